@@ -12,6 +12,15 @@
 #include "conntrack.h"
 #include "netlink.h"
 #include "forwarding.h"
+#include "listener.h"
+#include "usercache.h"
+#include "nattable.h"
+#include "metrics.h"
+#include "negcache.h"
+#include "ratelimit.h"
+#include "broker.h"
+#include "health.h"
+#include "replica.h"
 
 #include <assert.h>
 #include <errno.h>
@@ -21,23 +30,30 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <setjmp.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <pwd.h>
 #include <grp.h>
 
 const static char * const PROGRAM_NAME = "aidentd";
 const static char * const VERSION_STRING = "1.0.2";
 
+/// The default `idle_timeout` for listening sockets passed by inetd/systemd.
+#define DEFAULT_IDLE_TIMEOUT 60
+
 /// Prints the usage to `stderr` and exits.
 NORETURN static void
 usage(void) {
     (void) fprintf(stderr,
         "%s %s - Copyright (c) 2018 Kimmo Kulovesi <https://arkku.com/>\n\n"
-        "Intended to be run by inetd; the query is done on stdin/stdout.\n\n"
+        "Intended to be run by inetd; the query is done on stdin/stdout,\n"
+        "unless run as a standalone daemon with the option -d.\n\n"
         "Options:\n"
         "  -i           IP validation: instead of matching only the ports\n"
         "               require the destination to have the same IP as the\n"
@@ -61,13 +77,56 @@ usage(void) {
         "  -f *         Respond with error NO-USER to non-forwarded queries.\n"
         "  -f ?         Respond with error HIDDEN-USER to non-forwarded queries.\n\n"
         "  -l           Local only (disable forwarding).\n"
-        "  -c path      Set path to conntrack executable (needed for forwarding).\n"
+        "  -c path      Set path to conntrack executable (forwarding fallback).\n"
         "               (The default is \"%s\").\n"
+        "  -K           Keep connections to forwarding destinations open for\n"
+        "               further queries (daemon only).\n"
+        "  -H path      Share the health of forwarding destinations between\n"
+        "               processes in the file at path (the daemon shares it\n"
+        "               between its workers without this), so that failing\n"
+        "               destinations are not waited for by every query.\n\n",
+            PROGRAM_NAME, VERSION_STRING, PROGRAM_NAME, PROGRAM_NAME, conntrack_path
+    );
+    (void) fprintf(stderr,
+        "  -d           Run as a standalone daemon listening for connections\n"
+        "               (instead of being run by inetd).\n"
+        "  -p port      Port to listen on as a daemon (default %u).\n"
+        "  -L address   Address to listen on as a daemon (default all).\n"
+        "  -I seconds   Exit after no connections for this long (daemon, the\n"
+        "               default is %u for sockets passed by inetd or systemd).\n"
+        "  -U           Use io_uring instead of epoll for the daemon.\n"
+        "  -n workers   Number of worker processes for the daemon (default 1).\n"
+        "  -N           Pin each worker process to its own CPU.\n"
+        "  -m           Answer multiple queries per connection until EOF or\n"
+        "               until none arrives within the timeout.\n"
+        "  -W ms        Wait up to ms milliseconds to answer queries together\n"
+        "               with a single lookup of local connections (daemon).\n"
+        "  -S address   Serve metrics on the loopback port or Unix socket path\n"
+        "               (daemon only).\n"
+        "  -B path      Serve lookups for unprivileged instances (option -b)\n"
+        "               on the Unix socket path, instead of answering queries.\n"
+        "  -b path      Ask the lookup broker at path (option -B) to do the\n"
+        "               lookups, so that no privileges are needed.\n"
+        "  -R           Look up local and masqueraded connections concurrently.\n"
+        "  -E           Keep a table of masqueraded connections updated by\n"
+        "               connection tracking events (daemon only).\n"
+        "  -Y network   Accept replicas of the owners of connections from\n"
+        "               hosts behind NAT in network (e.g., 192.168.1.0/24,\n"
+        "               can be repeated), answering without forwarding\n"
+        "               (daemon only).\n"
+        "  -P address   Push replicas of the owners of connections from this\n"
+        "               host to the router at address (daemon only).\n"
+        "  -y port      Port for replicas (default %u).\n"
+        "  -z seconds   Answer queries that recently matched no connection\n"
+        "               from cache for this long (daemon, default 2, 0 = off).\n"
+        "  -r rate[/burst]  Limit each client (IPv6 /64) to rate queries per\n"
+        "               second, with bursts of up to burst (daemon only).\n\n"
+        "  -T           Log the time taken by each phase of every query.\n"
         "  -v           Increase logging verbosity (can be repeated for more).\n"
         "  -q           Decrease logging verbosity (can be repeated for more).\n"
         "  -e           Output log to stderr instead of syslog. Debugging only;\n"
         "               this may be sent by inetd to the remote!\n",
-            PROGRAM_NAME, VERSION_STRING, PROGRAM_NAME, PROGRAM_NAME, conntrack_path
+            listen_port, DEFAULT_IDLE_TIMEOUT, replica_port
     );
     (void) fputc('\n', stderr);
     exit(EXIT_SUCCESS);
@@ -97,9 +156,11 @@ handle_alarm(int sig) {
     siglongjmp(timeout_jump, sig);
 }
 
-/// Start the timer for `seconds`.
-static int
-timeout(const unsigned seconds) {
+/// Start the timer for `seconds`. This must be called only after
+/// `timeout_jump` has been set with `sigsetjmp` in the calling function,
+/// since the timeout jumps back there.
+static void
+start_timeout(const unsigned seconds) {
     struct sigaction sa = { .sa_flags = SA_RESETHAND };
     sa.sa_handler = (handle_alarm);
 
@@ -107,12 +168,16 @@ timeout(const unsigned seconds) {
         warning("sigaction");
     }
 
-    if (sigsetjmp(timeout_jump, 1) == 0) {
-        (void) alarm(seconds);
-        return 0;
-    } else {
-        return 1;
+    (void) alarm(seconds);
+}
+
+time_t
+monotonic_time(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+        error("clock_gettime");
     }
+    return ts.tv_sec;
 }
 
 void
@@ -121,26 +186,149 @@ cancel_timeout(void) {
     (void) signal(SIGALRM, SIG_IGN);
 }
 
-void
-block_timeout(void) {
+/// The nesting depth of `block_timeout` (including the lookup itself while
+/// its timeout is deferred by `start_lookup_timeout`).
+static unsigned timeout_blocks = 0;
+
+/// Is the timeout deferred to the blocking calls marked by `allow_timeout`?
+static bool timeout_deferred = false;
+
+/// Change the signal mask of the timeout alarm with `how` (of `sigprocmask`).
+static void
+mask_timeout(const int how) {
     sigset_t set;
     (void) sigemptyset(&set);
     (void) sigaddset(&set, SIGALRM);
-    if (sigprocmask(SIG_BLOCK, &set, NULL) < 0) {
-        warning("sigprocmask (block)");
+    if (sigprocmask(how, &set, NULL) < 0) {
+        warning(how == SIG_BLOCK ? "sigprocmask (block)" : "sigprocmask (unblock)");
+    }
+}
+
+void
+block_timeout(void) {
+    if (timeout_blocks++ == 0) {
+        mask_timeout(SIG_BLOCK);
     }
 }
 
 void
 unblock_timeout(void) {
-    sigset_t set;
-    (void) sigemptyset(&set);
-    (void) sigaddset(&set, SIGALRM);
-    if (sigprocmask(SIG_UNBLOCK, &set, NULL) < 0) {
-        warning("sigprocmask (unblock)");
+    if (timeout_blocks && --timeout_blocks == 0) {
+        mask_timeout(SIG_UNBLOCK);
+    }
+}
+
+void
+allow_timeout(void) {
+    if (timeout_deferred && timeout_blocks == 1) {
+        mask_timeout(SIG_UNBLOCK);
     }
 }
 
+void
+disallow_timeout(void) {
+    if (timeout_deferred && timeout_blocks == 1) {
+        mask_timeout(SIG_BLOCK);
+    }
+}
+
+/// Start the timer for `seconds` for a lookup, like `start_timeout`, but
+/// defer the timeout to the blocking calls marked by `allow_timeout`. The
+/// lookups call functions that are not async-signal-safe (e.g., `malloc`,
+/// `syslog`, and `getpwuid`), and jumping out of one of them could leave a
+/// lock held, deadlocking the daemon on its next query.
+static void
+start_lookup_timeout(const unsigned seconds) {
+    block_timeout();
+    timeout_deferred = true;
+    start_timeout(seconds);
+}
+
+/// End the timeout started by `start_lookup_timeout`, whether it occurred
+/// or not.
+static void
+end_lookup_timeout(void) {
+    cancel_timeout();
+    timeout_deferred = false;
+    timeout_blocks = 0;
+    mask_timeout(SIG_UNBLOCK);
+}
+
+#define TRACE_MAX_PHASES 24
+
+bool trace_queries = false;
+
+/// The phases of the query being traced.
+static struct {
+    bool active;
+    int count;
+    long long start;
+    long long previous;
+    unsigned local_port;
+    unsigned remote_port;
+    struct {
+        const char *name;
+        long long elapsed;
+    } phases[TRACE_MAX_PHASES];
+} trace = { .active = false };
+
+/// Returns the current monotonic time in microseconds.
+static long long
+monotonic_microseconds(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+        return 0;
+    }
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+trace_begin(void) {
+    if (!trace_queries) {
+        return;
+    }
+    trace.active = true;
+    trace.count = 0;
+    trace.local_port = 0;
+    trace.remote_port = 0;
+    trace.start = trace.previous = monotonic_microseconds();
+}
+
+void
+trace_phase(const char * const name) {
+    if (!trace.active || trace.count >= TRACE_MAX_PHASES) {
+        return;
+    }
+    const long long now = monotonic_microseconds();
+    trace.phases[trace.count].name = name;
+    trace.phases[trace.count].elapsed = now - trace.previous;
+    ++trace.count;
+    trace.previous = now;
+}
+
+void
+trace_end(void) {
+    if (!trace.active) {
+        return;
+    }
+    trace.active = false;
+
+    char line[TRACE_MAX_PHASES * 32];
+    size_t length = 0;
+    for (int i = 0; i < trace.count && length < sizeof line; ++i) {
+        const int written = snprintf(line + length, sizeof line - length, " %s=%lld",
+                                     trace.phases[i].name, trace.phases[i].elapsed);
+        if (written < 0) {
+            break;
+        }
+        length += (size_t) written;
+    }
+    line[length < sizeof line ? length : sizeof line - 1] = '\0';
+
+    notice("Trace (%u, %u):%s total=%lld us", trace.local_port, trace.remote_port, line,
+           trace.previous - trace.start);
+}
+
 /// Read a single port from `p`, simply ignoring any non-digits.
 /// If no digits are found, or the resulting value is not in the
 /// range 1..65535, returns `0`.
@@ -157,21 +345,14 @@ read_port(const char *p, char **endptr) {
     return (unsigned) result;
 }
 
-/// Reads an ident query from `input` to `query`.
-/// Returns `true` on success, `false` on failure.
+/// Parses an ident query from the line `buf` to `query`. The contents
+/// of `buf` may be modified. Returns `true` on success, `false` on failure.
 static bool
-read_query(FILE * const input, ident_query *query, bool * got_address) {
-    char buf[1004]; // RFC1413: 1000 characters maximum without EOL
-
+parse_query(char * const buf, ident_query *query, bool * got_address) {
     if (got_address) {
         *got_address = false;
     }
 
-    if (!fgets(buf, sizeof buf, input)) {
-        warning("Reading query failed");
-        return query;
-    }
-
     char *p = buf;
     if ((query->local_port = read_port(buf, &p)) == 0) {
         debug("Malformed query: could not read local port.");
@@ -218,12 +399,10 @@ read_query(FILE * const input, ident_query *query, bool * got_address) {
         }
     }
 
-    if (!inet_ntop(af, sockaddr, buf, sizeof ip_address)) {
+    if (!inet_ntop(af, sockaddr, ip_address, sizeof ip_address)) {
         return true;
     }
 
-    (void) strcpy(ip_address, buf);
-
     query->address_family = af;
     query->socket_address = sockaddr;
     query->ip_address = ip_address;
@@ -236,27 +415,318 @@ read_query(FILE * const input, ident_query *query, bool * got_address) {
 }
 
 int query_fd = -1;
+int race_fd = -1;
 FILE *query_pipe = NULL;
 
+/// Timeout for the lookup and for reading and writing in seconds.
+static unsigned timeout_seconds = 5;
+
+/// Is forwarding to masqueraded hosts enabled?
+static bool forwarding_enabled = true;
+
+/// Does the IP address of the connection have to match the peer?
+static bool validate_ip = false;
+
+/// Accept the original IP address in incoming queries (option `-a`)?
+static bool accept_ip_in_query = false;
+
+/// Send the original IP address in forwarded queries (option `-A`)?
+static bool forward_original_ip = false;
+
+/// The fixed response to local queries (option `-f`), or `NULL`.
+static const char *fixed_local_result = NULL;
+
+/// Sets the address of `query` to that of `peer` (if IP validation is
+/// enabled), and the textual representation of the address in `ip_address`.
+static void
+set_peer_address(ident_query * const query, const struct sockaddr_storage * const peer,
+                 char ip_address[INET6_ADDRSTRLEN]) {
+    const void *sockaddr = NULL;
+
+    if (peer->ss_family == AF_INET) {
+        sockaddr = &(((const struct sockaddr_in *) peer)->sin_addr);
+        query->address_family = AF_INET;
+    } else if (peer->ss_family == AF_INET6) {
+        sockaddr = &(((const struct sockaddr_in6 *) peer)->sin6_addr);
+        query->address_family = AF_INET6;
+    } else if (peer->ss_family != AF_UNSPEC) {
+        notice("Unknown address family %u", (unsigned) peer->ss_family);
+    }
+
+    if (sockaddr) {
+        query->peer_address = sockaddr;
+        query->peer_address_family = peer->ss_family;
+
+        if (inet_ntop(peer->ss_family, sockaddr, ip_address, INET6_ADDRSTRLEN)) {
+            if (validate_ip) {
+                query->socket_address = (void *) sockaddr;
+                query->address_family = peer->ss_family;
+                query->ip_address = ip_address;
+            }
+        } else {
+            warning("inet_ntop");
+        }
+    } else {
+        query->ip_in_query_extension = false;
+    }
+}
+
+/// Sets the local address of `query` to `local`.
+static void
+set_local_address(ident_query * const query, const struct sockaddr_storage * const local) {
+    if (local->ss_family == AF_INET) {
+        query->local_address = &(((const struct sockaddr_in *) local)->sin_addr);
+        query->local_address_family = AF_INET;
+    } else if (local->ss_family == AF_INET6) {
+        query->local_address = &(((const struct sockaddr_in6 *) local)->sin6_addr);
+        query->local_address_family = AF_INET6;
+    }
+}
+
+void
+prepare_queries(char * const lines[], const int count) {
+    if (fixed_local_result || broker_path || count < 1) {
+        // No local lookups (in this process)
+        return;
+    }
+
+    unsigned local_ports[count];
+    unsigned remote_ports[count];
+
+    for (int i = 0; i < count; ++i) {
+        char line[QUERY_MAX_LENGTH];
+        ident_query query = { .local_port = 0, .remote_port = 0 };
+
+        (void) snprintf(line, sizeof line, "%s", lines[i]);
+        if (!parse_query(line, &query, NULL)) {
+            query.local_port = 0;
+            query.remote_port = 0;
+        }
+        local_ports[i] = query.local_port;
+        remote_ports[i] = query.remote_port;
+    }
+
+    netlink_prefetch(local_ports, remote_ports, count);
+}
+
+void
+end_prepared_queries(void) {
+    netlink_end_prefetch();
+}
+
+/// Clean up the resources of a lookup that may have been left due to timeout.
+static void
+clean_up_lookup(void) {
+    if (query_fd >= 0) {
+        (void) close(query_fd);
+        query_fd = -1;
+    }
+    if (race_fd >= 0) {
+        (void) close(race_fd);
+        race_fd = -1;
+    }
+    close_query_pipe(true);
+}
+
+bool
+run_with_timeout(void (*function)(void *), void * const arg) {
+    bool timed_out = false;
+
+    if (sigsetjmp(timeout_jump, 1)) {
+        metric_count(METRIC_TIMEOUTS);
+        timed_out = true;
+        clean_up_forwarding();
+    } else {
+        start_lookup_timeout(timeout_seconds);
+        function(arg);
+    }
+    end_lookup_timeout();
+    clean_up_lookup();
+
+    return !timed_out;
+}
+
 int
-main(int argc, char *argv[]) {
-    ident_query query = { .local_port = 0, .remote_port = 0 };
+answer_query(char * const line, const struct sockaddr_storage * const peer,
+             const struct sockaddr_storage * const local,
+             char * const response, const size_t response_size) {
+    ident_query query = {
+        .local_port = 0, .remote_port = 0,
+        .ip_in_query_extension = accept_ip_in_query
+    };
+    char ip_address[INET6_ADDRSTRLEN] = { '\0' };
+    char * volatile found_result = NULL;
+    const char *error_result = "NO-USER";
+    const char *cache_address = ip_address;
+    bool timed_out = false;
+    int length = -1;
+
+    forwarding_attempted = false;
+    forwarding_skipped = false;
+    broker_failed = false;
+    metric_count(METRIC_QUERIES);
+
+    set_peer_address(&query, peer, ip_address);
+    set_local_address(&query, local);
+
+    if (!rate_limit_allow(peer)) {
+        debug("Rate limit exceeded by %s", *ip_address ? ip_address : "client");
+        metric_count(METRIC_RATE_LIMITED);
+        trace_phase("rate_limit");
+        goto clean_up;
+    }
+
+    // Parse the query
+
+    {
+        bool got_address = false;
+
+        if (!parse_query(line, &query, &got_address)) {
+            notice("Invalid query from %s", *ip_address ? ip_address : "client");
+            metric_count(METRIC_INVALID_QUERIES);
+            error_result = "INVALID-PORT";
+            trace_phase("parse");
+            goto send_response;
+        }
+        trace.local_port = query.local_port;
+        trace.remote_port = query.remote_port;
+        trace_phase("parse");
+
+        notice("Ident query from %s: our port %u to remote port %u%s%s%s",
+               *ip_address ? ip_address : "client",
+               query.local_port, query.remote_port,
+               got_address ? " (forwarded from " : "",
+               got_address ? query.ip_address : "",
+               got_address ? ")" : "");
+
+        if (got_address) {
+            cache_address = query.ip_address;
+        }
+    }
+
+    // Try to resolve the query
+
+    query.ip_in_query_extension = forward_original_ip;
+
+    if (negative_cache_lookup(cache_address, query.local_port, query.remote_port)) {
+        metric_count(METRIC_NEGATIVE_CACHE_HITS);
+        trace_phase("negative_cache");
+        goto send_response;
+    }
+
+    if (sigsetjmp(timeout_jump, 1)) {
+        notice("Query timed out (%u, %u)!", query.local_port, query.remote_port);
+        metric_count(METRIC_TIMEOUTS);
+        trace_phase("timeout");
+        timed_out = true;
+        clean_up_forwarding();
+        error_result = "UNKNOWN-ERROR";
+    } else {
+        start_lookup_timeout(timeout_seconds);
+
+        const bool race = race_lookups && forwarding_enabled && !fixed_local_result;
+
+        if (broker_path) {
+            found_result = broker_lookup(&query, !fixed_local_result, forwarding_enabled);
+        } else if (race) {
+            found_result = race_lookup(&query);
+        } else if (!fixed_local_result) {
+            const long long start = metric_stage_start();
+            found_result = netlink(&query);
+            metric_stage_done(STAGE_NETLINK, start, NULL);
+            trace_phase("netlink");
+            if (found_result) {
+                metric_count(METRIC_NETLINK_HITS);
+            }
+        }
+
+        if (!(found_result || race || broker_path) && forwarding_enabled) {
+            found_result = conntrack(&query);
+        }
+    }
+    end_lookup_timeout();
+    clean_up_lookup();
+
+    if (broker_failed && !found_result) {
+        error_result = "UNKNOWN-ERROR";
+    } else if (!timed_out) {
+        negative_cache_update(cache_address, query.local_port, query.remote_port,
+                              found_result || forwarding_attempted || forwarding_skipped);
+    }
 
+    // Format the response
+
+send_response:
+    if (!(found_result || forwarding_attempted) && fixed_local_result) {
+        switch (*fixed_local_result) {
+        case '\0':
+        case '*':
+            break;
+        case '!':
+            debug("Quitting without any result (option -f '%s').", fixed_local_result);
+            goto clean_up;
+        case '?':
+            error_result = "HIDDEN-USER";
+            break;
+        default:
+            found_result = strdup(fixed_local_result);
+            break;
+        }
+    }
+
+    metric_response(found_result ? "USERID" : (additional_info ? additional_info : error_result));
+
+    if (found_result) {
+        length = snprintf(response, response_size, "%u,%u:USERID:%s:%s\r\n",
+                          query.local_port, query.remote_port,
+                          additional_info ? additional_info : "UNIX",
+                          found_result);
+    } else {
+        length = snprintf(response, response_size, "%u,%u:ERROR:%s\r\n",
+                          query.local_port, query.remote_port,
+                          additional_info ? additional_info : error_result);
+    }
+
+    if (length < 0) {
+        error("snprintf response");
+    } else if ((size_t) length >= response_size) {
+        // Truncated, but still terminate the line
+        length = (int) response_size - 1;
+        response[length - 2] = '\r';
+        response[length - 1] = '\n';
+    }
+
+    // Clean up
+
+clean_up:
+    clean_up_forwarding();
+    if (found_result) {
+        free(found_result);
+        found_result = NULL;
+    }
+
+    return length;
+}
+
+int
+main(int argc, char *argv[]) {
     uid_t run_as_user = geteuid();
     gid_t run_as_group = getegid();
-    unsigned timeout_seconds = 5;
-    bool forwarding_enabled = true;
-    bool validate_ip = false;
     bool keep_privileges = false;
     bool use_syslog = true;
-    bool forward_original_ip = false;
-
-    static char ip_address[INET6_ADDRSTRLEN] = { '\0' };
-    struct sockaddr_storage peer;
-
-    const char *fixed_local_result = NULL;
-    char * volatile found_result = NULL;
-    const char *error_result = "NO-USER";
+    bool run_as_daemon = false;
+    bool use_nat_table = false;
+    bool keep_connections = false;
+    const char *metrics_address = NULL;
+    const char *serve_broker_path = NULL;
+    const char *health_path = NULL;
+    const char *push_address = NULL;
+    const char *replica_networks[REPLICA_NETWORKS];
+    int replica_network_count = 0;
+    bool idle_timeout_set = false;
+    unsigned negative_cache_ttl = 2;
+    unsigned rate_limit = 0;
+    unsigned rate_limit_burst = 0;
 
     if (run_as_user == 0) {
         // If run as root, change uid/gid by default ("-u 0 -g 0" to keep)
@@ -356,7 +826,7 @@ main(int argc, char *argv[]) {
                 }
                 break;
             case 'a': // accept IP from query
-                query.ip_in_query_extension = true;
+                accept_ip_in_query = true;
                 break;
             case 'A': // forward IP in query
                 forward_original_ip = true;
@@ -374,6 +844,181 @@ main(int argc, char *argv[]) {
                     ++insufficient_values;
                 }
                 break;
+            case 'W': // batch window
+                if (--argc > 0) {
+                    int milliseconds = atoi(*(++argv));
+                    if (milliseconds >= 0 && milliseconds <= 1000) {
+                        batch_window = (unsigned) milliseconds;
+                    } else {
+                        errno = EINVAL;
+                        error(*argv);
+                    }
+                } else {
+                    ++insufficient_values;
+                }
+                break;
+            case 'n': // number of workers
+                if (--argc > 0) {
+                    int workers = atoi(*(++argv));
+                    if (workers > 0 && workers <= MAX_WORKERS) {
+                        worker_count = (unsigned) workers;
+                    } else {
+                        errno = EINVAL;
+                        error(*argv);
+                    }
+                } else {
+                    ++insufficient_values;
+                }
+                break;
+            case 'U': // io_uring
+                use_io_uring = true;
+                break;
+            case 'N': // pin workers to CPUs
+                pin_workers = true;
+                break;
+            case 'm': // multiple queries per connection
+                multiple_queries = true;
+                break;
+            case 'K': // keep forwarding connections
+                keep_connections = true;
+                break;
+            case 'd': // standalone daemon
+                run_as_daemon = true;
+                break;
+            case 'p': // listen port
+                if (--argc > 0) {
+                    int port = atoi(*(++argv));
+                    if (port > 0 && port <= 65535) {
+                        listen_port = (unsigned) port;
+                    } else {
+                        errno = EINVAL;
+                        error(*argv);
+                    }
+                } else {
+                    ++insufficient_values;
+                }
+                break;
+            case 'L': // listen address
+                if (--argc > 0) {
+                    listen_address = *(++argv);
+                } else {
+                    ++insufficient_values;
+                }
+                break;
+            case 'S': // metrics
+                if (--argc > 0) {
+                    metrics_address = *(++argv);
+                } else {
+                    ++insufficient_values;
+                }
+                break;
+            case 'z': // negative cache
+                if (--argc > 0) {
+                    int seconds = atoi(*(++argv));
+                    if (seconds >= 0 && seconds <= 3600) {
+                        negative_cache_ttl = (unsigned) seconds;
+                    } else {
+                        errno = EINVAL;
+                        error(*argv);
+                    }
+                } else {
+                    ++insufficient_values;
+                }
+                break;
+            case 'r': // rate limit
+                if (--argc > 0) {
+                    char *end;
+                    const unsigned long rate = strtoul(*(++argv), &end, 10);
+                    unsigned long burst = rate;
+                    if (*end == '/') {
+                        burst = strtoul(end + 1, &end, 10);
+                    }
+                    if (*end == '\0' && rate <= 100000 && burst <= 100000) {
+                        rate_limit = (unsigned) rate;
+                        rate_limit_burst = (unsigned) burst;
+                    } else {
+                        errno = EINVAL;
+                        error(*argv);
+                    }
+                } else {
+                    ++insufficient_values;
+                }
+                break;
+            case 'B': // serve lookups as broker
+                if (--argc > 0) {
+                    serve_broker_path = *(++argv);
+                } else {
+                    ++insufficient_values;
+                }
+                break;
+            case 'H': // health of forwarding destinations
+                if (--argc > 0) {
+                    health_path = *(++argv);
+                } else {
+                    ++insufficient_values;
+                }
+                break;
+            case 'b': // broker for lookups
+                if (--argc > 0) {
+                    broker_path = *(++argv);
+                } else {
+                    ++insufficient_values;
+                }
+                break;
+            case 'I': // idle timeout
+                if (--argc > 0) {
+                    int seconds = atoi(*(++argv));
+                    if (seconds >= 0) {
+                        idle_timeout = (unsigned) seconds;
+                        idle_timeout_set = true;
+                    } else {
+                        errno = EINVAL;
+                        error(*argv);
+                    }
+                } else {
+                    ++insufficient_values;
+                }
+                break;
+            case 'Y': // accept replicas
+                if (--argc > 0) {
+                    if (replica_network_count >= REPLICA_NETWORKS) {
+                        errno = E2BIG;
+                        error(*(++argv));
+                    }
+                    replica_networks[replica_network_count++] = *(++argv);
+                } else {
+                    ++insufficient_values;
+                }
+                break;
+            case 'P': // push replicas
+                if (--argc > 0) {
+                    push_address = *(++argv);
+                } else {
+                    ++insufficient_values;
+                }
+                break;
+            case 'y': // replica port
+                if (--argc > 0) {
+                    int port = atoi(*(++argv));
+                    if (port > 0 && port <= 65535) {
+                        replica_port = (unsigned) port;
+                    } else {
+                        errno = EINVAL;
+                        error(*argv);
+                    }
+                } else {
+                    ++insufficient_values;
+                }
+                break;
+            case 'R': // race lookups
+                race_lookups = true;
+                break;
+            case 'E': // NAT table from events
+                use_nat_table = true;
+                break;
+            case 'T': // trace queries
+                trace_queries = true;
+                break;
             case 'v': // verbose
                 ++verbosity;
                 break;
@@ -405,17 +1050,98 @@ main(int argc, char *argv[]) {
     }
 
     open_log(PROGRAM_NAME, use_syslog);
+    trace_begin();
+
+    if (serve_broker_path) {
+        // Serving lookups for others, the options for answering do not apply
+        broker_path = NULL;
+        run_as_daemon = false;
+        open_broker(serve_broker_path, run_as_group);
+    }
+
+    bool inherited_listeners = false;
+    if (!serve_broker_path && inherit_listeners()) {
+        // Started by a service manager with the listening socket(s)
+        inherited_listeners = true;
+        run_as_daemon = true;
+        if (!idle_timeout_set) {
+            idle_timeout = DEFAULT_IDLE_TIMEOUT;
+        }
+    }
+
+    if (run_as_daemon) {
+        if ((replica_network_count || push_address) && worker_count > 1) {
+            // The replicas are kept by (or pushed from) a single process
+            notice("Replication uses a single worker process");
+            worker_count = 1;
+        }
+
+        // Bind the (privileged) port before dropping privileges
+        if (!inherited_listeners) {
+            open_listeners();
+        }
+
+        if (metrics_address && !enable_metrics(metrics_address)) {
+            notice("Metrics disabled");
+        }
+        if (replica_network_count && forwarding_enabled
+            && !enable_replica_server(replica_networks, replica_network_count)) {
+            notice("Replicas not accepted");
+        }
+        if (push_address && !enable_replica_push(push_address, fixed_local_result)) {
+            notice("Replicas not pushed");
+        }
+    }
+
+    if (forwarding_enabled && !serve_broker_path && (health_path || run_as_daemon)) {
+        // Open the file (or shared memory for the workers) while privileged
+        if (!enable_health(health_path)) {
+            notice("Health of forwarding destinations not tracked");
+        }
+    }
 
     // Drop privileges
 
+    if (broker_path && geteuid() != 0) {
+        // The broker does the privileged lookups, there is nothing to drop
+        keep_privileges = true;
+    }
+
     if (!keep_privileges) {
-        minimal_privileges_as(run_as_user, run_as_group, forwarding_enabled);
+        minimal_privileges_as(run_as_user, run_as_group, forwarding_enabled && !broker_path);
+        trace_phase("privileges");
+    }
+
+    if (serve_broker_path) {
+        (void) enable_async_log();
+        enable_user_cache();
+        if (use_nat_table && forwarding_enabled && !enable_nat_table()) {
+            notice("NAT table disabled, looking up connections directly");
+        }
+        serve_connections();
+    }
+
+    if (run_as_daemon) {
+        start_workers();
+        if (metrics_address && !serve_metrics()) {
+            notice("Metrics not served");
+        }
+        (void) enable_async_log();
+        enable_user_cache();
+        enable_negative_cache(negative_cache_ttl);
+        enable_rate_limit(rate_limit, rate_limit_burst);
+        keep_forward_connections = keep_connections;
+        if (use_nat_table && forwarding_enabled && !enable_nat_table()) {
+            notice("NAT table disabled, looking up connections directly");
+        }
+        connection_timeout = timeout_seconds;
+        serve_connections();
     }
 
     // Obtain peer IP
 
+    struct sockaddr_storage peer = { .ss_family = AF_UNSPEC };
     {
-        void *sockaddr = NULL;
         socklen_t peersize = sizeof peer;
 
         if (getpeername(STDIN_FILENO, (struct sockaddr *) &peer, &peersize) < 0) {
@@ -426,127 +1152,89 @@ main(int argc, char *argv[]) {
                       "getpeername failed (not run from inetd?)",
                       strerror(errno));
             }
-        } else if (peer.ss_family == AF_INET) {
-            sockaddr = &(((struct sockaddr_in *) &peer)->sin_addr);
-            query.address_family = AF_INET;
-        } else if (peer.ss_family == AF_INET6) {
-            sockaddr = &(((struct sockaddr_in6 *) &peer)->sin6_addr);
-            query.address_family = AF_INET6;
-        } else {
-            notice("Unknown address family %u", (unsigned) peer.ss_family);
-        }
-        if (sockaddr) {
-            if (inet_ntop(peer.ss_family, sockaddr, ip_address, sizeof ip_address)) {
-                if (validate_ip) {
-                    query.socket_address = sockaddr;
-                    query.address_family = peer.ss_family;
-                    query.ip_address = ip_address;
-                }
-            } else {
-                warning("inet_ntop");
-            }
-        } else {
-            query.ip_in_query_extension = false;
+            peer.ss_family = AF_UNSPEC;
         }
     }
 
-    // Read the query
+    // Obtain our IP (for exact lookups)
 
-    {
-        bool got_address = false;
+    struct sockaddr_storage local = { .ss_family = AF_UNSPEC };
+    if (peer.ss_family != AF_UNSPEC) {
+        socklen_t localsize = sizeof local;
 
-        if (timeout(timeout_seconds)) {
-            errno = ETIMEDOUT;
-            error("Reading query");
-        } else if (!read_query(stdin, &query, &got_address)) {
-            notice("Invalid query from %s", *ip_address ? ip_address : "client");
-            error_result = "INVALID-PORT";
-            goto send_response;
+        if (getsockname(STDIN_FILENO, (struct sockaddr *) &local, &localsize) < 0) {
+            debug("getsockname: %s", strerror(errno));
+            local.ss_family = AF_UNSPEC;
         }
-        cancel_timeout();
-
-        notice("Ident query from %s: our port %u to remote port %u%s%s%s",
-               *ip_address ? ip_address : "client",
-               query.local_port, query.remote_port,
-               got_address ? " (forwarded from " : "",
-               got_address ? query.ip_address : "",
-               got_address ? ")" : "");
     }
 
-    // Try to resolve the query
-
-    query.ip_in_query_extension = forward_original_ip;
+    trace_phase("getpeername");
 
-    if (timeout(timeout_seconds)) {
-        notice("Query timed out (%u, %u)!", query.local_port, query.remote_port);
-        clean_up_forwarding();
-        error_result = "UNKNOWN-ERROR";
-    } else {
-        if (!fixed_local_result) {
-            found_result = netlink(&query);
-        }
+    // Answer queries until EOF (or only the first one)
 
-        if (!found_result && forwarding_enabled) {
-            found_result = conntrack(&query);
-        }
-    }
-    cancel_timeout();
+    unsigned answered = 0;
+    do {
+        // Read the query
 
-    // Clean up resources that may have been left due to timeout
+        char line[QUERY_MAX_LENGTH];
 
-    if (query_fd >= 0) {
-        (void) close(query_fd);
-        query_fd = -1;
-    }
-    if (query_pipe) {
-        (void) pclose(query_pipe);
-        query_pipe = NULL;
-    }
+        if (answered) {
+            trace_begin();
+        }
 
-    // Send the response
+        if (sigsetjmp(timeout_jump, 1)) {
+            if (answered) {
+                cancel_timeout();
+                debug("Idle timeout after %u queries", answered);
+                break;
+            }
+            errno = ETIMEDOUT;
+            error("Reading query");
+        } else {
+            start_timeout(timeout_seconds);
+            if (!fgets(line, sizeof line, stdin)) {
+                if (answered) {
+                    cancel_timeout();
+                    break;
+                }
+                warning("Reading query failed");
+                line[0] = '\0';
+            } else if (multiple_queries && !strchr(line, '\n')) {
+                // Discard the rest of a line that is too long
+                int c;
+                while ((c = getchar()) != EOF && c != '\n');
+            }
+        }
+        cancel_timeout();
+        trace_phase("read");
 
-send_response:
-    if (!(found_result || forwarding_attempted) && fixed_local_result) {
-        switch (*fixed_local_result) {
-        case '\0':
-        case '*':
-            break;
-        case '!':
-            debug("Quitting without any result (option -f '%s').", fixed_local_result);
-            goto clean_up;
-        case '?':
-            error_result = "HIDDEN-USER";
-            break;
-        default:
-            found_result = strdup(fixed_local_result);
-            break;
+        if (answered && line[strspn(line, "\r\n")] == '\0') {
+            // Skip empty lines between queries
+            continue;
         }
-    }
 
-    if (timeout(timeout_seconds)) {
-        errno = ETIMEDOUT;
-        error("Writing response");
-    } else {
-        (void) printf("%u,%u:", query.local_port, query.remote_port);
+        // Resolve the query
 
-        if (found_result) {
-            (void) printf("USERID:%s:%s\r\n",
-                          additional_info ? additional_info : "UNIX",
-                          found_result);
-        } else {
-            (void) printf("ERROR:%s\r\n", additional_info ? additional_info : error_result);
-        }
-        (void) fflush(stdout);
-    }
+        char response[RESPONSE_MAX_LENGTH];
+        const int response_length = answer_query(line, &peer, &local, response, sizeof response);
+        ++answered;
 
-    // Clean up
+        // Send the response
 
-clean_up:
-    clean_up_forwarding();
-    if (found_result) {
-        free(found_result);
-        found_result = NULL;
-    }
+        if (response_length > 0) {
+            if (sigsetjmp(timeout_jump, 1)) {
+                errno = ETIMEDOUT;
+                error("Writing response");
+            } else {
+                start_timeout(timeout_seconds);
+                (void) fputs(response, stdout);
+                (void) fflush(stdout);
+            }
+            cancel_timeout();
+            trace_phase("write");
+        }
+        trace_end();
+    } while (multiple_queries);
 
     return EXIT_SUCCESS;
 }
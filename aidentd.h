@@ -26,6 +26,16 @@
 
 #include "log.h"
 #include <stdio.h>
+#include <time.h>
+#include <sys/socket.h>
+
+/// The size of buffer needed for a query line (RFC1413: 1000 characters
+/// maximum without EOL).
+#define QUERY_MAX_LENGTH 1004
+
+/// The size of buffer needed for a response line (ports, the reply type,
+/// and up to 512 characters each for the additional info and userid).
+#define RESPONSE_MAX_LENGTH 1056
 
 /// The arguments of the ident query.
 typedef struct ident_query {
@@ -35,20 +45,85 @@ typedef struct ident_query {
     void *socket_address;
     int address_family;
     _Bool ip_in_query_extension;
+    /// The address of the client that sent the query (even if not
+    /// validated), or `NULL` if unknown. Used as a hint for exact lookups.
+    const void *peer_address;
+    int peer_address_family;
+    /// Our address on the connection the query arrived on, or `NULL` if
+    /// unknown. Used as a hint for exact lookups.
+    const void *local_address;
+    int local_address_family;
 } ident_query;
 
+/// Answer the ident query in `line` from the client at `peer` to our
+/// address `local` (either of which may have the family `AF_UNSPEC` if
+/// unknown). The contents of `line` may be modified. The response is
+/// written to `response`, which must have room for `response_size` bytes.
+///
+/// Returns the length of the response, or -1 if no response is to be sent.
+int answer_query(char * const line, const struct sockaddr_storage * const peer,
+                 const struct sockaddr_storage * const local,
+                 char * const response, const size_t response_size);
+
+/// Prepare to answer the `count` ident queries in `lines` (as would be
+/// passed to `answer_query`) by looking up all of their local connections
+/// at once. The results are used by `answer_query` for these queries until
+/// `end_prepared_queries` is called.
+void prepare_queries(char * const lines[], const int count);
+
+/// Discard the results of `prepare_queries`.
+void end_prepared_queries(void);
+
+/// Returns the current monotonic time in seconds.
+time_t monotonic_time(void);
+
 /// Block the query timeout from occurring until `unblock_timeout` is called.
+/// The calls may be nested.
 void block_timeout(void);
 
 /// Unblock the query timeout after having been blocked by `block_timeout`.
 void unblock_timeout(void);
 
+/// Allow the query timeout to occur during the blocking system call that
+/// follows, until `disallow_timeout` is called. The timeout of a lookup
+/// (`answer_query` and `run_with_timeout`) is otherwise deferred, so every
+/// call that may block for long during a lookup must be marked with these.
+/// Only async-signal-safe calls may be made in between, since the timeout
+/// jumps out of them. Does nothing within `block_timeout`.
+void allow_timeout(void);
+
+/// Defer the query timeout again after `allow_timeout`.
+void disallow_timeout(void);
+
 /// Cancel the query timeout.
 void cancel_timeout(void);
 
+/// Call `function` with `arg` under the query timeout, like the lookups of
+/// `answer_query`, and clean up the resources of any lookup left behind by
+/// the timeout. Returns `false` if it timed out.
+_Bool run_with_timeout(void (*function)(void *), void * const arg);
+
+/// Trace the phases of each query (option `-T`)?
+extern _Bool trace_queries;
+
+/// Start tracing the phases of a query (if `trace_queries` is set).
+void trace_begin(void);
+
+/// Record the end of the phase `name` of the query being traced. The
+/// `name` must be a string constant.
+void trace_phase(const char * const name);
+
+/// Log the traced phases of the query as a single line, with the time
+/// taken by each phase in microseconds.
+void trace_end(void);
+
 /// A file descriptor for use by sub-queries. Will be closed on timeout.
 extern int query_fd;
 
+/// A second file descriptor for a sub-query done concurrently with the
+/// one using `query_fd`. Will be closed on timeout.
+extern int race_fd;
+
 /// A pipe handle for use by sub-queries. Will be closed on timeout.
 extern FILE *query_pipe;
 
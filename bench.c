@@ -0,0 +1,164 @@
+/*
+ * bench.c: Microbenchmarks for the per-query parsing and matching.
+ * aidentd
+ *
+ * The benchmarked functions are internal to their modules, so the modules
+ * are included here directly rather than linked. Run with `make bench`.
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#define main aidentd_main
+#include "aidentd.c"
+#undef main
+
+#include "netlink.c"
+#include "forwarding.c"
+#include "conntrack.c"
+
+#include <linux/inet_diag.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_SECONDS 0.25
+#define BENCH_CHUNK 1000
+#define BENCH_SOCKETS 1024
+
+/// Prevents the results of benchmarked calls from being optimized away.
+static volatile uintptr_t sink;
+
+/// Returns the current monotonic time in seconds.
+static double
+now_seconds(void) {
+    struct timespec now;
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+/// Run `function` with `arg` repeatedly for about `BENCH_SECONDS`, and
+/// report the time per call divided by `per_call` (e.g., the number of
+/// items processed by each call) as `name`.
+static void
+bench(const char * const name, void (*function)(const void *arg), const void * const arg,
+      const unsigned per_call) {
+    unsigned long iterations = 0;
+    const double start = now_seconds();
+    double elapsed;
+
+    do {
+        for (int i = 0; i < BENCH_CHUNK; ++i) {
+            function(arg);
+        }
+        iterations += BENCH_CHUNK;
+    } while ((elapsed = now_seconds() - start) < BENCH_SECONDS);
+
+    (void) printf("%-32s %10.1f ns/op\n", name,
+                  elapsed * 1e9 / (double) iterations / (double) per_call);
+}
+
+// parse_query
+
+static void
+bench_parse_query(const void * const arg) {
+    const char * const line = arg;
+    char buf[QUERY_MAX_LENGTH];
+    (void) strcpy(buf, line);
+    ident_query query = { .ip_in_query_extension = true };
+    bool got_address;
+    sink += parse_query(buf, &query, &got_address);
+    sink += (uintptr_t) query.ip_address;
+}
+
+// check_response
+
+/// Synthetic sock_diag responses for sockets of uid 0, with the last one
+/// matching `diag_query`.
+static struct inet_diag_msg diag_messages[BENCH_SOCKETS];
+
+static ident_query diag_query;
+
+static void
+init_diag_messages(void) {
+    for (int i = 0; i < BENCH_SOCKETS; ++i) {
+        struct inet_diag_msg * const msg = &diag_messages[i];
+        (void) memset(msg, 0, sizeof *msg);
+        msg->idiag_family = AF_INET;
+        msg->idiag_uid = 0;
+        msg->id.idiag_sport = htons(113);
+        msg->id.idiag_dport = htons((uint16_t) (10000 + i));
+        msg->id.idiag_src[0] = htonl(0xC0000201); // 192.0.2.1
+        msg->id.idiag_dst[0] = htonl(0xC6336407); // 198.51.100.7
+    }
+    diag_query.local_port = 113;
+    diag_query.remote_port = 10000 + BENCH_SOCKETS - 1;
+}
+
+static void
+bench_check_response(const void * const arg) {
+    (void) arg;
+    for (int i = 0; i < BENCH_SOCKETS; ++i) {
+        char * const username = check_response(&diag_messages[i], &diag_query);
+        if (username) {
+            sink += (uintptr_t) username[0];
+            free(username);
+        }
+    }
+}
+
+// parse_response
+
+static void
+bench_parse_response(const void * const arg) {
+    const char * const line = arg;
+    char buf[FORWARD_LINE_SIZE];
+    (void) strcpy(buf, line);
+    sink += (uintptr_t) parse_response(buf, "192.168.1.10");
+}
+
+// parse_conntrack_line
+
+static void
+bench_parse_conntrack_line(const void * const arg) {
+    const char * const line = arg;
+    char buf[512];
+    (void) strcpy(buf, line);
+    const ident_query query = { .local_port = 50000, .remote_port = 6667 };
+    conntrack_entry entry;
+    sink += parse_conntrack_line(buf, &query, &entry);
+}
+
+int
+main(void) {
+    verbosity = 0;
+    open_log("aidentd_bench", false);
+    enable_user_cache();
+    init_diag_messages();
+
+    bench("parse_query", bench_parse_query, "12345 , 6667\r\n", 1);
+    bench("parse_query (IPv4 address)", bench_parse_query, "12345, 6667 : 192.0.2.1\r\n", 1);
+    bench("parse_query (IPv6 address)", bench_parse_query, "12345, 6667 : 2001:db8::1\r\n", 1);
+
+    bench("check_response (per socket)", bench_check_response, NULL, BENCH_SOCKETS);
+
+    bench("parse_response (USERID)", bench_parse_response,
+          "40000 , 6667 : USERID : UNIX : someuser\r\n", 1);
+    bench("parse_response (ERROR)", bench_parse_response,
+          "40000 , 6667 : ERROR : NO-USER\r\n", 1);
+    bench("parse_response (re-sync)", bench_parse_response,
+          "40000 , 6667 : ERROR : USERID : UNIX : someuser\r\n", 1);
+
+    bench("parse_conntrack_line (match)", bench_parse_conntrack_line,
+          "tcp      6 431999 ESTABLISHED src=192.168.1.10 dst=198.51.100.7 "
+          "sport=40000 dport=6667 src=198.51.100.7 dst=203.0.113.1 "
+          "sport=6667 dport=50000 [ASSURED] mark=0 use=1\n", 1);
+    bench("parse_conntrack_line (no match)", bench_parse_conntrack_line,
+          "tcp      6 431999 ESTABLISHED src=192.168.1.11 dst=198.51.100.8 "
+          "sport=40001 dport=443 src=198.51.100.8 dst=203.0.113.1 "
+          "sport=443 dport=50001 [ASSURED] mark=0 use=1\n", 1);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,357 @@
+/*
+ * broker.c: A privileged process doing lookups for unprivileged ones.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#include "broker.h"
+#include "conntrack.h"
+#include "forwarding.h"
+#include "listener.h"
+#include "netlink.h"
+#include "metrics.h"
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BROKER_VERSION 3
+#define BROKER_USERNAME_SIZE 512
+
+const char *broker_path = NULL;
+
+bool broker_failed = false;
+
+/// The socket of the broker.
+static int broker_fd = -1;
+
+/// A lookup request to the broker: the `ident_query` with its addresses
+/// copied in place of the pointers. The textual `ip_address` of the query
+/// is not sent, but formatted from `socket_address` by the broker, since
+/// the request may come from any user in the group of the socket.
+typedef struct broker_request {
+    uint32_t version;
+    uint16_t local_port;
+    uint16_t remote_port;
+    int32_t address_family;
+    int32_t peer_address_family;
+    int32_t local_address_family;
+    uint8_t has_socket_address;
+    uint8_t ip_in_query_extension;
+    uint8_t local;
+    uint8_t masqueraded;
+    unsigned char socket_address[16];
+    unsigned char peer_address[16];
+    unsigned char local_address[16];
+} broker_request;
+
+/// The result of a lookup by the broker.
+enum broker_result {
+    BROKER_NO_MATCH = 0,
+    BROKER_LOCAL,
+    BROKER_MASQUERADED,
+    BROKER_ERROR
+};
+
+/// The response of the broker to a `broker_request`.
+typedef struct broker_response {
+    uint32_t version;
+    uint16_t local_port;
+    uint16_t remote_port;
+    int32_t result;
+    int32_t entry_count;
+    char username[BROKER_USERNAME_SIZE];
+    conntrack_entry entries[CONNTRACK_MAX_MATCHES];
+} broker_response;
+
+/// Returns the size of an address of `family`, or 0 if unknown.
+static size_t
+address_size(const int family) {
+    switch (family) {
+    case AF_INET:
+        return sizeof(struct in_addr);
+    case AF_INET6:
+        return sizeof(struct in6_addr);
+    default:
+        return 0;
+    }
+}
+
+/// Copy the `address` of `family` to `buf` (of 16 bytes). Returns the
+/// family, or `AF_UNSPEC` if there is no address to copy.
+static int
+copy_address(unsigned char buf[16], const void * const address, const int family) {
+    const size_t size = address_size(family);
+    if (!(address && size)) {
+        return AF_UNSPEC;
+    }
+    (void) memcpy(buf, address, size);
+    return family;
+}
+
+/// A request being answered by `answer_request`.
+typedef struct broker_lookup_state {
+    broker_request *req;
+    broker_response *resp;
+} broker_lookup_state;
+
+/// Answer the request `state->req` into `state->resp`.
+static void
+answer_request(void *arg) {
+    broker_request * const req = ((broker_lookup_state *) arg)->req;
+    broker_response * const resp = ((broker_lookup_state *) arg)->resp;
+    char ip_address[INET6_ADDRSTRLEN];
+
+    ident_query q = {
+        .local_port = req->local_port,
+        .remote_port = req->remote_port,
+        .address_family = req->address_family,
+        .ip_in_query_extension = req->ip_in_query_extension != 0
+    };
+    if (req->has_socket_address && address_size(req->address_family)
+        && inet_ntop(req->address_family, req->socket_address, ip_address, sizeof ip_address)) {
+        q.socket_address = req->socket_address;
+        q.ip_address = ip_address;
+    }
+    if (address_size(req->peer_address_family)) {
+        q.peer_address = req->peer_address;
+        q.peer_address_family = req->peer_address_family;
+    }
+    if (address_size(req->local_address_family)) {
+        q.local_address = req->local_address;
+        q.local_address_family = req->local_address_family;
+    }
+
+    if (!(q.local_port && q.remote_port)) {
+        return;
+    }
+
+    debug("BR lookup (%u, %u)%s%s", q.local_port, q.remote_port,
+          req->local ? " local" : "", req->masqueraded ? " masqueraded" : "");
+
+    if (req->local) {
+        char * const username = netlink(&q);
+        if (username) {
+            (void) strncpy(resp->username, username, sizeof(resp->username) - 1);
+            free(username);
+            resp->result = BROKER_LOCAL;
+            return;
+        }
+    }
+
+    if (req->masqueraded
+        && (resp->entry_count = conntrack_lookup(&q, resp->entries, CONNTRACK_MAX_MATCHES)) > 0) {
+        resp->result = BROKER_MASQUERADED;
+    }
+}
+
+/// Answer the requests waiting on `broker_fd`.
+static void
+handle_requests(void) {
+    for (;;) {
+        broker_request req;
+        struct sockaddr_un client;
+        socklen_t client_size = sizeof client;
+
+        const ssize_t length = recvfrom(broker_fd, &req, sizeof req, 0,
+                                        (struct sockaddr *) &client, &client_size);
+        if (length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                warning("BR recvfrom");
+            }
+            return;
+        }
+        if ((size_t) length != sizeof req || req.version != BROKER_VERSION) {
+            debug("BR ignoring invalid request of %ld bytes", (long) length);
+            continue;
+        }
+
+        broker_response resp;
+        (void) memset(&resp, 0, sizeof resp);
+        resp.version = BROKER_VERSION;
+        resp.local_port = req.local_port;
+        resp.remote_port = req.remote_port;
+        resp.result = BROKER_NO_MATCH;
+
+        broker_lookup_state state = { &req, &resp };
+        if (!run_with_timeout(answer_request, &state)) {
+            notice("Broker lookup timed out (%u, %u)!",
+                   (unsigned) req.local_port, (unsigned) req.remote_port);
+            resp.result = BROKER_ERROR;
+            resp.entry_count = 0;
+        }
+
+        if (sendto(broker_fd, &resp, sizeof resp, MSG_DONTWAIT,
+                   (struct sockaddr *) &client, client_size) < 0) {
+            warning("BR sendto");
+        }
+    }
+}
+
+void
+open_broker(const char * const path, const gid_t group) {
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof sa.sun_path) {
+        errno = ENAMETOOLONG;
+        error(path);
+    }
+    (void) strcpy(sa.sun_path, path);
+
+    if ((broker_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        error("socket (broker)");
+    }
+    (void) unlink(path);
+    if (bind(broker_fd, (struct sockaddr *) &sa, sizeof sa) < 0) {
+        error(path);
+    }
+    // The unprivileged processes in `group` need to be able to send requests
+    if (chown(path, (uid_t) -1, group) < 0 || chmod(path, 0660) < 0) {
+        warning(path);
+    }
+    if (!watch_input(broker_fd, handle_requests)) {
+        errno = EMFILE;
+        error("broker");
+    }
+
+    notice("Serving lookups at %s for group %u", path, (unsigned) group);
+}
+
+/// Close `query_fd`.
+static void
+close_broker_socket(void) {
+    block_timeout();
+    (void) close(query_fd);
+    query_fd = -1;
+    unblock_timeout();
+}
+
+/// Send `req` to the broker at `broker_path` and receive its response into
+/// `resp`. Returns `true` on success.
+static bool
+ask_broker(const broker_request * const req, broker_response * const resp) {
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    (void) strncpy(sa.sun_path, broker_path, sizeof(sa.sun_path) - 1);
+
+    if ((query_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+        warning("socket (broker)");
+        return false;
+    }
+
+    // Bind to an automatically assigned address for receiving the response
+    const struct sockaddr_un self = { .sun_family = AF_UNIX };
+    if (bind(query_fd, (const struct sockaddr *) &self, sizeof self.sun_family) < 0) {
+        warning("bind (broker)");
+        close_broker_socket();
+        return false;
+    }
+    if (connect(query_fd, (struct sockaddr *) &sa, sizeof sa) < 0) {
+        warning(broker_path);
+        close_broker_socket();
+        return false;
+    }
+
+    debug("BR sending request (%u, %u)", (unsigned) req->local_port, (unsigned) req->remote_port);
+    allow_timeout();
+    const ssize_t sent = send(query_fd, req, sizeof *req, 0);
+    disallow_timeout();
+    if (sent < 0) {
+        warning("send (broker)");
+        close_broker_socket();
+        return false;
+    }
+
+    bool received = false;
+    for (;;) {
+        allow_timeout();
+        const ssize_t length = recv(query_fd, resp, sizeof *resp, 0);
+        disallow_timeout();
+        if (length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            warning("recv (broker)");
+            break;
+        }
+        if ((size_t) length == sizeof *resp && resp->version == BROKER_VERSION
+            && resp->local_port == req->local_port && resp->remote_port == req->remote_port) {
+            received = true;
+            break;
+        }
+        debug("BR ignoring invalid response of %ld bytes", (long) length);
+    }
+
+    close_broker_socket();
+    return received;
+}
+
+char *
+broker_lookup(const ident_query * const query, const bool local, const bool masqueraded) {
+    broker_request req;
+    (void) memset(&req, 0, sizeof req);
+    req.version = BROKER_VERSION;
+    req.local_port = (uint16_t) query->local_port;
+    req.remote_port = (uint16_t) query->remote_port;
+    req.address_family = query->address_family;
+    req.has_socket_address = copy_address(req.socket_address, query->socket_address,
+                                          query->address_family) != AF_UNSPEC;
+    req.peer_address_family = copy_address(req.peer_address, query->peer_address,
+                                           query->peer_address_family);
+    req.local_address_family = copy_address(req.local_address, query->local_address,
+                                            query->local_address_family);
+    req.ip_in_query_extension = query->ip_in_query_extension;
+    req.local = local;
+    req.masqueraded = masqueraded;
+
+    forwarding_attempted = false;
+
+    broker_response resp;
+    const bool received = ask_broker(&req, &resp);
+    trace_phase("broker");
+    if (!received) {
+        broker_failed = true;
+        return NULL;
+    }
+
+    switch (resp.result) {
+    case BROKER_LOCAL: {
+            resp.username[sizeof(resp.username) - 1] = '\0';
+            char * const username = strdup(resp.username);
+            if (!username) {
+                error("strdup");
+            }
+            notice("Broker matched user %s (%u, %u)", username, query->local_port, query->remote_port);
+            metric_count(METRIC_NETLINK_HITS);
+            return username;
+        }
+    case BROKER_MASQUERADED:
+        if (resp.entry_count < 1 || resp.entry_count > CONNTRACK_MAX_MATCHES) {
+            return NULL;
+        }
+        for (int i = 0; i < resp.entry_count; ++i) {
+            conntrack_entry * const entry = &(resp.entries[i]);
+            entry->client[sizeof(entry->client) - 1] = '\0';
+            entry->source[sizeof(entry->source) - 1] = '\0';
+            entry->server[sizeof(entry->server) - 1] = '\0';
+        }
+        return forward_matches(query, resp.entries, resp.entry_count);
+    case BROKER_ERROR:
+        notice("Broker lookup failed (%u, %u)", query->local_port, query->remote_port);
+        broker_failed = true;
+        return NULL;
+    default:
+        return NULL;
+    }
+}
@@ -0,0 +1,42 @@
+/*
+ * broker.h: A privileged process doing lookups for unprivileged ones.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#ifndef AIDENTD_BROKER_H
+#define AIDENTD_BROKER_H
+
+#include "aidentd.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/// The path of the Unix socket of the broker to ask for lookups (option
+/// `-b`), or `NULL` to do the lookups in this process.
+extern const char *broker_path;
+
+/// Set by `broker_lookup` if the broker could not be asked, or it could not
+/// complete the lookup (e.g., it timed out).
+extern bool broker_failed;
+
+/// Open the Unix socket at `path` for serving lookups as the broker, and
+/// watch it in the event loop of `serve_connections` (`listener.h`). Any
+/// existing socket at `path` is replaced. Only the owner and `group` can
+/// send requests to the socket. Each request is looked up under the query
+/// timeout, and answered with an error if it expires. This needs to be done before
+/// dropping privileges if the directory of `path` is not writable by the
+/// user the broker runs as. The broker itself needs `CAP_NET_ADMIN` for
+/// looking up connection tracking. Exits on failure.
+void open_broker(const char * const path, const gid_t group);
+
+/// Look up `query` by asking the broker at `broker_path` over its socket,
+/// as a local connection if `local` and as a masqueraded connection if
+/// `masqueraded`. A masqueraded connection found by the broker is then
+/// forwarded by this process, so that only the lookups need privileges.
+/// Returns the username as `netlink` or `conntrack` would, or `NULL` if
+/// none (or the broker could not be reached). The socket is `query_fd`.
+char *broker_lookup(const ident_query * const query, const bool local, const bool masqueraded);
+
+#endif
@@ -6,7 +6,17 @@
  */
 
 #include "conntrack.h"
+#include "ctnetlink.h"
+#include "nattable.h"
 #include "forwarding.h"
+#include "metrics.h"
+#include "netlink.h"
+#include "replica.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include <errno.h>
 #include <stdbool.h>
@@ -14,14 +24,231 @@
 #include <stdlib.h>
 #include <string.h>
 
+#define CT_LINE_SIZE 512
+
 const char *conntrack_path = "/usr/sbin/conntrack";
 
-char *
-conntrack(const ident_query * const q) {
-    char buf[512];
-    int bufsize = sizeof buf;
+bool race_lookups = false;
 
-    forwarding_attempted = false;
+/// The process writing to `query_pipe`, or -1 if none.
+static pid_t query_pipe_pid = -1;
+
+/// The output received from `query_pipe` but not yet returned by
+/// `read_output_line`.
+static struct {
+    bool ended;
+    size_t length;
+    char buf[CT_LINE_SIZE];
+} output;
+
+/// Run `command` with the shell in a process group of its own, with its
+/// output read from `query_pipe`. Unlike with `popen`, the command can be
+/// killed by `close_query_pipe`. Returns `false` on error.
+static bool
+open_query_pipe(const char * const command) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        warning("pipe");
+        return false;
+    }
+
+    block_timeout();
+    const pid_t pid = fork();
+    if (pid == 0) {
+        (void) setpgid(0, 0);
+        sigset_t none;
+        (void) sigemptyset(&none);
+        (void) sigprocmask(SIG_SETMASK, &none, NULL);
+        if (dup2(fds[1], STDOUT_FILENO) < 0) {
+            _exit(127);
+        }
+        (void) close(fds[0]);
+        if (fds[1] != STDOUT_FILENO) {
+            (void) close(fds[1]);
+        }
+        (void) execl("/bin/sh", "sh", "-c", command, (char *) NULL);
+        _exit(127);
+    }
+    (void) close(fds[1]);
+    if (pid < 0) {
+        warning("fork");
+        (void) close(fds[0]);
+        unblock_timeout();
+        return false;
+    }
+    (void) setpgid(pid, pid);
+    query_pipe_pid = pid;
+    output.ended = false;
+    output.length = 0;
+    if (!(query_pipe = fdopen(fds[0], "r"))) {
+        warning("fdopen");
+        (void) close(fds[0]);
+    }
+    unblock_timeout();
+
+    if (!query_pipe) {
+        close_query_pipe(true);
+        return false;
+    }
+    return true;
+}
+
+void
+close_query_pipe(const bool terminate) {
+    block_timeout();
+    if (query_pipe) {
+        (void) fclose(query_pipe);
+        query_pipe = NULL;
+    }
+    if (query_pipe_pid > 0) {
+        if (terminate) {
+            (void) kill(-query_pipe_pid, SIGKILL);
+        }
+        while (waitpid(query_pipe_pid, NULL, 0) < 0 && errno == EINTR) {
+            continue;
+        }
+        query_pipe_pid = -1;
+    }
+    unblock_timeout();
+}
+
+/// Read the next line of output from `query_pipe` into `line` (of `size`
+/// bytes, at most `CT_LINE_SIZE`), waiting for it under the query timeout.
+/// Like `fgets`, a line too long for `line` is returned in parts. Returns
+/// `false` at the end of the output.
+static bool
+read_output_line(char * const line, const size_t size) {
+    const int fd = fileno(query_pipe);
+    for (;;) {
+        const char * const end = memchr(output.buf, '\n', output.length);
+        if (end || output.length >= size - 1 || (output.ended && output.length)) {
+            size_t length = end ? (size_t) (end - output.buf) + 1 : output.length;
+            if (length > size - 1) {
+                length = size - 1;
+            }
+            (void) memcpy(line, output.buf, length);
+            line[length] = '\0';
+            output.length -= length;
+            (void) memmove(output.buf, output.buf + length, output.length);
+            return true;
+        }
+        if (output.ended) {
+            return false;
+        }
+
+        allow_timeout();
+        const ssize_t received = read(fd, output.buf + output.length,
+                                      sizeof(output.buf) - output.length);
+        disallow_timeout();
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received < 0) {
+            warning("CT read");
+        }
+        if (received <= 0) {
+            output.ended = true;
+        } else {
+            output.length += (size_t) received;
+        }
+    }
+}
+
+/// Parse the line `line` of output from the conntrack program in place.
+/// Returns `true` and fills in `entry` if the connection matches `q`.
+static bool
+parse_conntrack_line(char * const line, const ident_query * const q, conntrack_entry * const entry) {
+    char * const lan_side = strstr(line, "src=");
+    if (!lan_side) {
+        debug("CT skipping: %s", line);
+        return false;
+    }
+    *(lan_side - 1) = '\0';
+
+    char * const nat_side = strstr(lan_side + 4, "src=");
+    if (!nat_side) {
+        debug("CT skipping: %s", line);
+        return false;
+    }
+    *(nat_side - 1) = '\0';
+
+    char *p;
+    const char *client = NULL;
+    const char *server = NULL;
+    const char *source = NULL;
+
+    p = strstr(lan_side, "sport=");
+    const unsigned client_port = p ? (unsigned) strtol(p + 6, NULL, 10) : 0;
+
+    p = strstr(nat_side, "sport=");
+    const unsigned server_port = p ? (unsigned) strtol(p + 6, NULL, 10) : 0;
+
+    p = strstr(nat_side, "dport=");
+    const unsigned router_port = p ? (unsigned) strtol(p + 6, NULL, 10) : 0;
+
+    p = strchr(lan_side + 4, ' ');
+    if (p) {
+        *p = '\0';
+        client = lan_side + 4;
+    }
+
+    p = strstr(nat_side, "dst=");
+    if (p) {
+        source = p + 4;
+        p = strchr(source, ' ');
+        if (p) {
+            *p = '\0';
+        }
+    }
+    p = strchr(nat_side + 4, ' ');
+    if (p) {
+        *p = '\0';
+        server = nat_side + 4;
+    }
+
+    bool match = client && source && q->remote_port == server_port && q->local_port == router_port;
+    if (match && strcmp(client, source) == 0) {
+        // Local connection, do not forward to ourselves
+        // (Normally matched in netlink, but it may be disabled.)
+        debug("CT found matching local connection");
+        match = false;
+    }
+
+    if (server && q->ip_address && strcmp(q->ip_address, server)) {
+        notice("%s returned a non-matching IP: %s expected %s",
+               conntrack_path, server, q->ip_address);
+        // In theory this should not happen, so it is safer to ignore
+        // the error here as it may be due to non-canonical IP
+        // representation. Logging as notice as it may indicate
+        // changes in conntrack behaviour and/or syntax.
+        //match = false;
+    }
+
+    debug("CT %s:%u -> %s:%u -> %s:%u (%s)",
+          server ? server : "", server_port,
+          source ? source : "", router_port,
+          client ? client : "", client_port,
+          match ? "FORWARD" : "no forward");
+
+    if (match) {
+        (void) snprintf(entry->client, sizeof entry->client, "%s", client);
+        (void) snprintf(entry->source, sizeof entry->source, "%s", source);
+        (void) snprintf(entry->server, sizeof entry->server, "%s", server ? server : "");
+        entry->client_port = client_port;
+        entry->router_port = router_port;
+        entry->server_port = server_port;
+    }
+
+    return match;
+}
+
+/// Look up the masqueraded connections matching `q` using the conntrack
+/// program at `conntrack_path`. Returns the number of matches filled in
+/// `entries` (up to `max`).
+static int
+conntrack_program(const ident_query * const q, conntrack_entry entries[], const int max) {
+    char buf[CT_LINE_SIZE];
+    int bufsize = sizeof buf;
 
     {
         int written = snprintf(buf, bufsize,
@@ -35,8 +262,12 @@ conntrack(const ident_query * const q) {
             error("CT command buffer");
         }
 
-        if (q->ip_address && q->ip_address[0]) {
-            int result = snprintf(buf + written, bufsize - written, " --reply-src=%s", q->ip_address);
+        // Format the address from its binary form for the shell command,
+        // rather than trust the textual `ip_address`
+        char address[INET6_ADDRSTRLEN];
+        if (q->socket_address
+            && inet_ntop(q->address_family, q->socket_address, address, sizeof address)) {
+            int result = snprintf(buf + written, bufsize - written, " --reply-src=%s", address);
             if (result < 0 || result >= (bufsize - written)) {
                 if (!errno) {
                     errno = ERANGE;
@@ -47,117 +278,214 @@ conntrack(const ident_query * const q) {
     }
 
     debug("CT command: %s", buf);
-    if (!(query_pipe = popen(buf, "r"))) {
-        warning(buf);
-        return NULL;
+    if (!open_query_pipe(buf)) {
+        return 0;
     }
+    trace_phase("conntrack_exec");
 
     debug("CT reading responses...");
 
-    bool match = false;
-    const char *client = NULL;
-    const char *server = NULL;
-    const char *source = NULL;
-    unsigned client_port = 0;
+    int count = 0;
 
-    while (!match && fgets(buf, bufsize, query_pipe)) {
-        char * const lan_side = strstr(buf, "src=");
-        if (!lan_side) {
-            debug("CT skipping: %s", buf);
-            continue;
+    bool first_line = true;
+    while (count < max && read_output_line(buf, sizeof buf)) {
+        if (first_line) {
+            trace_phase("conntrack_first_line");
+            first_line = false;
         }
-        *(lan_side - 1) = '\0';
-
-        char * const nat_side = strstr(lan_side + 4, "src=");
-        if (!nat_side) {
-            debug("CT skipping: %s", buf);
-            continue;
+        if (parse_conntrack_line(buf, q, &entries[count])) {
+            ++count;
         }
-        *(nat_side - 1) = '\0';
+    }
 
-        char *p;
-        client = NULL;
-        server = NULL;
-        source = NULL;
+    debug("CT closing");
 
-        p = strstr(lan_side, "sport=");
-        client_port = p ? (unsigned) strtol(p + 6, NULL, 10) : 0;
+    close_query_pipe(false);
+    trace_phase("conntrack_pclose");
 
-        p = strstr(nat_side, "sport=");
-        const unsigned server_port = p ? (unsigned) strtol(p + 6, NULL, 10) : 0;
+    return count;
+}
 
-        p = strstr(nat_side, "dport=");
-        const unsigned router_port = p ? (unsigned) strtol(p + 6, NULL, 10) : 0;
+char *
+forward_match(const ident_query * const q, const conntrack_entry * const entry) {
+    const char * const server = entry->server[0] ? entry->server : NULL;
 
-        p = strchr(lan_side + 4, ' ');
-        if (p) {
-            *p = '\0';
-            client = lan_side + 4;
-        }
+    notice("Matched connection from %s port %u to %s port %u, forwarding to %s as port %u",
+           entry->source[0] ? entry->source : "router", q->local_port,
+           server ? server : "server", q->remote_port,
+           entry->client, entry->client_port);
+    ident_query forwarded_query = {
+        .local_port = entry->client_port,
+        .remote_port = q->remote_port,
+    };
+    if (q->ip_in_query_extension && (server || q->ip_address)) {
+        forwarded_query.ip_in_query_extension = true;
+        forwarded_query.ip_address = server ? server : q->ip_address;
+    }
+    metric_count(METRIC_CONNTRACK_HITS);
+    metric_count(METRIC_FORWARDS);
 
-        p = strstr(nat_side, "dst=");
-        if (p) {
-            source = p + 4;
-            p = strchr(source, ' ');
-            if (p) {
-                *p = '\0';
-            }
-        }
-        p = strchr(nat_side + 4, ' ');
-        if (p) {
-            *p = '\0';
-            server = nat_side + 4;
-        }
+    const long long forward_start = metric_stage_start();
+    char * const result = forward_query(&forwarded_query, entry->client);
+    metric_stage_done(STAGE_FORWARD, forward_start, entry->client);
+    if (!result) {
+        metric_count(METRIC_FORWARD_FAILURES);
+    }
 
-        match = client && source && q->remote_port == server_port && q->local_port == router_port;
-        if (match && strcmp(client, source) == 0) {
-            // Local connection, do not forward to ourselves
-            // (Normally matched in netlink, but it may be disabled.)
-            debug("CT found matching local connection");
-            match = false;
-        }
+    return result;
+}
 
-        if (server && q->ip_address && strcmp(q->ip_address, server)) {
-            notice("%s returned a non-matching IP: %s expected %s",
-                   conntrack_path, server, q->ip_address);
-            // In theory this should not happen, so it is safer to ignore
-            // the error here as it may be due to non-canonical IP
-            // representation. Logging as notice as it may indicate
-            // changes in conntrack behaviour and/or syntax.
-            //match = false;
+char *
+forward_matches(const ident_query * const q, const conntrack_entry entries[], const int count) {
+    // A host that replicates its connections need not be asked
+    for (int i = 0; i < count; ++i) {
+        char * const username = replica_lookup(&entries[i]);
+        if (username) {
+            notice("Matched connection from %s port %u to %s port %u, replicated user: %s",
+                   entries[i].client, entries[i].client_port,
+                   entries[i].server, q->remote_port, username);
+            metric_count(METRIC_CONNTRACK_HITS);
+            metric_count(METRIC_REPLICA_HITS);
+            return username;
         }
+    }
 
-        debug("CT %s:%u -> %s:%u -> %s:%u (%s)",
-              server ? server : "", server_port,
-              source ? source : "", router_port,
-              client ? client : "", client_port,
-              match ? "FORWARD" : "no forward");
+    if (count < 2) {
+        return (count == 1) ? forward_match(q, &entries[0]) : NULL;
     }
 
-    debug("CT closing");
+    // Several hosts have a connection with the same ports (to different
+    // servers), so ask all of them at once and use the first user found
+    ident_query forwarded_queries[CONNTRACK_MAX_MATCHES];
+    const char *destinations[CONNTRACK_MAX_MATCHES];
+    const int n = (count < CONNTRACK_MAX_MATCHES) ? count : CONNTRACK_MAX_MATCHES;
 
-    block_timeout();
-    (void) pclose(query_pipe);
-    query_pipe = NULL;
-    unblock_timeout();
+    notice("Matched %d connections to port %u from port %u, forwarding to all",
+           n, q->remote_port, q->local_port);
 
-    char *result = NULL;
+    for (int i = 0; i < n; ++i) {
+        const conntrack_entry * const entry = &entries[i];
+        const char * const server = entry->server[0] ? entry->server : NULL;
 
-    if (match) {
-        notice("Matched connection from %s port %u to %s port %u, forwarding to %s as port %u",
-               source ? source : "router", q->local_port,
-               server ? server : "server", q->remote_port,
-               client, client_port);
-        ident_query forwarded_query = {
-            .local_port = client_port,
+        debug("CT candidate %s port %u (server %s)", entry->client, entry->client_port,
+              server ? server : "unknown");
+        forwarded_queries[i] = (ident_query) {
+            .local_port = entry->client_port,
             .remote_port = q->remote_port,
         };
         if (q->ip_in_query_extension && (server || q->ip_address)) {
-            forwarded_query.ip_in_query_extension = true;
-            forwarded_query.ip_address = server ? server : q->ip_address;
+            forwarded_queries[i].ip_in_query_extension = true;
+            forwarded_queries[i].ip_address = server ? server : q->ip_address;
         }
-        result = forward_query(&forwarded_query, client);
+        destinations[i] = entry->client;
+        metric_count(METRIC_FORWARDS);
+    }
+    metric_count(METRIC_CONNTRACK_HITS);
+
+    const long long forward_start = metric_stage_start();
+    char * const result = forward_queries(forwarded_queries, destinations, n);
+    metric_stage_done(STAGE_FORWARD, forward_start, NULL);
+    if (!result) {
+        metric_count(METRIC_FORWARD_FAILURES);
     }
 
     return result;
 }
+
+int
+conntrack_lookup(const ident_query * const q, conntrack_entry entries[], const int max) {
+    const long long start = metric_stage_start();
+    int found = nat_table_lookup(q, entries, max);
+    if (found < 0) {
+        found = ctnetlink(q, entries, max);
+    }
+    if (found < 0) {
+        debug("CT netlink lookup failed, falling back to %s", conntrack_path);
+        found = conntrack_program(q, entries, max);
+    }
+    metric_stage_done(STAGE_CONNTRACK, start, NULL);
+    trace_phase("conntrack");
+
+    return found;
+}
+
+char *
+conntrack(const ident_query * const q) {
+    conntrack_entry entries[CONNTRACK_MAX_MATCHES];
+
+    forwarding_attempted = false;
+
+    return forward_matches(q, entries, conntrack_lookup(q, entries, CONNTRACK_MAX_MATCHES));
+}
+
+char *
+race_lookup(const ident_query * const q) {
+    conntrack_entry entries[CONNTRACK_MAX_MATCHES];
+    char *result = NULL;
+
+    forwarding_attempted = false;
+
+    // The table is in memory, so there is nothing to race against
+    int found = nat_table_lookup(q, entries, CONNTRACK_MAX_MATCHES);
+    if (found > 0) {
+        trace_phase("conntrack");
+        return forward_matches(q, entries, found);
+    }
+
+    const long long start = metric_stage_start();
+    bool local_done = netlink_start(q, &result);
+    if (local_done) {
+        metric_stage_done(STAGE_NETLINK, start, NULL);
+        trace_phase("netlink");
+    }
+    if (found < 0 && !result) {
+        found = ctnetlink_start(q);
+    }
+
+    while (!(result || found > 0) && (!local_done || found == CTNETLINK_PENDING)) {
+        struct pollfd fds[2] = {
+            { .fd = local_done ? -1 : query_fd, .events = POLLIN },
+            { .fd = (found == CTNETLINK_PENDING) ? race_fd : -1, .events = POLLIN }
+        };
+        allow_timeout();
+        const int ready = poll(fds, 2, -1);
+        disallow_timeout();
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            warning("CT poll");
+            break;
+        }
+        if (fds[0].revents && (local_done = netlink_continue(q, &result))) {
+            metric_stage_done(STAGE_NETLINK, start, NULL);
+            trace_phase("netlink");
+        }
+        if (fds[1].revents && (found = ctnetlink_continue(q, entries, CONNTRACK_MAX_MATCHES)) != CTNETLINK_PENDING) {
+            metric_stage_done(STAGE_CONNTRACK, start, NULL);
+            trace_phase("conntrack");
+        }
+    }
+
+    if (!local_done) {
+        debug("CT cancelling the lookup of local connections");
+        netlink_cancel();
+    }
+    if (found == CTNETLINK_PENDING) {
+        debug("CT cancelling the lookup of connection tracking");
+        ctnetlink_cancel();
+    }
+
+    if (result) {
+        metric_count(METRIC_NETLINK_HITS);
+        return result;
+    }
+
+    if (found < 0) {
+        debug("CT netlink lookup failed, falling back to %s", conntrack_path);
+        found = conntrack_program(q, entries, CONNTRACK_MAX_MATCHES);
+        trace_phase("conntrack");
+    }
+
+    return forward_matches(q, entries, found);
+}
@@ -10,10 +10,31 @@
 
 #include "aidentd.h"
 
+#include <arpa/inet.h>
+#include <stdbool.h>
+
 extern const char *conntrack_path;
 
-/// Query the conntrack program at `conntrack_path` and forward the
-/// query to any discovered masqueraded connection.
+/// A masqueraded connection found by connection tracking.
+typedef struct conntrack_entry {
+    /// The masqueraded host (original source).
+    char client[INET6_ADDRSTRLEN];
+    /// The router address the connection is masqueraded as (reply destination).
+    char source[INET6_ADDRSTRLEN];
+    /// The remote server (reply source).
+    char server[INET6_ADDRSTRLEN];
+    unsigned client_port;
+    unsigned router_port;
+    unsigned server_port;
+} conntrack_entry;
+
+/// Query connection tracking and forward the query to any discovered
+/// masqueraded connection (to all of them at once if there are several
+/// with the same ports, see `forward_matches`). Connections are looked up
+/// from the table of masqueraded connections if enabled (see
+/// `nattable.h`), otherwise connection tracking is queried in-process via
+/// netlink (see `ctnetlink.h`), falling back to the conntrack program at
+/// `conntrack_path` if that fails.
 ///
 /// Returns the discovered username for the connection matching `query`,
 /// or `NULL` otherwise. Any returned username must be freed with `free`.
@@ -21,4 +42,43 @@ extern const char *conntrack_path;
 /// flag `forwarding_attempted` will be set (see `forwarding.h`).
 char *conntrack(const ident_query * const query);
 
+/// The maximum number of masqueraded connections matching a single query
+/// (i.e., hosts with the same ports to different servers) that are
+/// forwarded to.
+#define CONNTRACK_MAX_MATCHES 8
+
+/// Look up the masqueraded connections matching `query` like `conntrack`,
+/// but without forwarding the query. Returns the number of matches filled
+/// in `entries` (up to `max`).
+int conntrack_lookup(const ident_query * const query, conntrack_entry entries[], const int max);
+
+/// Forward `query` to the masqueraded host of `entry` (as found by
+/// `conntrack_lookup`). Returns the username as `conntrack` does.
+char *forward_match(const ident_query * const query, const conntrack_entry * const entry);
+
+/// Forward `query` to the masqueraded hosts of the `count` `entries` (as
+/// found by `conntrack_lookup`). If there are several, they are all asked
+/// at the same time (see `forward_queries` in `forwarding.h`). Connections
+/// replicated by their hosts (see `replica.h`) are answered without asking.
+/// Returns the username as `conntrack` does.
+char *forward_matches(const ident_query * const query, const conntrack_entry entries[],
+                      const int count);
+
+/// Close `query_pipe` (see `aidentd.h`) and wait for the conntrack program
+/// writing to it to exit, killing it first if `terminate` (e.g., after the
+/// lookup timed out).
+void close_query_pipe(const bool terminate);
+
+/// Look up local connections (see `netlink.h`) and masqueraded connections
+/// concurrently (option `-R`)?
+extern bool race_lookups;
+
+/// Look up `query` both as a local connection and as a masqueraded one at
+/// the same time, so that forwarded queries need not wait for the lookup
+/// of local connections to finish. Whichever lookup matches first is used
+/// (and the other cancelled): a local match returns the username like
+/// `netlink`, and a masqueraded one is forwarded like in `conntrack`.
+/// The connection tracking netlink socket is `race_fd`.
+char *race_lookup(const ident_query * const query);
+
 #endif
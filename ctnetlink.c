@@ -0,0 +1,491 @@
+/*
+ * ctnetlink.c: Connection tracking lookups via netlink.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#include "ctnetlink.h"
+
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Filter flags for `CTA_FILTER` (not exported in the kernel headers)
+#define CTA_FILTER_F_CTA_IP_SRC         (1U << 0)
+#define CTA_FILTER_F_CTA_PROTO_NUM      (1U << 3)
+#define CTA_FILTER_F_CTA_PROTO_SRC_PORT (1U << 4)
+#define CTA_FILTER_F_CTA_PROTO_DST_PORT (1U << 5)
+
+#define CT_REQUEST_SIZE 256
+#define CT_BUF_SIZE 8192
+
+/// The sequence assigned to the last request.
+static uint32_t sequence = 0;
+
+/// Returns the size of an address of `family`, or 0 if unknown.
+static size_t
+address_size(const int family) {
+    switch (family) {
+    case AF_INET:
+        return sizeof(struct in_addr);
+    case AF_INET6:
+        return sizeof(struct in6_addr);
+    default:
+        return 0;
+    }
+}
+
+/// Append the attribute `type` with `length` bytes of `data` to the
+/// message `nlh` that has room for `capacity` bytes in total.
+/// Returns the added attribute.
+static struct nlattr *
+add_attribute(struct nlmsghdr * const nlh, const size_t capacity,
+              const uint16_t type, const void * const data, const size_t length) {
+    const size_t attribute_length = NLA_HDRLEN + length;
+    if (NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(attribute_length) > capacity) {
+        errno = ENOBUFS;
+        error("CT request buffer");
+    }
+
+    struct nlattr * const attr = (struct nlattr *) ((unsigned char *) nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+    attr->nla_type = type;
+    attr->nla_len = (uint16_t) attribute_length;
+    if (length) {
+        (void) memcpy((unsigned char *) attr + NLA_HDRLEN, data, length);
+    }
+    nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(attribute_length);
+
+    return attr;
+}
+
+/// Begin a nested attribute of `type` in `nlh`. The returned attribute
+/// must be passed to `end_nested` after adding its contents.
+static struct nlattr *
+begin_nested(struct nlmsghdr * const nlh, const size_t capacity, const uint16_t type) {
+    return add_attribute(nlh, capacity, type | NLA_F_NESTED, NULL, 0);
+}
+
+/// End the nested attribute `nest` in `nlh`.
+static void
+end_nested(struct nlmsghdr * const nlh, struct nlattr * const nest) {
+    nest->nla_len = (uint16_t) (((unsigned char *) nlh + nlh->nlmsg_len) - (unsigned char *) nest);
+}
+
+uint32_t
+ctnetlink_request(const int sockfd, const int family, const ident_query * const q) {
+    union {
+        struct nlmsghdr header;
+        unsigned char bytes[CT_REQUEST_SIZE];
+    } request;
+    (void) memset(&request, 0, sizeof request);
+
+    struct nlmsghdr * const nlh = &request.header;
+    nlh->nlmsg_len = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    nlh->nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_GET;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    nlh->nlmsg_seq = ++sequence;
+
+    const size_t ip_size = (q && q->socket_address) ? address_size(q->address_family) : 0;
+
+    // The kernel does not support filtering without a specific family
+    struct nfgenmsg * const nfh = NLMSG_DATA(nlh);
+    nfh->nfgen_family = (uint8_t) family;
+    nfh->version = NFNETLINK_V0;
+    nfh->res_id = 0;
+
+    // The reply tuple: from the server port to our (masqueraded) port
+    struct nlattr * const tuple = begin_nested(nlh, sizeof request, CTA_TUPLE_REPLY);
+    if (ip_size) {
+        struct nlattr * const ip = begin_nested(nlh, sizeof request, CTA_TUPLE_IP);
+        (void) add_attribute(nlh, sizeof request,
+                             (q->address_family == AF_INET6) ? CTA_IP_V6_SRC : CTA_IP_V4_SRC,
+                             q->socket_address, ip_size);
+        end_nested(nlh, ip);
+    }
+    {
+        const uint8_t protocol = IPPROTO_TCP;
+
+        struct nlattr * const proto = begin_nested(nlh, sizeof request, CTA_TUPLE_PROTO);
+        (void) add_attribute(nlh, sizeof request, CTA_PROTO_NUM, &protocol, sizeof protocol);
+        if (q) {
+            const uint16_t src_port = htons((uint16_t) q->remote_port);
+            const uint16_t dst_port = htons((uint16_t) q->local_port);
+            (void) add_attribute(nlh, sizeof request, CTA_PROTO_SRC_PORT, &src_port, sizeof src_port);
+            (void) add_attribute(nlh, sizeof request, CTA_PROTO_DST_PORT, &dst_port, sizeof dst_port);
+        }
+        end_nested(nlh, proto);
+    }
+    end_nested(nlh, tuple);
+
+    // Ask the kernel to filter by the above (ignored by kernels before 5.8)
+    {
+        const uint32_t orig_flags = 0;
+        const uint32_t reply_flags = CTA_FILTER_F_CTA_PROTO_NUM
+                                     | (q ? (CTA_FILTER_F_CTA_PROTO_SRC_PORT
+                                             | CTA_FILTER_F_CTA_PROTO_DST_PORT) : 0)
+                                     | (ip_size ? CTA_FILTER_F_CTA_IP_SRC : 0);
+
+        struct nlattr * const filter = begin_nested(nlh, sizeof request, CTA_FILTER);
+        (void) add_attribute(nlh, sizeof request, CTA_FILTER_ORIG_FLAGS, &orig_flags, sizeof orig_flags);
+        (void) add_attribute(nlh, sizeof request, CTA_FILTER_REPLY_FLAGS, &reply_flags, sizeof reply_flags);
+        end_nested(nlh, filter);
+    }
+
+    struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+
+    if (sendto(sockfd, nlh, nlh->nlmsg_len, 0, (struct sockaddr *) &sa, sizeof sa) < 0) {
+        warning("CT sendto");
+        return 0;
+    }
+
+    return nlh->nlmsg_seq;
+}
+
+/// Parse the attributes in the `length` bytes at `data` into `table`,
+/// which has room for attribute types up to `max`.
+static void
+parse_attributes(const struct nlattr *table[], const int max, const void * const data, int length) {
+    (void) memset(table, 0, sizeof(*table) * (max + 1));
+
+    const struct nlattr *attr = data;
+    while (length >= (int) NLA_HDRLEN && attr->nla_len >= NLA_HDRLEN && attr->nla_len <= length) {
+        const int type = attr->nla_type & NLA_TYPE_MASK;
+        if (type <= max) {
+            table[type] = attr;
+        }
+        length -= NLA_ALIGN(attr->nla_len);
+        attr = (const struct nlattr *) ((const unsigned char *) attr + NLA_ALIGN(attr->nla_len));
+    }
+}
+
+/// Returns a pointer to the payload of `attr`.
+#define ATTR_DATA(attr) ((const void *) ((const unsigned char *) (attr) + NLA_HDRLEN))
+
+/// Returns the length of the payload of `attr`.
+#define ATTR_LENGTH(attr) ((int) (attr)->nla_len - (int) NLA_HDRLEN)
+
+/// Read the 16-bit port in network byte order from `attr`.
+static unsigned
+attribute_port(const struct nlattr * const attr) {
+    uint16_t port = 0;
+    if (attr && ATTR_LENGTH(attr) >= (int) sizeof port) {
+        (void) memcpy(&port, ATTR_DATA(attr), sizeof port);
+    }
+    return (unsigned) ntohs(port);
+}
+
+/// Parse the nested tuple attribute `attr` into `tuple`.
+/// Returns `true` on success.
+static bool
+parse_tuple(const struct nlattr * const attr, ct_tuple * const tuple) {
+    const struct nlattr *tb[CTA_TUPLE_MAX + 1];
+    const struct nlattr *ip[CTA_IP_MAX + 1];
+    const struct nlattr *proto[CTA_PROTO_MAX + 1];
+
+    (void) memset(tuple, 0, sizeof *tuple);
+
+    if (!attr) {
+        return false;
+    }
+    parse_attributes(tb, CTA_TUPLE_MAX, ATTR_DATA(attr), ATTR_LENGTH(attr));
+    if (!(tb[CTA_TUPLE_IP] && tb[CTA_TUPLE_PROTO])) {
+        return false;
+    }
+
+    parse_attributes(ip, CTA_IP_MAX, ATTR_DATA(tb[CTA_TUPLE_IP]), ATTR_LENGTH(tb[CTA_TUPLE_IP]));
+    const struct nlattr *src = NULL, *dst = NULL;
+    if (ip[CTA_IP_V4_SRC] && ip[CTA_IP_V4_DST]) {
+        tuple->family = AF_INET;
+        src = ip[CTA_IP_V4_SRC];
+        dst = ip[CTA_IP_V4_DST];
+    } else if (ip[CTA_IP_V6_SRC] && ip[CTA_IP_V6_DST]) {
+        tuple->family = AF_INET6;
+        src = ip[CTA_IP_V6_SRC];
+        dst = ip[CTA_IP_V6_DST];
+    } else {
+        return false;
+    }
+
+    const size_t size = address_size(tuple->family);
+    if (ATTR_LENGTH(src) < (int) size || ATTR_LENGTH(dst) < (int) size) {
+        return false;
+    }
+    (void) memcpy(tuple->src, ATTR_DATA(src), size);
+    (void) memcpy(tuple->dst, ATTR_DATA(dst), size);
+
+    parse_attributes(proto, CTA_PROTO_MAX, ATTR_DATA(tb[CTA_TUPLE_PROTO]), ATTR_LENGTH(tb[CTA_TUPLE_PROTO]));
+    if (proto[CTA_PROTO_NUM] && ATTR_LENGTH(proto[CTA_PROTO_NUM]) >= 1) {
+        tuple->protocol = *(const uint8_t *) ATTR_DATA(proto[CTA_PROTO_NUM]);
+    }
+    tuple->src_port = attribute_port(proto[CTA_PROTO_SRC_PORT]);
+    tuple->dst_port = attribute_port(proto[CTA_PROTO_DST_PORT]);
+
+    return true;
+}
+
+bool
+ctnetlink_parse(const struct nlmsghdr * const nlh, ct_tuple * const original, ct_tuple * const reply) {
+    const struct nlattr *tb[CTA_MAX + 1];
+    const int header_length = NLMSG_ALIGN(sizeof(struct nfgenmsg));
+    const int length = (int) nlh->nlmsg_len - NLMSG_LENGTH(header_length);
+
+    if (length < 0) {
+        return false;
+    }
+    parse_attributes(tb, CTA_MAX, (const unsigned char *) NLMSG_DATA(nlh) + header_length, length);
+
+    return parse_tuple(tb[CTA_TUPLE_ORIG], original) && parse_tuple(tb[CTA_TUPLE_REPLY], reply);
+}
+
+bool
+ctnetlink_match(const ct_tuple * const original, const ct_tuple * const reply,
+                const ident_query * const q, conntrack_entry * const entry) {
+    if (reply->protocol != IPPROTO_TCP) {
+        return false;
+    }
+
+    const size_t size = address_size(reply->family);
+    bool match = (q->remote_port == reply->src_port && q->local_port == reply->dst_port);
+
+    if (match && q->socket_address && q->address_family == reply->family
+        && memcmp(q->socket_address, reply->src, size)) {
+        match = false;
+    }
+
+    char client[INET6_ADDRSTRLEN] = { '\0' };
+    char source[INET6_ADDRSTRLEN] = { '\0' };
+    char server[INET6_ADDRSTRLEN] = { '\0' };
+    (void) inet_ntop(original->family, original->src, client, sizeof client);
+    (void) inet_ntop(reply->family, reply->dst, source, sizeof source);
+    (void) inet_ntop(reply->family, reply->src, server, sizeof server);
+
+    if (match && original->family == reply->family && memcmp(original->src, reply->dst, size) == 0) {
+        // Local connection, do not forward to ourselves
+        // (Normally matched in netlink, but it may be disabled.)
+        debug("CT found matching local connection");
+        match = false;
+    }
+
+    debug("CT %s:%u -> %s:%u -> %s:%u (%s)",
+          server, reply->src_port,
+          source, reply->dst_port,
+          client, original->src_port,
+          match ? "FORWARD" : "no forward");
+
+    if (match) {
+        (void) strcpy(entry->client, client);
+        (void) strcpy(entry->source, source);
+        (void) strcpy(entry->server, server);
+        entry->client_port = original->src_port;
+        entry->router_port = reply->dst_port;
+        entry->server_port = reply->src_port;
+    }
+
+    return match;
+}
+
+/// Check the conntrack message `nlh` against the query `q`. Returns `true`
+/// and fills in `entry` on match.
+static bool
+check_response(const struct nlmsghdr * const nlh, const ident_query * const q,
+               conntrack_entry * const entry) {
+    ct_tuple original, reply;
+    if (!ctnetlink_parse(nlh, &original, &reply)) {
+        debug("CT skipping unparseable entry");
+        return false;
+    }
+    return ctnetlink_match(&original, &reply, q, entry);
+}
+
+/// Read the responses to the request `seq` from `sockfd` until done,
+/// adding the matches to `entries` (of which `*count` are already filled,
+/// and which has room for `max`). Returns 0 when done, or -1 on error.
+/// If `wait` is `false`, returns `CTNETLINK_PENDING` instead of waiting
+/// for more responses.
+static int
+read_responses(const int sockfd, const uint32_t seq, const ident_query * const q,
+               conntrack_entry entries[], const int max, int * const count, const bool wait) {
+    union {
+        struct nlmsghdr header;
+        unsigned char bytes[CT_BUF_SIZE];
+    } buf;
+
+    debug("CT reading responses...");
+
+    for (;;) {
+        if (wait) {
+            allow_timeout();
+        }
+        ssize_t len = recv(sockfd, &buf, sizeof buf, wait ? 0 : MSG_DONTWAIT);
+        if (wait) {
+            disallow_timeout();
+        }
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!wait && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return CTNETLINK_PENDING;
+            }
+            warning("CT recv");
+            return -1;
+        }
+        debug("CT read %lu bytes", (unsigned long) len);
+
+        for (struct nlmsghdr *nlh = &buf.header; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_seq != seq) {
+                debug("CT message seq mismatch: %u, expecting %u", nlh->nlmsg_seq, seq);
+                continue;
+            }
+
+            switch (nlh->nlmsg_type) {
+            case NLMSG_DONE:
+                debug("CT done.");
+                return 0;
+            case NLMSG_ERROR: {
+                    const struct nlmsgerr * const err = NLMSG_DATA(nlh);
+                    if (nlh->nlmsg_len >= NLMSG_LENGTH(sizeof *err) && err->error == 0) {
+                        break; // acknowledgement
+                    }
+                    errno = (nlh->nlmsg_len >= NLMSG_LENGTH(sizeof *err)) ? -(err->error) : EIO;
+                    warning("CT netlink error");
+                    return -1;
+                }
+            default:
+                if (*count < max && check_response(nlh, q, &entries[*count])) {
+                    ++(*count);
+                }
+                break;
+            }
+        }
+    }
+}
+
+/// The address families to look up, in order. Without a known address
+/// both IPv4 (where NAT is most likely) and IPv6 are tried.
+static const int families[] = { AF_INET, AF_INET6 };
+
+#define FAMILY_COUNT ((int) (sizeof families / sizeof *families))
+
+/// Returns the index of the first family at or after `index` in `families`
+/// to look up for `query`, or `FAMILY_COUNT` if none.
+static int
+next_family(const ident_query * const query, int index) {
+    while (index < FAMILY_COUNT && query->socket_address
+           && address_size(query->address_family) && families[index] != query->address_family) {
+        ++index;
+    }
+    return index;
+}
+
+int
+ctnetlink(const ident_query * const query, conntrack_entry entries[], const int max) {
+    if ((query_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER)) < 0) {
+        warning("CT socket");
+        return -1;
+    }
+
+    int result = 0;
+    int count = 0;
+
+    for (int i = next_family(query, 0); result == 0 && count == 0 && i < FAMILY_COUNT;
+         i = next_family(query, i + 1)) {
+        debug("CT sending netlink request...");
+
+        const uint32_t seq = ctnetlink_request(query_fd, families[i], query);
+        result = seq ? read_responses(query_fd, seq, query, entries, max, &count, true) : -1;
+    }
+    if (count) {
+        result = count;
+    }
+
+    debug("CT closing netlink");
+    block_timeout();
+    (void) close(query_fd);
+    query_fd = -1;
+    unblock_timeout();
+
+    return result;
+}
+
+/// The state of the lookup started by `ctnetlink_start`.
+static struct {
+    int family_index;
+    uint32_t seq;
+    int count;
+} started;
+
+/// Close `race_fd`.
+static void
+close_race_fd(void) {
+    debug("CT closing netlink");
+    block_timeout();
+    (void) close(race_fd);
+    race_fd = -1;
+    unblock_timeout();
+}
+
+int
+ctnetlink_start(const ident_query * const query) {
+    if ((race_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER)) < 0) {
+        warning("CT socket");
+        return -1;
+    }
+
+    started.family_index = next_family(query, 0);
+    started.count = 0;
+    if (started.family_index >= FAMILY_COUNT) {
+        close_race_fd();
+        return 0;
+    }
+
+    debug("CT sending netlink request...");
+    if (!(started.seq = ctnetlink_request(race_fd, families[started.family_index], query))) {
+        close_race_fd();
+        return -1;
+    }
+
+    return CTNETLINK_PENDING;
+}
+
+int
+ctnetlink_continue(const ident_query * const query, conntrack_entry entries[], const int max) {
+    int result = read_responses(race_fd, started.seq, query, entries, max, &started.count, false);
+
+    if (result == 0 && started.count == 0) {
+        started.family_index = next_family(query, started.family_index + 1);
+        if (started.family_index < FAMILY_COUNT) {
+            debug("CT sending netlink request...");
+            started.seq = ctnetlink_request(race_fd, families[started.family_index], query);
+            result = started.seq ? CTNETLINK_PENDING : -1;
+        }
+    }
+
+    if (result != CTNETLINK_PENDING) {
+        close_race_fd();
+        if (started.count) {
+            result = started.count;
+        }
+    }
+    return result;
+}
+
+void
+ctnetlink_cancel(void) {
+    if (race_fd >= 0) {
+        close_race_fd();
+    }
+}
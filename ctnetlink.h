@@ -0,0 +1,75 @@
+/*
+ * ctnetlink.h: Connection tracking lookups via netlink.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#ifndef AIDENTD_CTNETLINK_H
+#define AIDENTD_CTNETLINK_H
+
+#include "aidentd.h"
+#include "conntrack.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/netlink.h>
+
+/// A tuple of a tracked connection.
+typedef struct ct_tuple {
+    int family;
+    unsigned protocol;
+    unsigned src_port;
+    unsigned dst_port;
+    unsigned char src[16];
+    unsigned char dst[16];
+} ct_tuple;
+
+/// Send a request to dump the tracked TCP connections of `family` to the
+/// `NETLINK_NETFILTER` socket `sockfd`, filtered by the reply tuple
+/// corresponding to `query` (or all TCP connections if `query` is `NULL`).
+/// Returns the sequence number of the request, or 0 on error.
+uint32_t ctnetlink_request(const int sockfd, const int family, const ident_query * const query);
+
+/// Parse the original and reply tuples of the conntrack message `nlh`
+/// into `original` and `reply`. Returns `true` on success.
+bool ctnetlink_parse(const struct nlmsghdr * const nlh, ct_tuple * const original, ct_tuple * const reply);
+
+/// Check the connection with the tuples `original` and `reply` against
+/// `query`. Returns `true` and fills in `entry` if the connection is a
+/// masqueraded TCP connection matching the query.
+bool ctnetlink_match(const ct_tuple * const original, const ct_tuple * const reply,
+                     const ident_query * const query, conntrack_entry * const entry);
+
+/// Look up the masqueraded TCP connections matching `query` directly from
+/// the kernel's connection tracking via netlink (`NETLINK_NETFILTER`).
+/// The kernel is asked to filter the dump by the reply tuple (supported
+/// since Linux 5.8), and the results are also checked here.
+///
+/// Returns the number of matches found and filled in `entries` (up to
+/// `max`), 0 if there was no match, or -1 if the lookup failed (e.g.,
+/// insufficient privileges or no kernel support), in which case the
+/// caller may fall back to the conntrack program. Requires `CAP_NET_ADMIN`.
+int ctnetlink(const ident_query * const query, conntrack_entry entries[], const int max);
+
+/// The result of `ctnetlink_start` and `ctnetlink_continue` when the
+/// lookup needs more responses from the kernel.
+#define CTNETLINK_PENDING (-2)
+
+/// Start looking up `query` as with `ctnetlink`, but on the socket
+/// `race_fd` and without waiting for the kernel to respond, so that other
+/// lookups can be done meanwhile. Returns `CTNETLINK_PENDING` if started,
+/// in which case `ctnetlink_continue` must be called when `race_fd`
+/// becomes readable (or `ctnetlink_cancel` to abandon the lookup), and
+/// otherwise the result as `ctnetlink` would return it.
+int ctnetlink_start(const ident_query * const query);
+
+/// Continue the lookup started by `ctnetlink_start` with the responses
+/// available on `race_fd`. Returns `CTNETLINK_PENDING` if more responses
+/// are needed, and otherwise the result as `ctnetlink` would return it.
+int ctnetlink_continue(const ident_query * const query, conntrack_entry entries[], const int max);
+
+/// Abandon the lookup started by `ctnetlink_start`.
+void ctnetlink_cancel(void);
+
+#endif
@@ -6,8 +6,12 @@
  */
 
 #include "forwarding.h"
+#include "health.h"
 
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
+#include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -17,6 +21,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 unsigned ident_port = 113;
 
@@ -39,8 +44,90 @@ static struct addrinfo *forward_address = NULL;
 
 bool forwarding_attempted = false;
 
+bool forwarding_skipped = false;
+
 char *additional_info = NULL;
 
+/// The maximum length of a forwarded response line (RFC1413 allows 512
+/// characters for the user id alone, plus the other fields).
+#define FORWARD_LINE_SIZE 1024
+
+#define FORWARD_POOL_SIZE 16
+#define FORWARD_IDLE_SECONDS 60
+
+/// An idle connection kept open to a forwarding destination.
+typedef struct pooled_connection {
+    int fd;
+    time_t last_used;
+    size_t length;
+    char destination[INET6_ADDRSTRLEN];
+    char buf[FORWARD_LINE_SIZE];
+} pooled_connection;
+
+/// The connections kept open (the destination is empty for unused ones).
+static pooled_connection pool[FORWARD_POOL_SIZE];
+
+#define FORWARD_CONCURRENT_MAX 8
+
+/// A query being forwarded by `forward_queries`.
+typedef struct concurrent_query {
+    int fd;
+    bool connected;
+    const ident_query *query;
+    long long started;
+    size_t length;
+    char destination[INET6_ADDRSTRLEN];
+    char buf[FORWARD_LINE_SIZE];
+    /// The error (or other info) returned without a user id.
+    char info[FORWARD_LINE_SIZE];
+} concurrent_query;
+
+/// The queries being forwarded by `forward_queries`. These are in global
+/// scope in order to be closed by the call to `clean_up_forwarding`.
+static concurrent_query concurrent[FORWARD_CONCURRENT_MAX];
+static int concurrent_count = 0;
+
+bool keep_forward_connections = false;
+
+/// The destination being forwarded to, whose outcome has not yet been
+/// reported to `health_report` (empty if none).
+static char health_destination[INET6_ADDRSTRLEN] = { '\0' };
+
+/// The time when forwarding to `health_destination` started.
+static long long health_start = 0;
+
+/// Returns the current monotonic time in milliseconds.
+static long long
+now_milliseconds(void) {
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+        return (long long) monotonic_time() * 1000;
+    }
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/// Report the outcome of forwarding to `health_destination`, if any.
+static void
+report_health(const bool success) {
+    if (health_destination[0]) {
+        block_timeout();
+        health_report(health_destination, success, now_milliseconds() - health_start);
+        health_destination[0] = '\0';
+        unblock_timeout();
+    }
+}
+
+/// Free `forward_address`.
+static void
+free_forward_address(void) {
+    if (forward_address) {
+        block_timeout();
+        freeaddrinfo(forward_address);
+        forward_address = NULL;
+        unblock_timeout();
+    }
+}
+
 /// Fields in the ident response
 enum fields {
     FIELD_PORTS = 0,
@@ -50,16 +137,100 @@ enum fields {
     FIELD_EOL
 };
 
-char *
-forward_query(const ident_query * const query, const char * const destination) {
-    char buf[513]; // RFC1413: 512 characters maximum user id
-    char *response = NULL;
+/// Set `additional_info` to a copy of `info`, unless it is empty.
+static void
+set_additional_info(const char * const info) {
+    if (!*info) {
+        return;
+    }
+    block_timeout();
+    free(additional_info);
+    additional_info = strdup(info);
+    unblock_timeout();
+}
+
+/// Parse the ident response `line` from `destination` in place. The line
+/// ends at the first CR, LF or NUL; if it ends at NUL (i.e., the whole line
+/// was not received) a non-empty user id is accepted as truncated. Returns
+/// the user id, or `NULL` if there is none. Any additional info or error
+/// is stored in `additional_info`.
+static char *
+parse_response(char * const line, const char * const destination) {
+    enum fields field = FIELD_PORTS;
+    bool is_error = false;
+    char *start = line;
+    char *end = line;
+
+    for (char *p = line; ; ++p) {
+        const char c = *p;
+        const bool is_eol = (c == '\0' || c == '\r' || c == '\n');
+
+        if (!(is_eol || (field != FIELD_USERID && c == ':'))) {
+            if (field == FIELD_USERID || !(c == ' ' || c == '\t' || c < ' ' || c >= 127)) {
+                // ignore space except in the user id
+                *end++ = c;
+            }
+            continue;
+        }
+
+        *end = '\0';
+        switch (field++) {
+        case FIELD_PORTS:
+            // should echo the ports but let's not bother to check
+            break;
+        case FIELD_REPLY_TYPE:
+            is_error = strcmp(start, "USERID") ? true : false;
+            debug("FWD received response type: %s", start);
+            break;
+        case FIELD_INFO:
+            set_additional_info(start);
+            if (is_error) {
+                if (strcmp(start, "USERID") == 0) {
+                    // This happens when forwarding with address to nullidentd
+                    field = FIELD_INFO;
+                    is_error = false;
+                    debug("FWD %s returned an extra field, trying to re-sync",
+                          destination);
+                } else {
+                    debug("FWD %s gave error: %s", destination, start);
+                    return NULL;
+                }
+            } else {
+                debug("FWD received system type: %s", start);
+            }
+            break;
+        case FIELD_USERID:
+            if (c == '\0') {
+                if (!*start) {
+                    break;
+                }
+                debug("FWD to %s: userid truncated before EOL", destination);
+            }
+            debug("FWD received userid: %s", start);
+            return start;
+        case FIELD_EOL:
+            break;
+        }
+
+        if (is_eol) {
+            debug("FWD to %s got premature EOL", destination);
+            return NULL;
+        }
+        start = end = p + 1;
+    }
+}
 
-    if (snprintf(buf, sizeof buf, "%u", ident_port) <= 0) {
+/// Connect `query_fd` to `destination` port `ident_port`. Returns `true`
+/// on success.
+static bool
+connect_to(const char * const destination) {
+    char port[8];
+
+    if (snprintf(port, sizeof port, "%u", ident_port) <= 0) {
         error("FWD snprintf port");
     }
 
-    debug("FWD to %s port %s", destination, buf);
+    debug("FWD to %s port %s", destination, port);
 
     {
         struct addrinfo hints = {
@@ -68,141 +239,317 @@ forward_query(const ident_query * const query, const char * const destination) {
             .ai_flags = AI_NUMERICHOST | AI_NUMERICSERV
         };
 
-        const int error_result = getaddrinfo(destination, buf, &hints, &forward_address);
+        const int error_result = getaddrinfo(destination, port, &hints, &forward_address);
         if (error_result) {
-            errno = EIO;
-            error(gai_strerror(error_result));
+            notice("FWD to %s: %s", destination, gai_strerror(error_result));
+            forward_address = NULL;
+            return false;
         }
+        trace_phase("forward_getaddrinfo");
     }
 
     close_query_fd();
     for (struct addrinfo *rp = forward_address; rp; rp = rp->ai_next) {
-        if ((query_fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) < 0) {
+        if ((query_fd = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC, rp->ai_protocol)) < 0) {
             debug("FWD socket: %s", strerror(errno));
             continue;
         }
 
         debug("FWD connecting to %s...", destination);
-        if (connect(query_fd, rp->ai_addr, rp->ai_addrlen) < 0) {
+        allow_timeout();
+        const int connected = connect(query_fd, rp->ai_addr, rp->ai_addrlen);
+        disallow_timeout();
+        if (connected < 0) {
             debug("FWD connect: %s", strerror(errno));
             close_query_fd();
             continue;
         }
+        break;
     }
-    clean_up_forwarding();
-    forwarding_attempted = true;
+    free_forward_address();
 
     if (query_fd < 0) {
         debug("FWD to %s failed", destination);
-        return NULL;
+        return false;
     }
+    trace_phase("forward_connect");
+    return true;
+}
 
-    {
-        bool with_ip = query->ip_in_query_extension && (query->ip_address != NULL);
-        int to_send = snprintf(buf, sizeof buf, "%u,%u%s%s\r\n",
-                               query->local_port, query->remote_port,
-                               with_ip ? " : " : "",
-                               with_ip ? query->ip_address : "");
-        if (to_send <= 0 || to_send >= sizeof buf) {
-            error("FWD snprintf query");
-        }
-
-        int bytes_sent = 0;
-        do {
-            int sent = send(query_fd, buf + bytes_sent, to_send - bytes_sent, MSG_NOSIGNAL);
-            if (sent <= 0) {
-                if (errno == EAGAIN || errno == EINTR) {
-                    continue;
-                }
-                notice("FWD send: %s", strerror(errno));
-                break;
-            }
-            bytes_sent += sent;
-        } while (bytes_sent > to_send);
+/// Take an idle connection to `destination` from the pool as `query_fd`,
+/// copying any input already received on it to `buf` and its length to
+/// `length`. Idle connections that have expired are closed. Returns `true`
+/// if a usable connection was found.
+static bool
+take_pooled_connection(const char * const destination, char * const buf, size_t * const length) {
+    const time_t current_time = monotonic_time();
+    bool found = false;
 
-        if (bytes_sent < to_send) {
-            debug("FWD query not written: %s", buf);
-            goto clean_up;
+    block_timeout();
+    for (int i = 0; i < FORWARD_POOL_SIZE; ++i) {
+        pooled_connection * const c = &pool[i];
+        if (!c->destination[0]) {
+            continue;
+        }
+        if (!found && strcmp(c->destination, destination) == 0) {
+            close_query_fd();
+            query_fd = c->fd;
+            (void) memcpy(buf, c->buf, c->length);
+            *length = c->length;
+            found = true;
+        } else if (current_time - c->last_used > FORWARD_IDLE_SECONDS) {
+            debug("FWD closing idle connection to %s", c->destination);
+            (void) close(c->fd);
+        } else {
+            continue;
         }
+        c->destination[0] = '\0';
+        c->fd = -1;
     }
+    unblock_timeout();
 
-    {
-        enum fields field = FIELD_PORTS;
-        char *p = buf;
-        char *end_of_buffer = buf + (sizeof(buf) - 2);
-        bool is_error = false;
-        do {
-            if (recv(query_fd, p, 1, 0) != 1) {
-                if (errno == EAGAIN || errno == EINTR) {
-                    continue;
-                }
-                notice("FWD to %s recv error: %s", destination, strerror(errno));
-                break;
+    if (found && *length == 0) {
+        // Check that the remote has not closed the connection meanwhile
+        char c;
+        const ssize_t result = recv(query_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (result == 0 || (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            debug("FWD kept connection to %s was closed", destination);
+            close_query_fd();
+            found = false;
+        }
+    }
+
+    if (found) {
+        debug("FWD reusing connection to %s", destination);
+    }
+    return found;
+}
+
+/// Keep `query_fd` to `destination` open in the pool for the next query
+/// to the same destination, along with `length` bytes of unread input from
+/// `buf`. The least recently used connection is closed if the pool is full.
+static void
+pool_connection(const char * const destination, const char * const buf, const size_t length) {
+    if (strlen(destination) >= sizeof pool[0].destination || length > sizeof pool[0].buf) {
+        close_query_fd();
+        return;
+    }
+
+    block_timeout();
+    pooled_connection *c = &pool[0];
+    for (int i = 0; i < FORWARD_POOL_SIZE; ++i) {
+        if (!pool[i].destination[0]) {
+            c = &pool[i];
+            break;
+        }
+        if (pool[i].last_used < c->last_used) {
+            c = &pool[i];
+        }
+    }
+    if (c->destination[0]) {
+        debug("FWD closing least recently used connection to %s", c->destination);
+        (void) close(c->fd);
+    }
+    (void) strcpy(c->destination, destination);
+    (void) memcpy(c->buf, buf, length);
+    c->length = length;
+    c->last_used = monotonic_time();
+    c->fd = query_fd;
+    query_fd = -1;
+    unblock_timeout();
+}
+
+/// Send `query` to `fd`. Returns `true` on success.
+static bool
+send_query(const int fd, const ident_query * const query) {
+    char buf[QUERY_MAX_LENGTH];
+    const bool with_ip = query->ip_in_query_extension && (query->ip_address != NULL);
+    const int to_send = snprintf(buf, sizeof buf, "%u,%u%s%s\r\n",
+                                 query->local_port, query->remote_port,
+                                 with_ip ? " : " : "",
+                                 with_ip ? query->ip_address : "");
+    if (to_send <= 0 || (size_t) to_send >= sizeof buf) {
+        error("FWD snprintf query");
+    }
+
+    int bytes_sent = 0;
+    do {
+        allow_timeout();
+        int sent = send(fd, buf + bytes_sent, to_send - bytes_sent, MSG_NOSIGNAL);
+        disallow_timeout();
+        if (sent <= 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
             }
+            notice("FWD send: %s", strerror(errno));
+            break;
+        }
+        bytes_sent += sent;
+    } while (bytes_sent < to_send);
 
-            const char c = *p;
-            if (c == '\0') {
-                notice("FWD to %s received NUL character", destination);
-                break;
+    if (bytes_sent < to_send) {
+        debug("FWD query not written: %s", buf);
+        return false;
+    }
+    return true;
+}
+
+/// Receive input from `query_fd` to `buf` of `size` bytes (of which
+/// `*length` are already filled) until it contains a whole line. Sets
+/// `*line_length` to the length of the first line, including the first
+/// character of its end (the rest is skipped on the next call).
+/// The input is terminated with NUL, which also ends any incomplete line.
+/// Returns `true` if the connection remains usable for another query.
+static bool
+read_line(char * const buf, const size_t size, size_t * const length,
+          size_t * const line_length, const char * const destination) {
+    bool is_open = true;
+    size_t end = 0;
+
+    for (;;) {
+        while (end == 0 && *length && (buf[0] == '\r' || buf[0] == '\n')) {
+            // Skip the rest of the previous line end
+            (void) memmove(buf, buf + 1, --(*length));
+        }
+        while (end < *length && buf[end] != '\r' && buf[end] != '\n' && buf[end] != '\0') {
+            ++end;
+        }
+        if (end < *length || *length >= size - 1) {
+            break;
+        }
+
+        allow_timeout();
+        const ssize_t received = recv(query_fd, buf + *length, size - 1 - *length, 0);
+        disallow_timeout();
+        if (received < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
             }
+            notice("FWD to %s recv error: %s", destination, strerror(errno));
+            is_open = false;
+            break;
+        }
+        if (received == 0) {
+            is_open = false;
+            break;
+        }
+        if (*length == 0) {
+            trace_phase("forward_first_byte");
+        }
+        *length += (size_t) received;
+    }
+    buf[*length] = '\0';
 
-            if ((field != FIELD_USERID && c == ':') || c == '\r' || c == '\n') {
-                *p = '\0';
-                switch (field++) {
-                case FIELD_PORTS:
-                    // should echo the ports but let's not bother to check
-                    break;
-                case FIELD_REPLY_TYPE:
-                    is_error = strcmp(buf, "USERID") ? true : false;
-                    debug("FWD received response type: %s", buf);
-                    break;
-                case FIELD_INFO:
-                    if (*buf) {
-                        block_timeout();
-                        additional_info = strdup(buf);
-                        unblock_timeout();
-                    }
-                    if (is_error) {
-                        if (strcmp(buf, "USERID") == 0) {
-                            // This happens when forwarding with address to nullidentd
-                            field = FIELD_INFO;
-                            is_error = false;
-                            debug("FWD %s returned an extra field, trying to re-sync",
-                                  destination);
-                        } else {
-                            debug("FWD %s gave error: %s", destination, buf);
-                            goto clean_up;
-                        }
-                    } else {
-                        debug("FWD received system type: %s", buf);
-                    }
-                    break;
-                case FIELD_USERID:
-                    response = buf;
-                    debug("FWD received userid: %s", response);
-                case FIELD_EOL:
-                    break;
-                }
-                p = buf;
+    debug("FWD read %lu bytes", (unsigned long) *length);
 
-                if (!response && (c == '\r' || c == '\n')) {
-                    debug("FWD to %s got premature EOL", destination);
-                    break;
-                }
-            } else if (field == FIELD_USERID || !(c == ' ' || c == '\t' || c < ' ' || c >= 127)) {
-                // ignore space except in the user id
-                ++p;
+    if (end == *length) {
+        // Incomplete line
+        *line_length = end;
+        return false;
+    }
+    if (buf[end] == '\0') {
+        notice("FWD to %s received NUL character", destination);
+        is_open = false;
+    }
+    *line_length = end + 1;
+    return is_open;
+}
+
+/// Returns `false` if the ports echoed at the beginning of the response
+/// `line` are known to not match those of `query`.
+static bool
+response_matches_query(const char * const line, const ident_query * const query) {
+    char *end;
+    const unsigned long local_port = strtoul(line, &end, 10);
+    if (end == line) {
+        return true;
+    }
+    while (*end == ' ' || *end == '\t') {
+        ++end;
+    }
+    if (*end != ',') {
+        return true;
+    }
+    const char * const remote = end + 1;
+    const unsigned long remote_port = strtoul(remote, &end, 10);
+    if (end == remote) {
+        return true;
+    }
+    return local_port == query->local_port && remote_port == query->remote_port;
+}
+
+char *
+forward_query(const ident_query * const query, const char * const destination) {
+    char buf[FORWARD_LINE_SIZE];
+    size_t length = 0;
+    size_t line_length = 0;
+    bool is_open = false;
+    char *response = NULL;
+
+    if (!health_allow(destination)) {
+        notice("Not forwarding query (%u, %u) to failing %s",
+               query->local_port, query->remote_port, destination);
+        forwarding_skipped = true;
+        return NULL;
+    }
+
+    forwarding_attempted = true;
+
+    block_timeout();
+    (void) snprintf(health_destination, sizeof health_destination, "%s", destination);
+    health_start = now_milliseconds();
+    unblock_timeout();
+
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        length = 0;
+
+        const bool reused = keep_forward_connections
+                            && take_pooled_connection(destination, buf, &length);
+        if (!reused && !connect_to(destination)) {
+            report_health(false);
+            return NULL;
+        }
+
+        if (!send_query(query_fd, query)) {
+            if (reused) {
+                close_query_fd();
+                continue;
             }
-        } while (!(response || p == end_of_buffer));
+            goto clean_up;
+        }
 
-        if (!(response || is_error) && field == FIELD_USERID && p != buf) {
-            debug("FWD to %s: userid truncated before EOL", destination);
-            *p = '\0';
-            response = buf;
+        is_open = read_line(buf, sizeof buf, &length, &line_length, destination);
+        if (reused && length == 0) {
+            // The kept connection was closed, try again with a new one
+            debug("FWD kept connection to %s closed without response", destination);
+            close_query_fd();
+            continue;
         }
+        break;
+    }
+
+    // Skip any responses to other queries on a kept connection
+    while (keep_forward_connections && is_open && !response_matches_query(buf, query)) {
+        debug("FWD %s skipping a response to another query", destination);
+        length -= line_length;
+        (void) memmove(buf, buf + line_length, length);
+        is_open = read_line(buf, sizeof buf, &length, &line_length, destination);
+    }
+
+    trace_phase("forward_eol");
+
+    // Any response shows the destination to be working
+    report_health(length != 0);
+
+    if (length) {
+        response = parse_response(buf, destination);
     }
 
 clean_up:
+    report_health(false);
+    if (keep_forward_connections && is_open && query_fd >= 0) {
+        pool_connection(destination, buf + line_length, length - line_length);
+    }
     close_query_fd();
 
     if (response) {
@@ -224,18 +571,278 @@ clean_up:
     return NULL;
 }
 
-void
-clean_up_forwarding(void) {
-    if (forward_address) {
-        block_timeout();
-        freeaddrinfo(forward_address);
+/// Close the connection of `c` (if open), and report its outcome as
+/// `success` to `health_report` unless it has been `cancelled`.
+static void
+finish_concurrent(concurrent_query * const c, const bool success, const bool cancelled) {
+    if (c->fd < 0) {
+        return;
+    }
+    block_timeout();
+    (void) close(c->fd);
+    c->fd = -1;
+    if (!cancelled) {
+        health_report(c->destination, success, now_milliseconds() - c->started);
+    }
+    unblock_timeout();
+}
+
+/// Close all connections of `concurrent`, reporting them as failed unless
+/// `cancelled`.
+static void
+finish_all_concurrent(const bool cancelled) {
+    for (int i = 0; i < concurrent_count; ++i) {
+        finish_concurrent(&concurrent[i], false, cancelled);
+    }
+    concurrent_count = 0;
+}
+
+/// Start connecting (without waiting) the next entry of `concurrent` to
+/// `destination` port `ident_port` for sending `query`. A failure to do so
+/// is reported to `health_report`.
+static void
+start_concurrent(const char * const destination, const ident_query * const query) {
+    if (concurrent_count >= FORWARD_CONCURRENT_MAX
+        || strlen(destination) >= sizeof concurrent[0].destination) {
+        return;
+    }
+
+    block_timeout();
+    concurrent_query * const c = &concurrent[concurrent_count++];
+    c->fd = -1;
+    c->connected = false;
+    c->query = query;
+    c->started = now_milliseconds();
+    c->length = 0;
+    c->info[0] = '\0';
+    (void) strcpy(c->destination, destination);
+    unblock_timeout();
+
+    char port[8];
+    if (snprintf(port, sizeof port, "%u", ident_port) <= 0) {
+        error("FWD snprintf port");
+    }
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_NUMERICHOST | AI_NUMERICSERV
+    };
+    const int error_result = getaddrinfo(destination, port, &hints, &forward_address);
+    if (error_result) {
+        notice("FWD to %s: %s", destination, gai_strerror(error_result));
         forward_address = NULL;
+        return;
+    }
+
+    const struct addrinfo * const rp = forward_address;
+    if ((c->fd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        rp->ai_protocol)) < 0) {
+        debug("FWD socket: %s", strerror(errno));
+    } else if (connect(c->fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+        c->connected = true;
+    } else if (errno != EINPROGRESS) {
+        debug("FWD connect to %s: %s", destination, strerror(errno));
+        block_timeout();
+        (void) close(c->fd);
+        c->fd = -1;
         unblock_timeout();
     }
+    free_forward_address();
+
+    if (c->fd < 0) {
+        health_report(destination, false, now_milliseconds() - c->started);
+        return;
+    }
+    debug("FWD connecting to %s port %s...", destination, port);
+    if (c->connected && !send_query(c->fd, query)) {
+        finish_concurrent(c, false, false);
+    }
+}
+
+/// Continue the query of `c`, whose connection is ready. Returns the user
+/// id if the response has it, otherwise `NULL`.
+static char *
+continue_concurrent(concurrent_query * const c) {
+    if (!c->connected) {
+        int socket_error = 0;
+        socklen_t size = sizeof socket_error;
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &socket_error, &size) < 0) {
+            socket_error = errno;
+        }
+        if (socket_error) {
+            debug("FWD connect to %s: %s", c->destination, strerror(socket_error));
+            finish_concurrent(c, false, false);
+        } else {
+            debug("FWD connected to %s", c->destination);
+            c->connected = true;
+            if (!send_query(c->fd, c->query)) {
+                finish_concurrent(c, false, false);
+            }
+        }
+        return NULL;
+    }
+
+    const ssize_t received = recv(c->fd, c->buf + c->length, sizeof(c->buf) - 1 - c->length, 0);
+    if (received < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return NULL;
+        }
+        notice("FWD to %s recv error: %s", c->destination, strerror(errno));
+    } else {
+        c->length += (size_t) received;
+    }
+    c->buf[c->length] = '\0';
+
+    if (received > 0 && c->length < sizeof(c->buf) - 1 && !strpbrk(c->buf, "\r\n")) {
+        // Wait for the rest of the line
+        return NULL;
+    }
+
+    finish_concurrent(c, c->length != 0, false);
+    if (!c->length) {
+        return NULL;
+    }
+    char * const userid = parse_response(c->buf, c->destination);
+    if (!userid && additional_info) {
+        // Keep the error of each host for `concurrent_error` to choose from
+        (void) snprintf(c->info, sizeof c->info, "%s", additional_info);
+        block_timeout();
+        free(additional_info);
+        additional_info = NULL;
+        unblock_timeout();
+    }
+    return userid;
+}
+
+/// Returns the precedence of the error `info` returned by a host: a host
+/// hiding the user has the connection, whereas any host not having it
+/// answers `NO-USER`.
+static int
+error_precedence(const char * const info) {
+    if (strcmp(info, "HIDDEN-USER") == 0) {
+        return 3;
+    }
+    if (strcmp(info, "NO-USER") == 0) {
+        return 1;
+    }
+    return 2;
+}
+
+/// Returns the error of `concurrent` with the highest precedence (and of
+/// these, the one forwarded to first), regardless of the order in which
+/// the responses arrived, or `NULL` if none returned an error.
+static const char *
+concurrent_error(void) {
+    const char *info = NULL;
+    int precedence = 0;
+    for (int i = 0; i < concurrent_count; ++i) {
+        if (concurrent[i].info[0]) {
+            const int p = error_precedence(concurrent[i].info);
+            if (p > precedence) {
+                precedence = p;
+                info = concurrent[i].info;
+            }
+        }
+    }
+    return info;
+}
+
+char *
+forward_queries(const ident_query queries[], const char * const destinations[], const int count) {
+    char *response = NULL;
+    const char *destination = NULL;
+    const ident_query *query = NULL;
+
+    finish_all_concurrent(true);
+
+    for (int i = 0; i < count; ++i) {
+        if (!health_allow(destinations[i])) {
+            notice("Not forwarding query (%u, %u) to failing %s",
+                   queries[i].local_port, queries[i].remote_port, destinations[i]);
+            forwarding_skipped = true;
+            continue;
+        }
+        forwarding_attempted = true;
+        start_concurrent(destinations[i], &queries[i]);
+    }
+    trace_phase("forward_connect");
+
+    while (!response) {
+        struct pollfd fds[FORWARD_CONCURRENT_MAX];
+        int index[FORWARD_CONCURRENT_MAX];
+        int n = 0;
+
+        for (int i = 0; i < concurrent_count; ++i) {
+            if (concurrent[i].fd >= 0) {
+                fds[n].fd = concurrent[i].fd;
+                fds[n].events = concurrent[i].connected ? POLLIN : POLLOUT;
+                fds[n].revents = 0;
+                index[n++] = i;
+            }
+        }
+        if (n == 0) {
+            break;
+        }
+
+        allow_timeout();
+        const int ready = poll(fds, n, -1);
+        disallow_timeout();
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            warning("FWD poll");
+            break;
+        }
+
+        for (int i = 0; i < n && !response; ++i) {
+            if (fds[i].revents) {
+                concurrent_query * const c = &concurrent[index[i]];
+                if ((response = continue_concurrent(c))) {
+                    destination = c->destination;
+                    query = c->query;
+                }
+            }
+        }
+    }
+
+    if (response) {
+        cancel_timeout();
+        char * const username = strdup(response);
+        if (!username) {
+            error("strdup");
+        }
+        notice("Forwarded query (%u, %u) to %s returned user: %s",
+               query->local_port, query->remote_port, destination, username);
+        finish_all_concurrent(true);
+        return username;
+    }
+
+    const char * const info = concurrent_error();
+    if (info) {
+        set_additional_info(info);
+    }
+    finish_all_concurrent(true);
+    if (additional_info) {
+        notice("Forwarded query to %d hosts returned status: %s", count, additional_info);
+    } else {
+        debug("FWD to %d hosts did not return a result", count);
+    }
+    return NULL;
+}
+
+void
+clean_up_forwarding(void) {
+    // Forwarding that did not finish (i.e., timed out) counts as a failure
+    report_health(false);
+    finish_all_concurrent(false);
+    free_forward_address();
 
     if (additional_info) {
         block_timeout();
         free(additional_info);
+        additional_info = NULL;
         unblock_timeout();
     }
 }
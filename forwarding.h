@@ -18,6 +18,15 @@
 /// flag `forwarding_attempted` will be set. See also `additional_info`.
 char *forward_query(const ident_query * const query, const char * const destination);
 
+/// Forward each of the `count` `queries` to the corresponding host of
+/// `destinations` at the same time, for when several hosts may have the
+/// connection. Returns the first username returned by any of them, and
+/// closes the other connections, or `NULL` if none did. Sets the flag
+/// `forwarding_attempted` like `forward_query`. At most 8 destinations
+/// are used.
+char *forward_queries(const ident_query queries[], const char * const destinations[],
+                      const int count);
+
 /// Free any resources allocated by forwarding (including `additional_info`).
 void clean_up_forwarding(void);
 
@@ -29,10 +38,23 @@ extern char *additional_info;
 /// The port to which forwarded identd queries are directed (default 113).
 extern unsigned ident_port;
 
+/// Keep connections to forwarding destinations open after the response,
+/// and reuse them for further queries to the same destination? This is
+/// only useful for long-running processes, and the destination must
+/// support multiple queries per connection (others will simply cause
+/// a new connection to be opened each time).
+extern _Bool keep_forward_connections;
+
 /// Has forwarding been attempted?
 /// 
 /// This is used to distinguish cases where no connection was found from
 /// cases where forwarding was unsuccesful.
 extern _Bool forwarding_attempted;
 
+/// Has forwarding been skipped because the destination has been failing
+/// (see `health.h`)? In this case `forwarding_attempted` is not set, so
+/// the response is the same as for no match, but the query is not cached
+/// as having matched no connection.
+extern _Bool forwarding_skipped;
+
 #endif
@@ -0,0 +1,268 @@
+/*
+ * health.c: Tracking the health of forwarding destinations.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#include "health.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define HEALTH_MAGIC 0x61696868U // "aihh"
+#define HEALTH_VERSION 1
+#define HEALTH_DESTINATIONS 64
+#define HEALTH_FAILURES 3 // consecutive failures to stop forwarding
+#define HEALTH_RETRY_MS 5000 // initially
+#define HEALTH_MAX_RETRY_MS 60000
+#define HEALTH_PROBE_MS 10000 // time allowed for a retry to finish
+#define HEALTH_LOCK_ATTEMPTS 1000
+
+/// The health of a forwarding destination.
+typedef struct destination_health {
+    char name[INET6_ADDRSTRLEN];
+    /// The number of consecutive failures.
+    uint32_t failures;
+    /// The current time between retries while failing.
+    uint32_t retry_ms;
+    /// The time until which queries are not forwarded (0 if forwarding).
+    int64_t closed_until;
+    /// The time until which a retry is in progress.
+    int64_t probe_until;
+    /// The time of the last report.
+    int64_t last_report;
+    /// The average time taken by successful forwards.
+    uint32_t average_ms;
+    uint64_t successes;
+    uint64_t total_failures;
+} destination_health;
+
+/// The state shared between processes.
+typedef struct health_state {
+    uint32_t magic;
+    uint32_t version;
+    unsigned char lock;
+    uint32_t count;
+    destination_health destinations[HEALTH_DESTINATIONS];
+} health_state;
+
+static health_state *shared = NULL;
+
+/// Returns the current monotonic time in milliseconds (the same for all
+/// processes).
+static int64_t
+now_milliseconds(void) {
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+        return (int64_t) monotonic_time() * 1000;
+    }
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/// Acquire the lock of `shared`. Returns `false` if it could not be
+/// acquired (e.g., if a process died holding it).
+static bool
+lock(void) {
+    for (int i = 0; i < HEALTH_LOCK_ATTEMPTS; ++i) {
+        if (!__atomic_test_and_set(&(shared->lock), __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+        (void) sched_yield();
+    }
+    debug("HL could not acquire lock");
+    return false;
+}
+
+static void
+unlock(void) {
+    __atomic_clear(&(shared->lock), __ATOMIC_RELEASE);
+}
+
+/// Returns the state of `destination`, or `NULL` if there is none. If
+/// `add` is set, a missing destination is added, replacing the one least
+/// recently reported if full.
+static destination_health *
+find_destination(const char * const destination, const bool add) {
+    uint32_t count = __atomic_load_n(&(shared->count), __ATOMIC_ACQUIRE);
+    if (count > HEALTH_DESTINATIONS) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        if (strcmp(shared->destinations[i].name, destination) == 0) {
+            return &(shared->destinations[i]);
+        }
+    }
+    if (!add) {
+        return NULL;
+    }
+
+    // Add the destination (other processes may be doing the same)
+    destination_health *result = NULL;
+    block_timeout();
+    if (lock()) {
+        count = shared->count;
+        for (uint32_t i = 0; i < count && !result; ++i) {
+            if (strcmp(shared->destinations[i].name, destination) == 0) {
+                result = &(shared->destinations[i]);
+            }
+        }
+        if (!result) {
+            if (count < HEALTH_DESTINATIONS) {
+                result = &(shared->destinations[count]);
+                __atomic_store_n(&(shared->count), count + 1, __ATOMIC_RELEASE);
+            } else {
+                result = &(shared->destinations[0]);
+                for (uint32_t i = 1; i < count; ++i) {
+                    if (shared->destinations[i].last_report < result->last_report) {
+                        result = &(shared->destinations[i]);
+                    }
+                }
+                debug("HL forgetting %s", result->name);
+            }
+            (void) memset(result, 0, sizeof *result);
+            (void) snprintf(result->name, sizeof result->name, "%s", destination);
+        }
+        unlock();
+    }
+    unblock_timeout();
+
+    return result;
+}
+
+bool
+enable_health(const char * const path) {
+    if (shared) {
+        return true;
+    }
+
+    health_state *state;
+    if (path) {
+        const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            warning(path);
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || (st.st_size < (off_t) sizeof *state
+                                   && ftruncate(fd, sizeof *state) < 0)) {
+            warning(path);
+            (void) close(fd);
+            return false;
+        }
+        state = mmap(NULL, sizeof *state, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        (void) close(fd);
+    } else {
+        state = mmap(NULL, sizeof *state, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+    if (state == MAP_FAILED) {
+        warning("mmap (health)");
+        return false;
+    }
+
+    if (state->magic != HEALTH_MAGIC || state->version != HEALTH_VERSION) {
+        // A new file (or one from an incompatible version)
+        (void) memset(state, 0, sizeof *state);
+        state->magic = HEALTH_MAGIC;
+        state->version = HEALTH_VERSION;
+    }
+
+    shared = state;
+    return true;
+}
+
+bool
+health_allow(const char * const destination) {
+    if (!shared) {
+        return true;
+    }
+    destination_health * const d = find_destination(destination, false);
+    if (!d) {
+        return true;
+    }
+
+    const int64_t closed_until = __atomic_load_n(&(d->closed_until), __ATOMIC_ACQUIRE);
+    if (!closed_until) {
+        return true;
+    }
+
+    const int64_t now = now_milliseconds();
+    if (closed_until > now && closed_until - now <= HEALTH_MAX_RETRY_MS) {
+        debug("HL not forwarding to failing %s for %lld ms", destination,
+              (long long) (closed_until - now));
+        return false;
+    }
+
+    // Due to be tried again, but only by one query at a time
+    int64_t probe_until = __atomic_load_n(&(d->probe_until), __ATOMIC_ACQUIRE);
+    if (probe_until > now && probe_until - now <= HEALTH_PROBE_MS) {
+        debug("HL retry of %s already in progress", destination);
+        return false;
+    }
+    if (!__atomic_compare_exchange_n(&(d->probe_until), &probe_until, now + HEALTH_PROBE_MS,
+                                     false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    notice("Retrying forwarding to failing %s", destination);
+    return true;
+}
+
+void
+health_report(const char * const destination, const bool success,
+              const long long milliseconds) {
+    if (!shared) {
+        return;
+    }
+    destination_health * const d = find_destination(destination, !success);
+    if (!d) {
+        return;
+    }
+
+    const int64_t now = now_milliseconds();
+    __atomic_store_n(&(d->last_report), now, __ATOMIC_RELAXED);
+
+    if (success) {
+        (void) __atomic_fetch_add(&(d->successes), 1, __ATOMIC_RELAXED);
+        const uint32_t average = __atomic_load_n(&(d->average_ms), __ATOMIC_RELAXED);
+        const uint32_t sample = (milliseconds > 0) ? (uint32_t) milliseconds : 0;
+        __atomic_store_n(&(d->average_ms), average ? (average * 7 + sample) / 8 : sample,
+                         __ATOMIC_RELAXED);
+
+        if (__atomic_exchange_n(&(d->failures), 0, __ATOMIC_ACQ_REL) >= HEALTH_FAILURES) {
+            notice("Forwarding to %s recovered", destination);
+        }
+        __atomic_store_n(&(d->retry_ms), 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&(d->closed_until), 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&(d->probe_until), 0, __ATOMIC_RELEASE);
+        return;
+    }
+
+    (void) __atomic_fetch_add(&(d->total_failures), 1, __ATOMIC_RELAXED);
+    const uint32_t failures = __atomic_add_fetch(&(d->failures), 1, __ATOMIC_ACQ_REL);
+    debug("HL %s failed %u times in a row after %lld ms", destination, failures, milliseconds);
+    if (failures < HEALTH_FAILURES) {
+        return;
+    }
+
+    uint32_t retry_ms = __atomic_load_n(&(d->retry_ms), __ATOMIC_RELAXED);
+    retry_ms = retry_ms ? retry_ms * 2 : HEALTH_RETRY_MS;
+    if (retry_ms > HEALTH_MAX_RETRY_MS) {
+        retry_ms = HEALTH_MAX_RETRY_MS;
+    }
+    __atomic_store_n(&(d->retry_ms), retry_ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&(d->closed_until), now + retry_ms, __ATOMIC_RELEASE);
+    __atomic_store_n(&(d->probe_until), 0, __ATOMIC_RELEASE);
+    notice("Forwarding to %s failed %u times, not forwarding for %u s",
+           destination, failures, retry_ms / 1000);
+}
@@ -0,0 +1,38 @@
+/*
+ * health.h: Tracking the health of forwarding destinations.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#ifndef AIDENTD_HEALTH_H
+#define AIDENTD_HEALTH_H
+
+#include "aidentd.h"
+
+#include <stdbool.h>
+
+/// Enable tracking the outcomes of forwarding to each destination, so that
+/// queries are not forwarded to a destination that keeps failing (e.g., a
+/// host that has been powered off) until it has had time to recover. Such
+/// a destination is then tried again by a single query at a time, with the
+/// time between attempts doubling while it fails.
+///
+/// The state is kept in the file at `path` if not `NULL`, shared by every
+/// process that maps it (e.g., each process started by `inetd`), and
+/// otherwise in memory shared by the processes forked after this call
+/// (i.e., the worker processes of the daemon). The file must be opened
+/// before dropping privileges if it is not accessible afterwards. Returns
+/// `true` on success.
+bool enable_health(const char * const path);
+
+/// Returns `false` if queries should not be forwarded to `destination`,
+/// because it has been failing and is not yet due to be tried again.
+bool health_allow(const char * const destination);
+
+/// Record the outcome of forwarding to `destination`: `success` if it
+/// responded, and the time taken in `milliseconds`.
+void health_report(const char * const destination, const bool success,
+                   const long long milliseconds);
+
+#endif
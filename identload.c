@@ -0,0 +1,502 @@
+/*
+ * identload.c: Load generator and latency benchmark for Ident servers.
+ * aidentd
+ *
+ * Opens real TCP connections over the loopback interface to have something
+ * for the server to look up, then queries the server about them at the
+ * given rate and concurrency, and reports the throughput, latency and
+ * distribution of responses.
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+const static char * const PROGRAM_NAME = "identload";
+
+#define RESPONSE_MAX_LENGTH 1056
+#define MAX_CONCURRENCY 10000
+#define MAX_EVENTS 256
+
+/// The outcome of a query.
+enum outcome {
+    OUTCOME_USERID = 0,
+    OUTCOME_NO_USER,
+    OUTCOME_HIDDEN_USER,
+    OUTCOME_OTHER_ERROR,
+    OUTCOME_INVALID,
+    OUTCOME_NO_RESPONSE,
+    OUTCOME_TIMEOUT,
+    OUTCOME_CONNECT_ERROR,
+    OUTCOME_COUNT
+};
+
+static const char * const outcome_names[OUTCOME_COUNT] = {
+    "USERID",
+    "NO-USER",
+    "HIDDEN-USER",
+    "other ERROR",
+    "invalid response",
+    "no response",
+    "timeout",
+    "connect failed"
+};
+
+/// A query in progress.
+typedef struct client {
+    int fd;
+    bool sent;
+    long long started;
+    size_t length;
+    char query[32];
+    char response[RESPONSE_MAX_LENGTH];
+} client;
+
+/// A loopback connection to be looked up by the server.
+typedef struct pair {
+    unsigned local_port;
+    unsigned remote_port;
+} pair;
+
+static const char *server_host = "127.0.0.1";
+static const char *server_port = "113";
+static unsigned concurrency = 10;
+static unsigned long total_queries = 10000;
+static unsigned duration = 0;
+static unsigned rate = 0;
+static unsigned timeout_ms = 5000;
+static unsigned pair_count = 100;
+
+static pair *pairs;
+static client *clients;
+static unsigned *free_clients;
+static unsigned free_count;
+
+/// The latencies of answered queries in microseconds.
+static struct {
+    uint32_t *values;
+    size_t count;
+    size_t capacity;
+} latencies = { NULL, 0, 0 };
+
+static unsigned long outcomes[OUTCOME_COUNT];
+
+static int epoll_fd = -1;
+
+/// Print the `message` and the error message for `errno`, then exit.
+static void
+fail(const char * const message) {
+    perror(message);
+    exit(EXIT_FAILURE);
+}
+
+/// Returns the current monotonic time in microseconds.
+static long long
+now_microseconds(void) {
+    struct timespec now;
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/// Raise the limit of open files to accommodate the connections.
+static void
+raise_file_limit(void) {
+    const rlim_t needed = (rlim_t) pair_count * 2 + concurrency + 64;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur >= needed) {
+        return;
+    }
+    limit.rlim_cur = (limit.rlim_max == RLIM_INFINITY || limit.rlim_max > needed) ? needed : limit.rlim_max;
+    (void) setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+/// Open `pair_count` TCP connections over the loopback interface for the
+/// server to look up. The connections are left open until exit.
+static void
+open_pairs(void) {
+    pairs = calloc(pair_count, sizeof *pairs);
+    if (!pairs) {
+        fail("calloc");
+    }
+
+    const int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        fail("socket");
+    }
+    struct sockaddr_in address = { .sin_family = AF_INET };
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t size = sizeof address;
+    if (bind(listen_fd, (struct sockaddr *) &address, sizeof address) < 0
+        || listen(listen_fd, SOMAXCONN) < 0
+        || getsockname(listen_fd, (struct sockaddr *) &address, &size) < 0) {
+        fail("bind");
+    }
+
+    for (unsigned i = 0; i < pair_count; ++i) {
+        const int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *) &address, sizeof address) < 0) {
+            fail("connect (loopback)");
+        }
+        if (accept(listen_fd, NULL, NULL) < 0) {
+            fail("accept (loopback)");
+        }
+
+        struct sockaddr_in local;
+        size = sizeof local;
+        if (getsockname(fd, (struct sockaddr *) &local, &size) < 0) {
+            fail("getsockname");
+        }
+        pairs[i].local_port = ntohs(local.sin_port);
+        pairs[i].remote_port = ntohs(address.sin_port);
+    }
+
+    (void) close(listen_fd);
+}
+
+/// Record the `latency` of an answered query.
+static void
+record_latency(const long long latency) {
+    if (latencies.count == latencies.capacity) {
+        const size_t capacity = latencies.capacity ? latencies.capacity * 2 : 4096;
+        uint32_t * const values = realloc(latencies.values, capacity * sizeof *values);
+        if (!values) {
+            fail("realloc");
+        }
+        latencies.values = values;
+        latencies.capacity = capacity;
+    }
+    latencies.values[latencies.count++] = (uint32_t) (latency > UINT32_MAX ? UINT32_MAX : latency);
+}
+
+/// Returns the outcome for the `response`.
+static enum outcome
+classify_response(const char * const response) {
+    const char *type = strchr(response, ':');
+    if (!type) {
+        return OUTCOME_INVALID;
+    }
+    ++type;
+    while (*type == ' ' || *type == '\t') {
+        ++type;
+    }
+    if (strncmp(type, "USERID", 6) == 0) {
+        return OUTCOME_USERID;
+    }
+    if (strncmp(type, "ERROR", 5) != 0) {
+        return OUTCOME_INVALID;
+    }
+    if (strstr(type, "NO-USER")) {
+        return OUTCOME_NO_USER;
+    }
+    if (strstr(type, "HIDDEN-USER")) {
+        return OUTCOME_HIDDEN_USER;
+    }
+    return OUTCOME_OTHER_ERROR;
+}
+
+/// Finish the query of the client at `index` with `outcome`.
+static void
+finish_client(const unsigned index, const enum outcome outcome) {
+    client * const c = &clients[index];
+    if (outcome <= OUTCOME_INVALID) {
+        record_latency(now_microseconds() - c->started);
+    }
+    ++outcomes[outcome];
+    (void) close(c->fd);
+    c->fd = -1;
+    free_clients[free_count++] = index;
+}
+
+/// Start a query about the connection `p`. Returns `false` if it could
+/// not be started.
+static bool
+start_client(const struct addrinfo * const server, const pair * const p) {
+    const unsigned index = free_clients[--free_count];
+    client * const c = &clients[index];
+
+    c->started = now_microseconds();
+    c->sent = false;
+    c->length = 0;
+    (void) snprintf(c->query, sizeof c->query, "%u, %u\r\n", p->local_port, p->remote_port);
+
+    c->fd = socket(server->ai_family, server->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                   server->ai_protocol);
+    if (c->fd < 0) {
+        perror("socket");
+        free_clients[free_count++] = index;
+        return false;
+    }
+    if (connect(c->fd, server->ai_addr, server->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        finish_client(index, OUTCOME_CONNECT_ERROR);
+        return true;
+    }
+
+    struct epoll_event event = { .events = EPOLLOUT, .data.u32 = index };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &event) < 0) {
+        fail("epoll_ctl");
+    }
+    return true;
+}
+
+/// Handle the `events` on the client at `index`.
+static void
+service_client(const unsigned index, const uint32_t events) {
+    client * const c = &clients[index];
+
+    if (!c->sent) {
+        int error = 0;
+        socklen_t size = sizeof error;
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &size) < 0 || error) {
+            finish_client(index, OUTCOME_CONNECT_ERROR);
+            return;
+        }
+        const size_t length = strlen(c->query);
+        if (send(c->fd, c->query, length, MSG_NOSIGNAL) != (ssize_t) length) {
+            finish_client(index, OUTCOME_NO_RESPONSE);
+            return;
+        }
+        c->sent = true;
+        struct epoll_event event = { .events = EPOLLIN, .data.u32 = index };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &event) < 0) {
+            fail("epoll_ctl");
+        }
+        return;
+    }
+
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+
+    const ssize_t received = recv(c->fd, c->response + c->length,
+                                  sizeof(c->response) - 1 - c->length, 0);
+    if (received < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (received <= 0) {
+        if (c->length) {
+            c->response[c->length] = '\0';
+            finish_client(index, classify_response(c->response));
+        } else {
+            finish_client(index, OUTCOME_NO_RESPONSE);
+        }
+        return;
+    }
+    c->length += (size_t) received;
+    c->response[c->length] = '\0';
+    if (strchr(c->response, '\n') || c->length >= sizeof(c->response) - 1) {
+        finish_client(index, classify_response(c->response));
+    }
+}
+
+/// Time out queries that have taken longer than `timeout_ms`.
+static void
+expire_clients(const long long current_time) {
+    for (unsigned i = 0; i < concurrency; ++i) {
+        if (clients[i].fd >= 0 && current_time - clients[i].started >= (long long) timeout_ms * 1000) {
+            finish_client(i, OUTCOME_TIMEOUT);
+        }
+    }
+}
+
+static int
+compare_latencies(const void * const a, const void * const b) {
+    const uint32_t x = *(const uint32_t *) a;
+    const uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+/// Returns the latency at `percentile` from the sorted latencies.
+static uint32_t
+latency_percentile(const double percentile) {
+    if (!latencies.count) {
+        return 0;
+    }
+    size_t index = (size_t) (percentile / 100.0 * (double) latencies.count);
+    if (index >= latencies.count) {
+        index = latencies.count - 1;
+    }
+    return latencies.values[index];
+}
+
+/// Print the results for the run that took `elapsed` microseconds.
+static void
+report(const long long elapsed) {
+    unsigned long completed = 0;
+    for (int i = 0; i < OUTCOME_COUNT; ++i) {
+        completed += outcomes[i];
+    }
+    const double seconds = (double) elapsed / 1000000.0;
+
+    qsort(latencies.values, latencies.count, sizeof *latencies.values, compare_latencies);
+
+    (void) printf("queries:  %lu in %.3f s (%.0f qps)\n", completed, seconds,
+                  seconds > 0 ? (double) completed / seconds : 0.0);
+    (void) printf("latency:  p50 %u us, p99 %u us, p99.9 %u us, max %u us\n",
+                  latency_percentile(50.0), latency_percentile(99.0), latency_percentile(99.9),
+                  latencies.count ? latencies.values[latencies.count - 1] : 0);
+    for (int i = 0; i < OUTCOME_COUNT; ++i) {
+        if (outcomes[i]) {
+            (void) printf("%-17s %lu\n", outcome_names[i], outcomes[i]);
+        }
+    }
+}
+
+static void
+usage(void) {
+    (void) fprintf(stderr,
+        "Usage: %s [options]\n\n"
+        "  -h host       Ident server to query (default %s).\n"
+        "  -p port       Port of the Ident server (default %s).\n"
+        "  -c count      Number of concurrent queries (default %u).\n"
+        "  -n count      Total number of queries (default %lu).\n"
+        "  -d seconds    Run for the given time instead of a number of queries.\n"
+        "  -r qps        Start queries at the given rate (default as fast as\n"
+        "                the concurrency allows).\n"
+        "  -t ms         Timeout for each query (default %u).\n"
+        "  -l count      Number of loopback connections to query about\n"
+        "                (default %u).\n\n"
+        "The server must be able to see the loopback connections (i.e., run on\n"
+        "the same host) for the queries to be answered with USERID.\n",
+        PROGRAM_NAME, server_host, server_port, concurrency, total_queries, timeout_ms,
+        pair_count);
+    exit(EXIT_SUCCESS);
+}
+
+/// Returns the numeric value of `arg`, exiting if it is not in the range
+/// from `min` to `max`.
+static unsigned long
+numeric_argument(const char * const arg, const unsigned long min, const unsigned long max) {
+    char *end = NULL;
+    const unsigned long value = arg ? strtoul(arg, &end, 10) : 0;
+    if (!arg || *end || value < min || value > max) {
+        errno = EINVAL;
+        fail(arg ? arg : "Missing value");
+    }
+    return value;
+}
+
+int
+main(int argc, char *argv[]) {
+    int option;
+    while ((option = getopt(argc, argv, "h:p:c:n:d:r:t:l:")) != -1) {
+        switch (option) {
+        case 'h':
+            server_host = optarg;
+            break;
+        case 'p':
+            server_port = optarg;
+            break;
+        case 'c':
+            concurrency = (unsigned) numeric_argument(optarg, 1, MAX_CONCURRENCY);
+            break;
+        case 'n':
+            total_queries = numeric_argument(optarg, 1, ULONG_MAX);
+            break;
+        case 'd':
+            duration = (unsigned) numeric_argument(optarg, 1, 86400);
+            break;
+        case 'r':
+            rate = (unsigned) numeric_argument(optarg, 1, 10000000);
+            break;
+        case 't':
+            timeout_ms = (unsigned) numeric_argument(optarg, 1, 600000);
+            break;
+        case 'l':
+            pair_count = (unsigned) numeric_argument(optarg, 1, 30000);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *server = NULL;
+    const int status = getaddrinfo(server_host, server_port, &hints, &server);
+    if (status) {
+        (void) fprintf(stderr, "%s: %s\n", server_host, gai_strerror(status));
+        return EXIT_FAILURE;
+    }
+
+    raise_file_limit();
+    open_pairs();
+
+    clients = calloc(concurrency, sizeof *clients);
+    free_clients = calloc(concurrency, sizeof *free_clients);
+    if (!clients || !free_clients) {
+        fail("calloc");
+    }
+    for (unsigned i = 0; i < concurrency; ++i) {
+        clients[i].fd = -1;
+        free_clients[free_count++] = concurrency - 1 - i;
+    }
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        fail("epoll_create1");
+    }
+
+    const long long start_time = now_microseconds();
+    const long long end_time = duration ? start_time + (long long) duration * 1000000 : 0;
+    const long long interval = rate ? 1000000 / rate : 0;
+    long long next_start = start_time;
+    unsigned long started = 0;
+
+    for (;;) {
+        long long current_time = now_microseconds();
+        const bool starting = duration ? current_time < end_time : started < total_queries;
+
+        while (starting && free_count && (!rate || current_time >= next_start)) {
+            if (!start_client(server, &pairs[started % pair_count])) {
+                break;
+            }
+            ++started;
+            next_start += interval;
+            if (!duration && started >= total_queries) {
+                break;
+            }
+        }
+
+        if (!starting && free_count == concurrency) {
+            break;
+        }
+
+        int wait = 10;
+        if (starting && rate && free_count) {
+            const long long until_next = (next_start - current_time) / 1000;
+            wait = until_next < wait ? (int) (until_next > 0 ? until_next : 0) : wait;
+        }
+
+        struct epoll_event events[MAX_EVENTS];
+        const int count = epoll_wait(epoll_fd, events, MAX_EVENTS, wait);
+        if (count < 0 && errno != EINTR) {
+            fail("epoll_wait");
+        }
+        for (int i = 0; i < count; ++i) {
+            service_client(events[i].data.u32, events[i].events);
+        }
+
+        expire_clients(now_microseconds());
+    }
+
+    report(now_microseconds() - start_time);
+
+    freeaddrinfo(server);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1239 @@
+/*
+ * listener.c: Listening for connections as a standalone daemon.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // accept4, CPU_SET
+#endif
+
+#include "listener.h"
+#include "uring.h"
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <linux/filter.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+unsigned listen_port = 113;
+
+const char *listen_address = NULL;
+
+unsigned connection_timeout = 5;
+
+bool multiple_queries = false;
+
+unsigned worker_count = 1;
+
+bool pin_workers = false;
+
+unsigned batch_window = 0;
+
+bool use_io_uring = false;
+
+unsigned idle_timeout = 0;
+
+#define MAX_ADDRESSES 8
+#define MAX_LISTENERS (MAX_ADDRESSES * MAX_WORKERS)
+#define MAX_INPUTS 8
+#define MAX_CONNECTIONS 1024
+#define MAX_EVENTS 64
+#define MAX_BATCH 256
+#define NO_TIMEOUT (24 * 60 * 60) // seconds for "no" timeout
+
+#define RING_ENTRIES 256
+#define RING_CQ_ENTRIES 4096
+#define ACCEPT_SLOTS 4 // concurrent accepts per listening socket
+
+// The operation in the low bits of the io_uring user data (the rest is a
+// pointer to the `watched`, or 0 for cancellations)
+#define RING_RECEIVE 0 // accept, poll, or recv
+#define RING_SEND 1
+#define RING_OP_MASK 3
+
+/// The type of a watched file descriptor.
+enum watch_type {
+    WATCH_LISTENER = 0,
+    WATCH_CONNECTION,
+    WATCH_INPUT
+};
+
+/// A file descriptor watched by the event loop.
+typedef struct watched {
+    enum watch_type type;
+    int fd;
+} watched;
+
+/// Another file descriptor serviced by the event loop.
+typedef struct input {
+    watched watch;
+    void (*handler)(void);
+} input;
+
+/// The state of a client connection.
+typedef struct connection {
+    watched watch;
+    struct connection *next;
+    struct connection *previous;
+    struct sockaddr_storage peer;
+    struct sockaddr_storage local;
+    time_t deadline;
+    uint32_t events;
+    bool at_eof;
+    bool skip_line;
+    bool batched;
+    bool prepared;
+    struct connection *batch_next;
+    uint64_t in_flight;
+    bool closing;
+    size_t query_length;
+    size_t line_length;
+    size_t response_length;
+    size_t response_sent;
+    char query[QUERY_MAX_LENGTH];
+    char response[RESPONSE_MAX_LENGTH];
+} connection;
+
+/// An accept operation on a listening socket (with io_uring).
+typedef struct accept_slot {
+    watched watch;
+    struct sockaddr_storage peer;
+    socklen_t peersize;
+} accept_slot;
+
+/// The listening sockets.
+static watched listeners[MAX_LISTENERS];
+
+/// The number of listening sockets in `listeners`.
+static int listener_count = 0;
+
+/// The worker process serving each of `listeners`.
+static unsigned listener_workers[MAX_LISTENERS];
+
+/// The worker process index of this process.
+static unsigned worker_index = 0;
+
+/// Other watched file descriptors.
+static input inputs[MAX_INPUTS];
+
+/// The number of watched file descriptors in `inputs`.
+static int input_count = 0;
+
+/// The epoll instance.
+static int epoll_fd = -1;
+
+/// Are connections served with io_uring instead of epoll?
+static bool ring_enabled = false;
+
+/// Open connections in order of their deadlines (oldest first).
+static struct {
+    connection *first;
+    connection *last;
+    unsigned count;
+} connections = { NULL, NULL, 0 };
+
+/// The time of the last new connection (for `idle_timeout`).
+static long long last_connection_time = 0;
+
+/// Queries waiting to be answered together (in order of arrival).
+static struct {
+    connection *first;
+    connection *last;
+    int count;
+    long long deadline;
+} batch = { NULL, NULL, 0, 0 };
+
+/// Returns the current monotonic time in milliseconds.
+static long long
+monotonic_milliseconds(void) {
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+        return (long long) monotonic_time() * 1000;
+    }
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/// Open a listening socket for the address `ai`. Returns the socket,
+/// or -1 on error.
+static int
+open_listener_socket(const struct addrinfo * const ai) {
+    const int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          ai->ai_protocol);
+    if (fd < 0) {
+        debug("LS socket: %s", strerror(errno));
+        return -1;
+    }
+
+    const int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) < 0) {
+        warning("SO_REUSEADDR");
+    }
+    if (worker_count > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) < 0) {
+        warning("SO_REUSEPORT");
+        (void) close(fd);
+        return -1;
+    }
+    if (ai->ai_family == AF_INET6 && !listen_address) {
+        // Accept also IPv4 on the wildcard address
+        const int off = 0;
+        (void) setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof off);
+    }
+
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 || listen(fd, SOMAXCONN) < 0) {
+        warning("bind");
+        (void) close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/// Steer the connections arriving to the group of `SO_REUSEPORT` sockets
+/// including `fd` to the socket of the worker with the same index as the
+/// CPU processing the connection (modulo the number of workers). The
+/// sockets in the group are indexed in the order they were bound.
+static void
+steer_by_cpu(const int fd) {
+    struct sock_filter code[] = {
+        // A = current CPU
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t) (SKF_AD_OFF + SKF_AD_CPU)),
+        // A = A % worker_count
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, worker_count),
+        // return A (the socket index)
+        BPF_STMT(BPF_RET | BPF_A, 0)
+    };
+    struct sock_fprog program = {
+        .len = (unsigned short) (sizeof code / sizeof *code),
+        .filter = code
+    };
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof program) < 0) {
+        warning("SO_ATTACH_REUSEPORT_CBPF");
+    }
+}
+
+/// Open a listening socket for the address `ai` for each worker.
+/// Returns `true` on success.
+static bool
+open_listener(const struct addrinfo * const ai) {
+    if (listener_count + (int) worker_count > MAX_LISTENERS) {
+        notice("Too many listening addresses, ignoring the rest");
+        return false;
+    }
+
+    for (unsigned worker = 0; worker < worker_count; ++worker) {
+        const int fd = open_listener_socket(ai);
+        if (fd < 0) {
+            // Close the sockets of other workers for the same address
+            while (worker--) {
+                (void) close(listeners[--listener_count].fd);
+            }
+            return false;
+        }
+
+        listeners[listener_count].type = WATCH_LISTENER;
+        listeners[listener_count].fd = fd;
+        listener_workers[listener_count] = worker;
+        ++listener_count;
+    }
+
+    if (pin_workers && worker_count > 1) {
+        steer_by_cpu(listeners[listener_count - (int) worker_count].fd);
+    }
+
+    return true;
+}
+
+/// Is `fd` a listening stream socket?
+static bool
+is_listening_socket(const int fd) {
+    int listening = 0;
+    int type = 0;
+    socklen_t size = sizeof listening;
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &size) < 0 || !listening) {
+        return false;
+    }
+    size = sizeof type;
+    return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &size) == 0 && type == SOCK_STREAM;
+}
+
+/// Add the inherited listening socket `fd` to `listeners`. Returns `true`
+/// on success.
+static bool
+inherit_listener(const int fd) {
+    if (!is_listening_socket(fd)) {
+        debug("LS inherited fd %d is not a listening socket", fd);
+        return false;
+    }
+    if (listener_count >= MAX_ADDRESSES) {
+        notice("Too many inherited sockets, ignoring fd %d", fd);
+        return false;
+    }
+
+    const int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        warning("fcntl (inherited listener)");
+        return false;
+    }
+    (void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    listeners[listener_count].type = WATCH_LISTENER;
+    listeners[listener_count].fd = fd;
+    listener_workers[listener_count] = 0;
+    ++listener_count;
+    return true;
+}
+
+bool
+inherit_listeners(void) {
+    const char * const pid = getenv("LISTEN_PID");
+    const char * const fds = getenv("LISTEN_FDS");
+
+    if (pid && fds && strtol(pid, NULL, 10) == (long) getpid()) {
+        // systemd socket activation: the sockets begin at fd 3
+        const int count = atoi(fds);
+        for (int i = 0; i < count; ++i) {
+            (void) inherit_listener(3 + i);
+        }
+        (void) unsetenv("LISTEN_PID");
+        (void) unsetenv("LISTEN_FDS");
+        (void) unsetenv("LISTEN_FDNAMES");
+    } else if (is_listening_socket(STDIN_FILENO)) {
+        // inetd "wait" service: the socket is stdin
+        (void) inherit_listener(STDIN_FILENO);
+    }
+
+    if (listener_count == 0) {
+        return false;
+    }
+    if (worker_count > 1) {
+        notice("Inherited sockets are served by a single process");
+        worker_count = 1;
+    }
+    notice("Serving %d inherited socket%s", listener_count, (listener_count == 1) ? "" : "s");
+    return true;
+}
+
+void
+open_listeners(void) {
+    char port[8];
+    struct addrinfo *addresses = NULL;
+    struct addrinfo hints = {
+        .ai_family = listen_address ? AF_UNSPEC : AF_INET6,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV
+    };
+
+    (void) snprintf(port, sizeof port, "%u", listen_port);
+
+    int error_result = getaddrinfo(listen_address, port, &hints, &addresses);
+    if (error_result && !listen_address) {
+        // IPv6 may be unavailable
+        hints.ai_family = AF_INET;
+        error_result = getaddrinfo(listen_address, port, &hints, &addresses);
+    }
+    if (error_result) {
+        errno = EINVAL;
+        error(gai_strerror(error_result));
+    }
+
+    for (const struct addrinfo *ai = addresses; ai; ai = ai->ai_next) {
+        (void) open_listener(ai);
+    }
+    freeaddrinfo(addresses);
+
+    if (listener_count == 0 && !listen_address) {
+        // Fall back to IPv4 only
+        hints.ai_family = AF_INET;
+        if (getaddrinfo(NULL, port, &hints, &addresses) == 0) {
+            for (const struct addrinfo *ai = addresses; ai; ai = ai->ai_next) {
+                (void) open_listener(ai);
+            }
+            freeaddrinfo(addresses);
+        }
+    }
+
+    if (listener_count == 0) {
+        error("Could not listen on any address");
+    }
+
+    notice("Listening on %s port %u", listen_address ? listen_address : "all addresses",
+           listen_port);
+}
+
+bool
+watch_input(const int fd, void (* const handler)(void)) {
+    if (input_count >= MAX_INPUTS || !handler) {
+        return false;
+    }
+    inputs[input_count].watch.type = WATCH_INPUT;
+    inputs[input_count].watch.fd = fd;
+    inputs[input_count].handler = handler;
+    ++input_count;
+    return true;
+}
+
+/// Pin this process to the CPU corresponding to `worker_index`.
+static void
+pin_to_cpu(void) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET((int) (worker_index % (unsigned long) cpus), &set);
+    if (sched_setaffinity(0, sizeof set, &set) < 0) {
+        warning("sched_setaffinity");
+    }
+}
+
+void
+start_workers(void) {
+    if (worker_count <= 1) {
+        return;
+    }
+
+    pid_t workers[MAX_WORKERS];
+
+    for (unsigned i = 0; i < worker_count; ++i) {
+        const pid_t pid = fork();
+        if (pid < 0) {
+            error("fork");
+        }
+        if (pid == 0) {
+            // Terminate along with the parent
+            (void) prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+            worker_index = i;
+
+            // Keep only the listening sockets of this worker
+            int count = 0;
+            for (int l = 0; l < listener_count; ++l) {
+                if (listener_workers[l] == worker_index) {
+                    listeners[count++] = listeners[l];
+                } else {
+                    (void) close(listeners[l].fd);
+                }
+            }
+            listener_count = count;
+
+            if (pin_workers) {
+                pin_to_cpu();
+            }
+            debug("LS worker %u started", worker_index);
+            return;
+        }
+        workers[i] = pid;
+    }
+
+    for (int l = 0; l < listener_count; ++l) {
+        (void) close(listeners[l].fd);
+    }
+    listener_count = 0;
+
+    notice("Started %u worker processes", worker_count);
+
+    // If any worker exits, stop the rest and exit (to be restarted)
+    int status = 0;
+    pid_t pid;
+    while ((pid = wait(&status)) < 0 && errno == EINTR);
+
+    if (pid > 0 && WIFSIGNALED(status)) {
+        notice("Worker process %ld killed by signal %d", (long) pid, WTERMSIG(status));
+    } else if (pid > 0) {
+        notice("Worker process %ld exited with status %d", (long) pid, WEXITSTATUS(status));
+    }
+    for (unsigned i = 0; i < worker_count; ++i) {
+        if (workers[i] != pid) {
+            (void) kill(workers[i], SIGTERM);
+        }
+    }
+    exit(EXIT_FAILURE);
+}
+
+/// Convert an IPv4-mapped IPv6 address in `peer` (as obtained from a
+/// dual-stack socket) to a plain IPv4 address, since the connection
+/// being queried is an IPv4 connection.
+static void
+unmap_ipv4_address(struct sockaddr_storage * const peer) {
+    if (peer->ss_family != AF_INET6) {
+        return;
+    }
+    const struct sockaddr_in6 * const ipv6 = (const struct sockaddr_in6 *) peer;
+    if (!IN6_IS_ADDR_V4MAPPED(&(ipv6->sin6_addr))) {
+        return;
+    }
+    struct sockaddr_in ipv4 = {
+        .sin_family = AF_INET,
+        .sin_port = ipv6->sin6_port
+    };
+    (void) memcpy(&(ipv4.sin_addr), ipv6->sin6_addr.s6_addr + 12, sizeof ipv4.sin_addr);
+    (void) memset(peer, 0, sizeof *peer);
+    (void) memcpy(peer, &ipv4, sizeof ipv4);
+}
+
+/// Remove the connection `c` from the list of open connections.
+static void
+unlink_connection(connection * const c) {
+    if (c->previous) {
+        c->previous->next = c->next;
+    } else {
+        connections.first = c->next;
+    }
+    if (c->next) {
+        c->next->previous = c->previous;
+    } else {
+        connections.last = c->previous;
+    }
+    c->next = NULL;
+    c->previous = NULL;
+    --connections.count;
+}
+
+/// Append the connection `c` to the list of open connections, and set its
+/// deadline. Connections have the same timeout, so this keeps them in order.
+static void
+append_connection(connection * const c) {
+    c->deadline = monotonic_time() + (connection_timeout ? connection_timeout : NO_TIMEOUT);
+    c->previous = connections.last;
+    if (connections.last) {
+        connections.last->next = c;
+    } else {
+        connections.first = c;
+    }
+    connections.last = c;
+    ++connections.count;
+}
+
+/// Add the connection `c` to the batch of queries to be answered together.
+static void
+add_to_batch(connection * const c) {
+    c->batched = true;
+    c->batch_next = NULL;
+    if (batch.last) {
+        batch.last->batch_next = c;
+    } else {
+        batch.first = c;
+        batch.deadline = monotonic_milliseconds() + batch_window;
+    }
+    batch.last = c;
+    ++batch.count;
+}
+
+/// Remove the connection `c` from the batch of queries.
+static void
+remove_from_batch(connection * const c) {
+    connection *previous = NULL;
+    for (connection *b = batch.first; b; previous = b, b = b->batch_next) {
+        if (b != c) {
+            continue;
+        }
+        if (previous) {
+            previous->batch_next = c->batch_next;
+        } else {
+            batch.first = c->batch_next;
+        }
+        if (batch.last == c) {
+            batch.last = previous;
+        }
+        --batch.count;
+        break;
+    }
+    c->batched = false;
+    c->batch_next = NULL;
+}
+
+#ifndef NO_IO_URING
+/// Returns the io_uring user data for the operation `op` on `w`.
+static uint64_t
+ring_data(watched * const w, const unsigned op) {
+    return (uint64_t) (uintptr_t) w | op;
+}
+
+/// Submit the operation on `c` corresponding to its `events` (`EPOLLOUT`
+/// to send the response, `EPOLLIN` to receive input), unless one is
+/// already in flight. Returns `true` on success.
+static bool
+submit_connection(connection * const c) {
+    if (c->in_flight || !(c->events & (EPOLLIN | EPOLLOUT))) {
+        return true;
+    }
+
+    struct io_uring_sqe * const sqe = uring_sqe();
+    if (!sqe) {
+        notice("io_uring queue full, dropping a connection");
+        return false;
+    }
+    sqe->fd = c->watch.fd;
+    if (c->events & EPOLLOUT) {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (uint64_t) (uintptr_t) (c->response + c->response_sent);
+        sqe->len = (uint32_t) (c->response_length - c->response_sent);
+        sqe->msg_flags = MSG_NOSIGNAL;
+        c->in_flight = ring_data(&(c->watch), RING_SEND);
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->addr = (uint64_t) (uintptr_t) (c->query + c->query_length);
+        sqe->len = (uint32_t) (sizeof(c->query) - 1 - c->query_length);
+        c->in_flight = ring_data(&(c->watch), RING_RECEIVE);
+    }
+    sqe->user_data = c->in_flight;
+    return true;
+}
+
+/// Cancel the operation with the user data `user_data`. Returns `true`
+/// if the cancellation was submitted.
+static bool
+cancel_operation(const uint64_t user_data) {
+    struct io_uring_sqe * const sqe = uring_sqe();
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = 0;
+    return true;
+}
+#endif
+
+/// Close the connection `c` and free its resources.
+static void
+close_connection(connection * const c) {
+    if (c->batched) {
+        remove_from_batch(c);
+    }
+    unlink_connection(c);
+    (void) close(c->watch.fd);
+#ifndef NO_IO_URING
+    if (c->in_flight) {
+        // Free the connection when the cancelled operation completes
+        c->closing = true;
+        if (!cancel_operation(c->in_flight)) {
+            debug("LS can not cancel io_uring operation");
+        }
+        return;
+    }
+#endif
+    free(c);
+}
+
+/// Set the epoll `events` to wait for on the connection `c` (with io_uring,
+/// submit the corresponding operation). Returns `true` on success.
+static bool
+watch_connection(connection * const c, const uint32_t events) {
+#ifndef NO_IO_URING
+    if (ring_enabled) {
+        c->events = events;
+        return submit_connection(c);
+    }
+#endif
+    if (c->events == events) {
+        return true;
+    }
+    struct epoll_event event = { .events = events, .data.ptr = c };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->watch.fd, &event) < 0) {
+        warning("epoll_ctl (mod)");
+        return false;
+    }
+    c->events = events;
+    return true;
+}
+
+/// Start serving the accepted connection `client_fd` from `peer`.
+static void
+add_connection(const int client_fd, const struct sockaddr_storage * const peer) {
+    if (connections.count >= MAX_CONNECTIONS) {
+        notice("Too many connections, dropping a new one");
+        (void) close(client_fd);
+        return;
+    }
+
+    last_connection_time = monotonic_milliseconds();
+
+    connection * const c = calloc(1, sizeof *c);
+    if (!c) {
+        warning("calloc");
+        (void) close(client_fd);
+        return;
+    }
+    c->watch.type = WATCH_CONNECTION;
+    c->watch.fd = client_fd;
+    c->peer = *peer;
+    unmap_ipv4_address(&(c->peer));
+
+    socklen_t localsize = sizeof c->local;
+    if (getsockname(client_fd, (struct sockaddr *) &(c->local), &localsize) < 0) {
+        c->local.ss_family = AF_UNSPEC;
+    }
+    unmap_ipv4_address(&(c->local));
+
+    if (ring_enabled) {
+        append_connection(c);
+        if (!watch_connection(c, EPOLLIN | EPOLLRDHUP)) {
+            close_connection(c);
+        }
+        return;
+    }
+
+    c->events = EPOLLIN | EPOLLRDHUP;
+    struct epoll_event event = { .events = c->events, .data.ptr = c };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event) < 0) {
+        warning("epoll_ctl (add)");
+        (void) close(client_fd);
+        free(c);
+        return;
+    }
+
+    append_connection(c);
+}
+
+/// Accept all pending connections from the listening socket `fd`.
+static void
+accept_connections(const int fd) {
+    for (;;) {
+        struct sockaddr_storage peer;
+        socklen_t peersize = sizeof peer;
+
+        const int client_fd = accept4(fd, (struct sockaddr *) &peer, &peersize,
+                                      SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                warning("accept");
+            }
+            return;
+        }
+
+        add_connection(client_fd, &peer);
+    }
+}
+
+/// Send as much of the pending response of `c` as possible. Returns `true`
+/// if the entire response has been sent, `false` otherwise.
+static bool
+send_response(connection * const c) {
+    if (ring_enabled) {
+        // Sent by io_uring (see `watch_connection`)
+        return c->response_sent >= c->response_length;
+    }
+    while (c->response_sent < c->response_length) {
+        const ssize_t sent = send(c->watch.fd, c->response + c->response_sent,
+                                  c->response_length - c->response_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            debug("LS send: %s", strerror(errno));
+            c->response_sent = c->response_length;
+            break;
+        }
+        c->response_sent += (size_t) sent;
+    }
+    return true;
+}
+
+/// Prepare the connection `c` for its next query after the current one has
+/// been answered. Returns `false` if the connection should be closed instead.
+static bool
+next_query(connection * const c) {
+    if (!multiple_queries) {
+        return false;
+    }
+
+    // Keep any further input after the answered line
+    c->query_length -= c->line_length;
+    (void) memmove(c->query, c->query + c->line_length, c->query_length + 1);
+    c->line_length = 0;
+    c->response_length = 0;
+    c->response_sent = 0;
+
+    // Restart the timeout for the next query
+    unlink_connection(c);
+    append_connection(c);
+
+    return true;
+}
+
+/// Delimit the next query line in the input of `c` (setting its
+/// `line_length`), discarding empty lines and the rest of any line that
+/// was too long. Returns `false` if there is no line to answer yet.
+static bool
+delimit_line(connection * const c) {
+    for (;;) {
+        size_t length = 0;
+        while (length < c->query_length && c->query[length] != '\r' && c->query[length] != '\n') {
+            ++length;
+        }
+
+        if (c->skip_line || length == 0) {
+            // Discard the rest of a line that was too long, and empty lines
+            // (such as the LF after CR)
+            if (length < c->query_length) {
+                c->skip_line = false;
+                ++length;
+            }
+            c->query_length -= length;
+            (void) memmove(c->query, c->query + length, c->query_length + 1);
+            if (c->query_length) {
+                continue;
+            }
+            return false;
+        }
+
+        if (length < c->query_length) {
+            // Complete line
+            c->query[length] = '\0';
+            c->line_length = length + 1;
+        } else if (c->at_eof) {
+            // Answer even without EOL
+            c->line_length = length;
+        } else if (c->query_length >= sizeof(c->query) - 1) {
+            debug("LS query too long");
+            c->line_length = length;
+            c->skip_line = true;
+        } else {
+            // Wait for the rest of the line
+            return false;
+        }
+        return true;
+    }
+}
+
+/// Answer each complete query line in `c` (as well as any incomplete line
+/// at EOF or in a full buffer), and start sending the responses. Returns
+/// `true` if the connection is done and can be closed.
+static bool
+answer_connection(connection * const c) {
+    for (;;) {
+        if (!c->line_length && !delimit_line(c)) {
+            if (c->at_eof && c->query_length == 0) {
+                return true;
+            }
+            return !watch_connection(c, EPOLLIN | EPOLLRDHUP);
+        }
+
+        if (batch_window && !c->prepared) {
+            // Wait for other queries to answer together
+            add_to_batch(c);
+            return !watch_connection(c, 0);
+        }
+        c->prepared = false;
+
+        trace_begin();
+        const int response_length = answer_query(c->query, &(c->peer), &(c->local),
+                                                 c->response, sizeof c->response);
+        if (response_length > 0) {
+            c->response_length = (size_t) response_length;
+            c->response_sent = 0;
+
+            if (!send_response(c)) {
+                // Wait for the socket to become writable
+                trace_end();
+                return !watch_connection(c, EPOLLOUT);
+            }
+            trace_phase("write");
+        }
+        trace_end();
+
+        if (!next_query(c)) {
+            return true;
+        }
+    }
+}
+
+/// Answer the batch of queries together. Returns the number of
+/// milliseconds until the next batch is due, or -1 if there is none.
+static int
+answer_batch(void) {
+    if (!batch.count) {
+        return -1;
+    }
+    const long long current_time = monotonic_milliseconds();
+    if (batch.count < MAX_BATCH && current_time < batch.deadline) {
+        return (int) (batch.deadline - current_time);
+    }
+
+    connection *c = batch.first;
+    const int count = batch.count;
+    batch.first = NULL;
+    batch.last = NULL;
+    batch.count = 0;
+
+    char *lines[MAX_BATCH];
+    int n = 0;
+    for (connection *b = c; b && n < MAX_BATCH; b = b->batch_next) {
+        lines[n++] = b->query;
+    }
+
+    debug("LS answering a batch of %d queries", count);
+    prepare_queries(lines, n);
+
+    while (c) {
+        connection * const next = c->batch_next;
+        c->batched = false;
+        c->batch_next = NULL;
+        c->prepared = true;
+        if (answer_connection(c)) {
+            close_connection(c);
+        }
+        c = next;
+    }
+
+    end_prepared_queries();
+
+    return batch.count ? (int) batch_window : -1;
+}
+
+/// Add `received` bytes read into the input buffer of `c`. Returns `true`
+/// if there may be a query line to answer.
+static bool
+add_input(connection * const c, const size_t received) {
+    const size_t start = c->query_length;
+    c->query_length += received;
+    c->query[c->query_length] = '\0';
+
+    return c->query_length >= sizeof(c->query) - 1
+        || memchr(c->query + start, '\n', received)
+        || memchr(c->query + start, '\r', received);
+}
+
+/// Read available input from `c`. Returns `true` if the connection is
+/// done and can be closed.
+static bool
+read_connection(connection * const c) {
+    for (;;) {
+        const size_t space = sizeof(c->query) - 1 - c->query_length;
+        if (space == 0) {
+            return answer_connection(c);
+        }
+
+        const ssize_t received = recv(c->watch.fd, c->query + c->query_length, space, 0);
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            debug("LS recv: %s", strerror(errno));
+            return true;
+        }
+        if (received == 0) {
+            if (c->query_length == 0) {
+                debug("LS connection closed by the remote");
+            }
+            c->at_eof = true;
+            return answer_connection(c);
+        }
+
+        if (add_input(c, (size_t) received)) {
+            return answer_connection(c);
+        }
+    }
+}
+
+/// Close connections that have passed their deadline. Returns the number
+/// of milliseconds until the next deadline, or -1 if there are none.
+static int
+expire_connections(void) {
+    const time_t current_time = monotonic_time();
+
+    while (connections.first && connections.first->deadline <= current_time) {
+        debug("LS connection timed out");
+        close_connection(connections.first);
+    }
+
+    if (!connections.first) {
+        return -1;
+    }
+    return (int) (connections.first->deadline - current_time) * 1000;
+}
+
+/// Close expired connections and answer the batch of queries if it is due.
+/// Returns the number of milliseconds to wait for events, or -1 to wait
+/// indefinitely.
+static int
+handle_timeouts(void) {
+    int timeout = expire_connections();
+    const int batch_timeout = answer_batch();
+    if (batch_timeout >= 0 && (timeout < 0 || batch_timeout < timeout)) {
+        timeout = batch_timeout;
+    }
+
+    if (idle_timeout && connections.count == 0 && batch.count == 0) {
+        const long long idle = monotonic_milliseconds() - last_connection_time;
+        if (idle >= (long long) idle_timeout * 1000) {
+            notice("No connections for %u seconds, exiting", idle_timeout);
+            exit(EXIT_SUCCESS);
+        }
+        const int idle_remaining = (int) ((long long) idle_timeout * 1000 - idle);
+        if (timeout < 0 || idle_remaining < timeout) {
+            timeout = idle_remaining;
+        }
+    }
+
+    return timeout;
+}
+
+#ifndef NO_IO_URING
+/// Submit an accept operation for `slot`. Returns `true` on success.
+static bool
+submit_accept(accept_slot * const slot) {
+    struct io_uring_sqe * const sqe = uring_sqe();
+    if (!sqe) {
+        return false;
+    }
+    slot->peersize = sizeof slot->peer;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = slot->watch.fd;
+    sqe->addr = (uint64_t) (uintptr_t) &(slot->peer);
+    sqe->addr2 = (uint64_t) (uintptr_t) &(slot->peersize);
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = ring_data(&(slot->watch), RING_RECEIVE);
+    return true;
+}
+
+/// Submit a poll operation for input on `in`. Returns `true` on success.
+static bool
+submit_poll(input * const in) {
+    struct io_uring_sqe * const sqe = uring_sqe();
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = in->watch.fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = ring_data(&(in->watch), RING_RECEIVE);
+    return true;
+}
+
+/// Handle the completion of the operation `op` on `c` with `result`.
+/// Returns `true` if the connection is done and can be closed.
+static bool
+complete_connection(connection * const c, const unsigned op, const int result) {
+    if (result < 0) {
+        if (result == -EINTR || result == -EAGAIN) {
+            return !submit_connection(c);
+        }
+        debug("LS %s: %s", op == RING_SEND ? "send" : "recv", strerror(-result));
+        return true;
+    }
+
+    if (op == RING_SEND) {
+        c->response_sent += (size_t) result;
+        if (c->response_sent < c->response_length) {
+            return !submit_connection(c);
+        }
+        return !next_query(c) || answer_connection(c);
+    }
+
+    if (result == 0) {
+        if (c->query_length == 0) {
+            debug("LS connection closed by the remote");
+        }
+        c->at_eof = true;
+        return answer_connection(c);
+    }
+
+    if (add_input(c, (size_t) result)) {
+        return answer_connection(c);
+    }
+    return !submit_connection(c);
+}
+
+/// Serve connections with io_uring, so that accepting connections, reading
+/// queries and sending responses are submitted to the kernel together with
+/// a single system call per iteration. Returns only if io_uring can not be
+/// set up.
+static void
+serve_ring(void) {
+    if (!uring_open(RING_ENTRIES, RING_CQ_ENTRIES)) {
+        return;
+    }
+
+    accept_slot * const slots = calloc((size_t) listener_count * ACCEPT_SLOTS, sizeof *slots);
+    if (!slots) {
+        warning("calloc");
+        return;
+    }
+    ring_enabled = true;
+
+    for (int i = 0; i < listener_count * ACCEPT_SLOTS; ++i) {
+        slots[i].watch = listeners[i / ACCEPT_SLOTS];
+        if (!submit_accept(&slots[i])) {
+            error("io_uring (accept)");
+        }
+    }
+
+    for (int i = 0; i < input_count; ++i) {
+        if (!submit_poll(&inputs[i])) {
+            error("io_uring (poll)");
+        }
+    }
+
+    debug("LS serving connections with io_uring");
+
+    for (;;) {
+        if (!uring_wait(handle_timeouts())) {
+            error("io_uring_enter");
+        }
+
+        uint64_t user_data;
+        int32_t result;
+        while (uring_completion(&user_data, &result)) {
+            watched * const w = (watched *) (uintptr_t) (user_data & ~(uint64_t) RING_OP_MASK);
+            const unsigned op = (unsigned) (user_data & RING_OP_MASK);
+
+            if (!w) {
+                // Cancellation
+                continue;
+            }
+
+            if (w->type == WATCH_LISTENER) {
+                accept_slot * const slot = (accept_slot *) w;
+                if (result >= 0) {
+                    add_connection(result, &(slot->peer));
+                } else if (result != -EINTR && result != -EAGAIN && result != -ECONNABORTED) {
+                    errno = -result;
+                    warning("accept");
+                }
+                if (!submit_accept(slot)) {
+                    error("io_uring (accept)");
+                }
+                continue;
+            }
+            if (w->type == WATCH_INPUT) {
+                input * const in = (input *) w;
+                in->handler();
+                if (!submit_poll(in)) {
+                    error("io_uring (poll)");
+                }
+                continue;
+            }
+
+            connection * const c = (connection *) w;
+            c->in_flight = 0;
+            if (c->closing) {
+                free(c);
+                continue;
+            }
+
+            if (complete_connection(c, op, result)) {
+                close_connection(c);
+            }
+        }
+    }
+}
+#endif
+
+NORETURN void
+serve_connections(void) {
+    (void) signal(SIGPIPE, SIG_IGN);
+    last_connection_time = monotonic_milliseconds();
+
+    if (use_io_uring) {
+#ifndef NO_IO_URING
+        serve_ring();
+#endif
+        notice("io_uring not available, using epoll");
+    }
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        error("epoll_create1");
+    }
+
+    for (int i = 0; i < listener_count; ++i) {
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = &listeners[i] };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listeners[i].fd, &event) < 0) {
+            error("epoll_ctl (listener)");
+        }
+    }
+
+    for (int i = 0; i < input_count; ++i) {
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = &inputs[i] };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inputs[i].watch.fd, &event) < 0) {
+            error("epoll_ctl (input)");
+        }
+    }
+
+    debug("LS serving connections");
+
+    for (;;) {
+        struct epoll_event events[MAX_EVENTS];
+
+        const int count = epoll_wait(epoll_fd, events, MAX_EVENTS, handle_timeouts());
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error("epoll_wait");
+        }
+
+        for (int i = 0; i < count; ++i) {
+            watched * const w = events[i].data.ptr;
+
+            if (w->type == WATCH_LISTENER) {
+                accept_connections(w->fd);
+                continue;
+            }
+            if (w->type == WATCH_INPUT) {
+                ((input *) w)->handler();
+                continue;
+            }
+
+            connection * const c = (connection *) w;
+            bool done = false;
+
+            if (c->batched) {
+                // Answered with the batch, unless the client is gone (hangups
+                // and errors are reported even when not waiting for events)
+                if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                    debug("LS batched connection hung up");
+                    close_connection(c);
+                }
+                continue;
+            }
+
+            if (events[i].events & EPOLLOUT) {
+                done = send_response(c) && (!next_query(c) || answer_connection(c));
+            } else if (c->response_length) {
+                // Error or hangup while waiting to send the response
+                done = true;
+            } else {
+                done = read_connection(c);
+            }
+
+            if (done) {
+                close_connection(c);
+            }
+        }
+    }
+}
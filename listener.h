@@ -0,0 +1,93 @@
+/*
+ * listener.h: Listening for connections as a standalone daemon.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#ifndef AIDENTD_LISTENER_H
+#define AIDENTD_LISTENER_H
+
+#include "aidentd.h"
+
+#include <stdbool.h>
+
+/// The port on which to listen for connections (default 113).
+extern unsigned listen_port;
+
+/// The numeric address on which to listen, or `NULL` for all addresses.
+extern const char *listen_address;
+
+/// The timeout in seconds for reading the query and writing the response.
+extern unsigned connection_timeout;
+
+/// Answer multiple queries per connection, until EOF or until no query
+/// arrives within `connection_timeout`? Otherwise each connection is closed
+/// after answering the first query.
+extern bool multiple_queries;
+
+/// The time in milliseconds to wait for further queries to arrive, so that
+/// they can all be answered together with a single lookup of the local
+/// connections (see `prepare_queries`). If 0, each query is answered as
+/// soon as it arrives.
+extern unsigned batch_window;
+
+/// Serve connections with io_uring instead of epoll? This submits the
+/// accepting of connections, reading of queries and sending of responses
+/// to the kernel in batches, rather than making a system call for each.
+/// Falls back to epoll if io_uring is not available (it requires Linux
+/// 5.11 or later, and may be disabled), or if built with `NO_IO_URING`.
+extern bool use_io_uring;
+
+/// The number of seconds without connections after which to exit, or 0
+/// to never exit. This allows a service manager (or `inetd`) to start the
+/// process on demand for a burst of connections.
+extern unsigned idle_timeout;
+
+/// The maximum number of worker processes.
+#define MAX_WORKERS 64
+
+/// The number of worker processes serving connections (default 1). If
+/// more than one, each worker has its own listening sockets bound to the
+/// same address with `SO_REUSEPORT`, so that the kernel distributes the
+/// connections between them.
+extern unsigned worker_count;
+
+/// Pin each worker process to its own CPU, and steer connections to the
+/// worker on the CPU processing them?
+extern bool pin_workers;
+
+/// Open the listening sockets at `listen_address` port `listen_port`.
+/// This needs to be done before dropping privileges if the port is
+/// privileged (as the ident port 113 is). Exits on failure.
+void open_listeners(void);
+
+/// Use the listening sockets passed by a service manager instead of opening
+/// them: either by `systemd` socket activation (`LISTEN_FDS` with
+/// `Accept=no`), or as stdin by `inetd` (a `wait` service). The inherited
+/// sockets are served by a single process. Returns `true` if any listening
+/// sockets were inherited, in which case `open_listeners` must not be
+/// called.
+bool inherit_listeners(void);
+
+/// Watch the file descriptor `fd` in the event loop of `serve_connections`,
+/// calling `handler` whenever it becomes readable. This allows other
+/// long-lived sockets (e.g., event subscriptions) to be serviced between
+/// queries. Must be called before `serve_connections`. Returns `true` on
+/// success.
+bool watch_input(const int fd, void (* const handler)(void));
+
+/// Start `worker_count` worker processes (if more than one) to serve
+/// connections on the sockets opened by `open_listeners`. Returns in each
+/// worker process, while the parent process waits for the workers and
+/// exits if any of them exits. This should be called after dropping
+/// privileges, but before setting up anything specific to a process.
+void start_workers(void);
+
+/// Serve connections on the sockets opened by `open_listeners`, answering
+/// each query with `answer_query`. Connections are handled by an event
+/// loop in this single process, so the per-query cost is only that of the
+/// lookup itself. Does not return.
+NORETURN void serve_connections(void);
+
+#endif
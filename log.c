@@ -7,18 +7,50 @@
 
 #include "aidentd.h"
 
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
 #include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
+
+#define LOG_RING_SIZE 1024 // must be a power of 2
+#define LOG_LINE_SIZE 512
+#define LOG_DRAIN_WAIT_MS 1000
 
 int verbosity = 2;
 
 static bool log_to_syslog = false;
 
+/// A message waiting to be written by the flusher thread.
+typedef struct log_entry {
+    int priority;
+    const char *prefix; // on stderr only
+    char text[LOG_LINE_SIZE];
+} log_entry;
+
+/// The ring of messages from the main thread (the only producer) to
+/// the flusher thread (the only consumer).
+static struct {
+    log_entry *entries;
+    unsigned head;
+    unsigned tail;
+    unsigned long dropped;
+    int sleeping;
+    int wake_fd;
+} ring = { NULL, 0, 0, 0, 0, -1 };
+
+/// Is logging done asynchronously via `ring`?
+static bool log_async = false;
+
 void
 open_log(const char * const name, bool use_syslog) {
     log_to_syslog = use_syslog;
@@ -27,6 +59,152 @@ open_log(const char * const name, bool use_syslog) {
     }
 }
 
+/// Write the message `text` with `priority`, or with `prefix` on stderr.
+static void
+write_message(const int priority, const char * const prefix, const char * const text) {
+    if (log_to_syslog) {
+        syslog(priority, "%s", text);
+    } else {
+        (void) fputs(prefix, stderr);
+        (void) fputs(text, stderr);
+        (void) fputc('\n', stderr);
+    }
+}
+
+/// Log the message formatted from `format` and `args` with `priority`, or
+/// with `prefix` on stderr.
+static void
+log_message(const int priority, const char * const prefix, const char * restrict format,
+            va_list args) {
+    if (!log_async) {
+        if (log_to_syslog) {
+            vsyslog(priority, format, args);
+        } else {
+            (void) fputs(prefix, stderr);
+            (void) vfprintf(stderr, format, args);
+            (void) fputc('\n', stderr);
+        }
+        return;
+    }
+
+    const unsigned tail = ring.tail;
+    if (tail - __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+        (void) __atomic_fetch_add(&ring.dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    log_entry * const entry = &ring.entries[tail & (LOG_RING_SIZE - 1)];
+    entry->priority = priority;
+    entry->prefix = prefix;
+    (void) vsnprintf(entry->text, sizeof entry->text, format, args);
+    __atomic_store_n(&ring.tail, tail + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_exchange_n(&ring.sleeping, 0, __ATOMIC_SEQ_CST)) {
+        const uint64_t one = 1;
+        (void) write(ring.wake_fd, &one, sizeof one);
+    }
+}
+
+/// Log a message formatted as with `printf`, via `log_message`.
+static void
+log_formatted(const int priority, const char * const prefix, const char * restrict format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_message(priority, prefix, format, args);
+    va_end(args);
+}
+
+/// Write the messages from `ring` as they arrive.
+static void *
+flush_messages(void * const arg) {
+    (void) arg;
+    unsigned head = ring.head;
+
+    for (;;) {
+        while (head != __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE)) {
+            const log_entry * const entry = &ring.entries[head & (LOG_RING_SIZE - 1)];
+            write_message(entry->priority, entry->prefix, entry->text);
+            __atomic_store_n(&ring.head, ++head, __ATOMIC_RELEASE);
+        }
+
+        const unsigned long dropped = __atomic_exchange_n(&ring.dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) {
+            char text[64];
+            (void) snprintf(text, sizeof text, "Log full, %lu messages dropped", dropped);
+            write_message(LOG_WARNING, "Warning: ", text);
+        }
+        if (!log_to_syslog) {
+            (void) fflush(stderr);
+        }
+
+        // Sleep until woken up by the next message
+        __atomic_store_n(&ring.sleeping, 1, __ATOMIC_SEQ_CST);
+        if (head != __atomic_load_n(&ring.tail, __ATOMIC_SEQ_CST)
+            && __atomic_exchange_n(&ring.sleeping, 0, __ATOMIC_SEQ_CST)) {
+            continue;
+        }
+        uint64_t count;
+        while (read(ring.wake_fd, &count, sizeof count) < 0 && errno == EINTR);
+    }
+
+    return NULL;
+}
+
+/// Wait (a limited time) for the flusher thread to write pending messages.
+static void
+drain_log(void) {
+    const struct timespec delay = { .tv_nsec = 1000000 };
+    for (int i = 0; i < LOG_DRAIN_WAIT_MS; ++i) {
+        if (__atomic_load_n(&ring.head, __ATOMIC_ACQUIRE) == ring.tail) {
+            break;
+        }
+        (void) nanosleep(&delay, NULL);
+    }
+}
+
+bool
+enable_async_log(void) {
+    if (log_async) {
+        return true;
+    }
+
+    ring.entries = calloc(LOG_RING_SIZE, sizeof *ring.entries);
+    if (!ring.entries) {
+        warning("calloc (log)");
+        return false;
+    }
+    if ((ring.wake_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        warning("eventfd (log)");
+        free(ring.entries);
+        ring.entries = NULL;
+        return false;
+    }
+
+    // Signals (especially the query timeout) must go to the main thread
+    sigset_t all, previous;
+    (void) sigfillset(&all);
+    (void) pthread_sigmask(SIG_BLOCK, &all, &previous);
+
+    pthread_t thread;
+    const int result = pthread_create(&thread, NULL, flush_messages, NULL);
+    (void) pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (result != 0) {
+        errno = result;
+        warning("pthread_create (log)");
+        (void) close(ring.wake_fd);
+        ring.wake_fd = -1;
+        free(ring.entries);
+        ring.entries = NULL;
+        return false;
+    }
+    (void) pthread_detach(thread);
+
+    log_async = true;
+    (void) atexit(drain_log);
+    return true;
+}
+
 void
 debug(const char * restrict format, ...) {
     if (verbosity < 3) {
@@ -34,13 +212,7 @@ debug(const char * restrict format, ...) {
     }
     va_list args;
     va_start(args, format);
-    if (log_to_syslog) {
-        vsyslog((verbosity > 3) ? LOG_NOTICE : LOG_DEBUG, format, args);
-    } else {
-        (void) fputs("# ", stderr);
-        (void) vfprintf(stderr, format, args);
-        (void) fputc('\n', stderr);
-    }
+    log_message((verbosity > 3) ? LOG_NOTICE : LOG_DEBUG, "# ", format, args);
     va_end(args);
 }
 
@@ -51,13 +223,7 @@ notice(const char * restrict format, ...) {
     }
     va_list args;
     va_start(args, format);
-    if (log_to_syslog) {
-        vsyslog(LOG_NOTICE, format, args);
-    } else {
-        (void) fputs("Notice: ", stderr);
-        (void) vfprintf(stderr, format, args);
-        (void) fputc('\n', stderr);
-    }
+    log_message(LOG_NOTICE, "Notice: ", format, args);
     va_end(args);
 }
 
@@ -67,20 +233,22 @@ warning(const char * const msg) {
         return;
     }
     if (log_to_syslog) {
-        syslog(LOG_WARNING, "Warning: %s: %s", msg, strerror(errno));
+        log_formatted(LOG_WARNING, "", "Warning: %s: %s", msg, strerror(errno));
     } else {
-        (void) fputs("Warning: ", stderr);
-        perror(msg);
+        log_formatted(LOG_WARNING, "Warning: ", "%s: %s", msg, strerror(errno));
     }
 }
 
 NORETURN void
 error(const char * const msg) {
+    const int error_number = errno;
+    if (log_async) {
+        drain_log();
+    }
     if (log_to_syslog) {
-        syslog(LOG_ERR, "ERROR: %s: %s", msg, strerror(errno));
+        syslog(LOG_ERR, "ERROR: %s: %s", msg, strerror(error_number));
     } else {
-        (void) fputs("ERROR: ", stderr);
-        perror(msg);
+        (void) fprintf(stderr, "ERROR: %s: %s\n", msg, strerror(error_number));
     }
     closelog();
     exit(EXIT_FAILURE);
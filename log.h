@@ -13,6 +13,15 @@
 /// Initialise logging. Must be called before anything is logged.
 void open_log(const char * const name, _Bool use_syslog);
 
+/// Write log messages asynchronously from a background thread, so that
+/// logging never blocks the caller (e.g., when syslog is slow). Messages
+/// are passed to the thread via a fixed-size ring; if it fills up, further
+/// messages are dropped and their number is logged once there is room.
+/// Errors (which exit the program) are still logged synchronously. This
+/// is only useful for long-running processes, and must be called after
+/// forking any worker processes. Returns `true` on success.
+_Bool enable_async_log(void);
+
 /// Verbosity of logging; 0 is errors only and 3 is the maximum.
 extern int verbosity;
 
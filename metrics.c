@@ -0,0 +1,598 @@
+/*
+ * metrics.c: Counters and latency histograms for monitoring.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // accept4
+#endif
+
+#include "metrics.h"
+#include "listener.h"
+
+#include <sched.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define METRICS_DESTINATIONS 32
+#define METRICS_LOCK_ATTEMPTS 1000
+#define METRICS_CLIENTS 8 // per process
+#define METRICS_CLIENT_TIMEOUT 5 // seconds
+
+/// The upper bounds of the latency histogram buckets in microseconds.
+static const uint32_t bucket_bounds[] = {
+    500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000
+};
+
+#define METRICS_BUCKETS ((int) (sizeof bucket_bounds / sizeof *bucket_bounds) + 1)
+
+/// The response types, with the last one for all others.
+static const char * const response_types[] = {
+    "USERID", "NO-USER", "HIDDEN-USER", "INVALID-PORT", "UNKNOWN-ERROR", "other"
+};
+
+#define RESPONSE_TYPES ((int) (sizeof response_types / sizeof *response_types))
+
+/// A histogram of latencies.
+typedef struct histogram {
+    uint64_t buckets[METRICS_BUCKETS];
+    uint64_t count;
+    uint64_t sum; // microseconds
+} histogram;
+
+/// The metrics (in memory shared between processes).
+typedef struct metrics {
+    uint64_t counters[METRIC_COUNTERS];
+    uint64_t responses[RESPONSE_TYPES];
+    histogram stages[METRIC_STAGES];
+    unsigned char destination_lock;
+    unsigned destination_count;
+    struct {
+        char name[INET6_ADDRSTRLEN];
+        histogram latency;
+    } destinations[METRICS_DESTINATIONS];
+} metrics;
+
+static const char * const counter_names[METRIC_COUNTERS][2] = {
+    { "queries", "Ident queries received." },
+    { "invalid_queries", "Queries that could not be parsed." },
+    { "netlink_hits", "Queries matched to local connections." },
+    { "conntrack_hits", "Queries matched to masqueraded connections." },
+    { "forwards", "Queries forwarded to masqueraded hosts." },
+    { "forward_failures", "Forwarded queries without a user id in the response." },
+    { "timeouts", "Queries that timed out." },
+    { "negative_cache_hits", "Queries answered from the cache of misses." },
+    { "rate_limited", "Queries dropped for exceeding the rate limit." },
+    { "replica_hits", "Masqueraded connections answered from replicas." }
+};
+
+static const char * const stage_names[METRIC_STAGES] = {
+    "netlink", "conntrack", "forward"
+};
+
+/// The shared metrics, or `NULL` if not enabled.
+static metrics *shared = NULL;
+
+/// The socket serving the metrics.
+static int metrics_fd = -1;
+
+/// Is `metrics_fd` a Unix socket (i.e., not HTTP)?
+static bool metrics_unix = false;
+
+/// Returns the current monotonic time in microseconds.
+static long long
+monotonic_microseconds(void) {
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+        return 0;
+    }
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/// Add `value` to `counter` atomically.
+static void
+add(uint64_t * const counter, const uint64_t value) {
+    (void) __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+/// Returns the value of `counter`.
+static uint64_t
+get(const uint64_t * const counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/// Record the `latency` in microseconds in the histogram `h`.
+static void
+record(histogram * const h, const uint64_t latency) {
+    int bucket = 0;
+    while (bucket < METRICS_BUCKETS - 1 && latency > bucket_bounds[bucket]) {
+        ++bucket;
+    }
+    add(&(h->buckets[bucket]), 1);
+    add(&(h->count), 1);
+    add(&(h->sum), latency);
+}
+
+/// Returns the histogram for `destination`, adding it if there is room,
+/// or `NULL` if there is not.
+static histogram *
+destination_histogram(const char * const destination) {
+    unsigned count = __atomic_load_n(&(shared->destination_count), __ATOMIC_ACQUIRE);
+    for (unsigned i = 0; i < count; ++i) {
+        if (strcmp(shared->destinations[i].name, destination) == 0) {
+            return &(shared->destinations[i].latency);
+        }
+    }
+    if (count >= METRICS_DESTINATIONS) {
+        return NULL;
+    }
+
+    // Add the destination (other processes may be doing the same), but
+    // give up rather than wait on a lock left by a process that died
+    histogram *result = NULL;
+    block_timeout();
+    bool locked = false;
+    for (int i = 0; i < METRICS_LOCK_ATTEMPTS && !locked; ++i) {
+        locked = !__atomic_test_and_set(&(shared->destination_lock), __ATOMIC_ACQUIRE);
+        if (!locked) {
+            (void) sched_yield();
+        }
+    }
+    if (!locked) {
+        unblock_timeout();
+        debug("MT could not acquire lock, not recording %s", destination);
+        return NULL;
+    }
+    count = shared->destination_count;
+    for (unsigned i = 0; i < count; ++i) {
+        if (strcmp(shared->destinations[i].name, destination) == 0) {
+            result = &(shared->destinations[i].latency);
+            break;
+        }
+    }
+    if (!result && count < METRICS_DESTINATIONS) {
+        (void) snprintf(shared->destinations[count].name, sizeof shared->destinations[count].name,
+                        "%s", destination);
+        result = &(shared->destinations[count].latency);
+        __atomic_store_n(&(shared->destination_count), count + 1, __ATOMIC_RELEASE);
+    }
+    __atomic_clear(&(shared->destination_lock), __ATOMIC_RELEASE);
+    unblock_timeout();
+
+    return result;
+}
+
+void
+metric_count(const enum metric_counter counter) {
+    if (shared) {
+        add(&(shared->counters[counter]), 1);
+    }
+}
+
+void
+metric_response(const char * const type) {
+    if (!shared) {
+        return;
+    }
+    int i = 0;
+    while (i < RESPONSE_TYPES - 1 && strcmp(type, response_types[i])) {
+        ++i;
+    }
+    add(&(shared->responses[i]), 1);
+}
+
+long long
+metric_stage_start(void) {
+    return shared ? monotonic_microseconds() : 0;
+}
+
+void
+metric_stage_done(const enum metric_stage stage, const long long start,
+                  const char * const destination) {
+    if (!shared || !start) {
+        return;
+    }
+    const long long elapsed = monotonic_microseconds() - start;
+    const uint64_t latency = elapsed > 0 ? (uint64_t) elapsed : 0;
+
+    record(&(shared->stages[stage]), latency);
+
+    if (destination) {
+        histogram * const h = destination_histogram(destination);
+        if (h) {
+            record(h, latency);
+        }
+    }
+}
+
+/// Write the histogram `h` as `name` with the `labels` to `out`.
+static void
+write_histogram(FILE * const out, const char * const name, const char * const labels,
+                const histogram * const h) {
+    uint64_t cumulative = 0;
+    for (int i = 0; i < METRICS_BUCKETS; ++i) {
+        cumulative += get(&(h->buckets[i]));
+        if (i < METRICS_BUCKETS - 1) {
+            (void) fprintf(out, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels,
+                           bucket_bounds[i] / 1e6, (unsigned long long) cumulative);
+        } else {
+            (void) fprintf(out, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels,
+                           (unsigned long long) cumulative);
+        }
+    }
+    (void) fprintf(out, "%s_sum{%s} %.6f\n", name, labels, get(&(h->sum)) / 1e6);
+    (void) fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long) get(&(h->count)));
+}
+
+/// Write the metrics to `out` in the Prometheus text format.
+static void
+write_metrics(FILE * const out) {
+    for (int i = 0; i < METRIC_COUNTERS; ++i) {
+        (void) fprintf(out, "# HELP aidentd_%s_total %s\n# TYPE aidentd_%s_total counter\n"
+                       "aidentd_%s_total %llu\n",
+                       counter_names[i][0], counter_names[i][1], counter_names[i][0],
+                       counter_names[i][0], (unsigned long long) get(&(shared->counters[i])));
+    }
+
+    (void) fputs("# HELP aidentd_responses_total Responses sent by type.\n"
+                 "# TYPE aidentd_responses_total counter\n", out);
+    for (int i = 0; i < RESPONSE_TYPES; ++i) {
+        (void) fprintf(out, "aidentd_responses_total{type=\"%s\"} %llu\n", response_types[i],
+                       (unsigned long long) get(&(shared->responses[i])));
+    }
+
+    (void) fputs("# HELP aidentd_stage_duration_seconds Latency of each stage of answering.\n"
+                 "# TYPE aidentd_stage_duration_seconds histogram\n", out);
+    for (int i = 0; i < METRIC_STAGES; ++i) {
+        char labels[32];
+        (void) snprintf(labels, sizeof labels, "stage=\"%s\"", stage_names[i]);
+        write_histogram(out, "aidentd_stage_duration_seconds", labels, &(shared->stages[i]));
+    }
+
+    (void) fputs("# HELP aidentd_forward_duration_seconds Latency of forwarding by destination.\n"
+                 "# TYPE aidentd_forward_duration_seconds histogram\n", out);
+    const unsigned count = __atomic_load_n(&(shared->destination_count), __ATOMIC_ACQUIRE);
+    for (unsigned i = 0; i < count; ++i) {
+        char labels[INET6_ADDRSTRLEN + 32];
+        (void) snprintf(labels, sizeof labels, "destination=\"%s\"", shared->destinations[i].name);
+        write_histogram(out, "aidentd_forward_duration_seconds", labels,
+                        &(shared->destinations[i].latency));
+    }
+}
+
+/// A client of the metrics.
+typedef struct metrics_client {
+    int fd;
+    /// The time after which the client is dropped (monotonic microseconds).
+    long long deadline;
+    /// The end of the HTTP request received so far.
+    char request[4];
+    /// The response (`length` bytes, of which `sent` have been sent), or
+    /// `NULL` while the request is still being received.
+    char *output;
+    size_t length;
+    size_t sent;
+} metrics_client;
+
+static metrics_client clients[METRICS_CLIENTS];
+
+/// The epoll instance for `metrics_fd` and `clients` in this process,
+/// itself watched by the event loop of `serve_connections`.
+static int metrics_epoll = -1;
+
+/// Close the connection to the client `c`.
+static void
+drop_client(metrics_client * const c) {
+    (void) close(c->fd);
+    c->fd = -1;
+    free(c->output);
+    c->output = NULL;
+}
+
+/// Prepare the response to the client `c`, and start sending it.
+/// Returns `true` on success, otherwise the client is dropped.
+static bool
+respond_to_client(metrics_client * const c) {
+    char *text = NULL;
+    size_t length = 0;
+    FILE * const out = open_memstream(&text, &length);
+    if (!out) {
+        warning("open_memstream");
+        drop_client(c);
+        return false;
+    }
+    write_metrics(out);
+    if (fclose(out) != 0) {
+        warning("metrics");
+        free(text);
+        drop_client(c);
+        return false;
+    }
+
+    if (!metrics_unix) {
+        char header[128];
+        const int header_length = snprintf(header, sizeof header,
+                                           "HTTP/1.0 200 OK\r\n"
+                                           "Content-Type: text/plain; version=0.0.4\r\n"
+                                           "Content-Length: %zu\r\n\r\n", length);
+        char * const response = malloc((size_t) header_length + length);
+        if (!response) {
+            warning("malloc (metrics)");
+            free(text);
+            drop_client(c);
+            return false;
+        }
+        (void) memcpy(response, header, (size_t) header_length);
+        (void) memcpy(response + header_length, text, length);
+        free(text);
+        text = response;
+        length += (size_t) header_length;
+    }
+
+    c->output = text;
+    c->length = length;
+    c->sent = 0;
+
+    struct epoll_event event = { .events = EPOLLOUT, .data.u32 = (uint32_t) (c - clients) };
+    if (epoll_ctl(metrics_epoll, EPOLL_CTL_MOD, c->fd, &event) < 0) {
+        warning("MT epoll_ctl");
+        drop_client(c);
+        return false;
+    }
+    return true;
+}
+
+/// Receive the request from the client `c` (whatever it is, so that the
+/// response is not reset), responding once it has been received.
+static void
+read_request(metrics_client * const c) {
+    for (;;) {
+        char buf[512];
+        const ssize_t received = recv(c->fd, buf, sizeof buf, 0);
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            drop_client(c);
+            return;
+        }
+        if (received == 0) {
+            // The client has finished sending
+            (void) respond_to_client(c);
+            return;
+        }
+
+        // Keep the last bytes to find the end of the headers
+        const size_t kept = sizeof c->request;
+        if ((size_t) received >= kept) {
+            (void) memcpy(c->request, buf + received - (ssize_t) kept, kept);
+        } else {
+            (void) memmove(c->request, c->request + received, kept - (size_t) received);
+            (void) memcpy(c->request + kept - (size_t) received, buf, (size_t) received);
+        }
+        if (memcmp(c->request, "\r\n\r\n", kept) == 0 || memcmp(c->request + 2, "\n\n", 2) == 0) {
+            (void) respond_to_client(c);
+            return;
+        }
+    }
+}
+
+/// Send as much of the response to the client `c` as it will take,
+/// closing the connection once all of it has been sent.
+static void
+write_response(metrics_client * const c) {
+    while (c->sent < c->length) {
+        const ssize_t sent = send(c->fd, c->output + c->sent, c->length - c->sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                debug("MT send: %s", strerror(errno));
+                break;
+            }
+            return;
+        }
+        c->sent += (size_t) sent;
+    }
+    drop_client(c);
+}
+
+/// Drop the clients past their deadline.
+static void
+drop_expired_clients(void) {
+    const long long now = monotonic_microseconds();
+    for (int i = 0; i < METRICS_CLIENTS; ++i) {
+        if (clients[i].fd >= 0 && clients[i].deadline < now) {
+            debug("MT dropping a client that did not finish in time");
+            drop_client(&clients[i]);
+        }
+    }
+}
+
+/// Accept the pending metrics clients.
+static void
+accept_clients(void) {
+    drop_expired_clients();
+
+    for (;;) {
+        const int fd = accept4(metrics_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                warning("accept (metrics)");
+            }
+            return;
+        }
+
+        metrics_client *c = NULL;
+        for (int i = 0; i < METRICS_CLIENTS && !c; ++i) {
+            if (clients[i].fd < 0) {
+                c = &clients[i];
+            }
+        }
+        if (!c) {
+            debug("MT too many clients, refusing another");
+            (void) close(fd);
+            continue;
+        }
+
+        c->fd = fd;
+        c->deadline = monotonic_microseconds() + METRICS_CLIENT_TIMEOUT * 1000000LL;
+        (void) memset(c->request, 0, sizeof c->request);
+
+        struct epoll_event event = { .events = EPOLLIN, .data.u32 = (uint32_t) (c - clients) };
+        if (epoll_ctl(metrics_epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+            warning("MT epoll_ctl");
+            drop_client(c);
+            continue;
+        }
+        if (metrics_unix) {
+            // The plain text is sent without waiting for a request
+            (void) respond_to_client(c);
+        }
+    }
+}
+
+/// Handle the events of `metrics_epoll`.
+static void
+handle_metrics_events(void) {
+    struct epoll_event events[METRICS_CLIENTS + 1];
+
+    const int count = epoll_wait(metrics_epoll, events, METRICS_CLIENTS + 1, 0);
+    for (int i = 0; i < count; ++i) {
+        const uint32_t index = events[i].data.u32;
+        if (index >= METRICS_CLIENTS) {
+            accept_clients();
+        } else if (clients[index].fd < 0) {
+            continue;
+        } else if (clients[index].output) {
+            write_response(&clients[index]);
+        } else {
+            read_request(&clients[index]);
+        }
+    }
+}
+
+/// Open the socket for serving metrics at `address`. Returns `true` on success.
+static bool
+open_metrics_socket(const char * const address) {
+    union {
+        struct sockaddr_in in;
+        struct sockaddr_un un;
+    } addr;
+    socklen_t addrsize;
+    (void) memset(&addr, 0, sizeof addr);
+
+    metrics_unix = (address[0] == '/');
+    if (metrics_unix) {
+        if (strlen(address) >= sizeof addr.un.sun_path) {
+            errno = ENAMETOOLONG;
+            warning(address);
+            return false;
+        }
+        addr.un.sun_family = AF_UNIX;
+        (void) strcpy(addr.un.sun_path, address);
+        addrsize = sizeof addr.un;
+        (void) unlink(address);
+    } else {
+        const int port = atoi(address);
+        if (port <= 0 || port > 65535) {
+            errno = EINVAL;
+            warning(address);
+            return false;
+        }
+        addr.in.sin_family = AF_INET;
+        addr.in.sin_port = htons((uint16_t) port);
+        addr.in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addrsize = sizeof addr.in;
+    }
+
+    const int fd = socket(metrics_unix ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        warning("socket (metrics)");
+        return false;
+    }
+    if (!metrics_unix) {
+        const int on = 1;
+        (void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+    }
+    if (bind(fd, (struct sockaddr *) &addr, addrsize) < 0 || listen(fd, 16) < 0) {
+        warning(address);
+        (void) close(fd);
+        return false;
+    }
+
+    metrics_fd = fd;
+    return true;
+}
+
+bool
+enable_metrics(const char * const address) {
+    if (shared) {
+        return true;
+    }
+
+    metrics * const m = mmap(NULL, sizeof *m, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) {
+        warning("mmap (metrics)");
+        return false;
+    }
+
+    if (!open_metrics_socket(address)) {
+        (void) munmap(m, sizeof *m);
+        return false;
+    }
+
+    shared = m;
+    notice("Serving metrics at %s%s", metrics_unix ? "" : "127.0.0.1:", address);
+
+    return true;
+}
+
+bool
+serve_metrics(void) {
+    if (!shared || metrics_epoll >= 0) {
+        return shared != NULL;
+    }
+
+    if ((metrics_epoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        warning("MT epoll_create1");
+        return false;
+    }
+    for (int i = 0; i < METRICS_CLIENTS; ++i) {
+        clients[i].fd = -1;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.u32 = METRICS_CLIENTS };
+    if (epoll_ctl(metrics_epoll, EPOLL_CTL_ADD, metrics_fd, &event) < 0
+        || !watch_input(metrics_epoll, handle_metrics_events)) {
+        warning("MT watch");
+        (void) close(metrics_epoll);
+        metrics_epoll = -1;
+        return false;
+    }
+    return true;
+}
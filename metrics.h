@@ -0,0 +1,69 @@
+/*
+ * metrics.h: Counters and latency histograms for monitoring.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#ifndef AIDENTD_METRICS_H
+#define AIDENTD_METRICS_H
+
+#include "aidentd.h"
+
+#include <stdbool.h>
+
+/// The counted events.
+enum metric_counter {
+    METRIC_QUERIES = 0,
+    METRIC_INVALID_QUERIES,
+    METRIC_NETLINK_HITS,
+    METRIC_CONNTRACK_HITS,
+    METRIC_FORWARDS,
+    METRIC_FORWARD_FAILURES,
+    METRIC_TIMEOUTS,
+    METRIC_NEGATIVE_CACHE_HITS,
+    METRIC_RATE_LIMITED,
+    METRIC_REPLICA_HITS,
+    METRIC_COUNTERS
+};
+
+/// The timed stages of answering a query.
+enum metric_stage {
+    STAGE_NETLINK = 0,
+    STAGE_CONNTRACK,
+    STAGE_FORWARD,
+    METRIC_STAGES
+};
+
+/// Enable metrics, served at `address` in the Prometheus text format: a
+/// numeric port serves HTTP on the loopback interface, and a path beginning
+/// with `/` serves the plain text on a Unix socket. The metrics are kept in
+/// memory shared by all processes forked after this call (i.e., the worker
+/// processes of the daemon), and the socket is serviced by the event loop
+/// of `serve_connections` (`listener.h`) once `serve_metrics` has been
+/// called. Returns `true` on success.
+bool enable_metrics(const char * const address);
+
+/// Serve the metrics enabled by `enable_metrics` from the event loop of
+/// `serve_connections` in this process, which must be called after
+/// `start_workers` (and before `serve_connections`). Each client is
+/// served without blocking, and dropped unless it has received the
+/// metrics within a few seconds. Returns `true` on success.
+bool serve_metrics(void);
+
+/// Count one `counter` event.
+void metric_count(const enum metric_counter counter);
+
+/// Count a response of the `type` (`USERID` or an error).
+void metric_response(const char * const type);
+
+/// Returns the start time for `metric_stage_done`, or 0 if metrics are
+/// not enabled.
+long long metric_stage_start(void);
+
+/// Record the time since `start` as the latency of `stage`, and also as
+/// the latency of forwarding to `destination` unless it is `NULL`.
+void metric_stage_done(const enum metric_stage stage, const long long start,
+                       const char * const destination);
+
+#endif
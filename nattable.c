@@ -0,0 +1,351 @@
+/*
+ * nattable.c: In-memory table of masqueraded connections.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#include "nattable.h"
+#include "ctnetlink.h"
+#include "listener.h"
+
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NT_BUCKET_BITS 12
+#define NT_BUCKETS (1U << NT_BUCKET_BITS)
+#define NT_MAX_ENTRIES 65536
+#define NT_BUF_SIZE 65536
+#define NT_RCVBUF_SIZE (4 * 1024 * 1024)
+
+/// A masqueraded connection in the table.
+typedef struct nat_entry {
+    struct nat_entry *next;
+    ct_tuple original;
+    ct_tuple reply;
+} nat_entry;
+
+/// The table of masqueraded connections, hashed by the reply ports.
+static nat_entry *table[NT_BUCKETS];
+
+/// The number of entries in `table`.
+static unsigned entry_count = 0;
+
+/// Is the table known to contain all masqueraded connections?
+static bool table_complete = false;
+
+/// The netlink socket subscribed to connection tracking events.
+static int event_fd = -1;
+
+/// The buffer for receiving netlink messages.
+static union {
+    struct nlmsghdr header;
+    unsigned char bytes[NT_BUF_SIZE];
+} buf;
+
+/// Returns the bucket for the reply source port `server_port` and
+/// the reply destination port `router_port`.
+static unsigned
+bucket_for_ports(const unsigned server_port, const unsigned router_port) {
+    const uint32_t key = ((uint32_t) (server_port & 0xFFFFU) << 16) | (router_port & 0xFFFFU);
+    return (unsigned) ((key * UINT32_C(2654435761)) >> (32 - NT_BUCKET_BITS));
+}
+
+/// Remove the entry with the reply tuple `reply`. Returns `true` if found.
+static bool
+remove_entry(const ct_tuple * const reply) {
+    nat_entry **link = &table[bucket_for_ports(reply->src_port, reply->dst_port)];
+
+    for (nat_entry *e = *link; e; link = &(e->next), e = e->next) {
+        if (memcmp(&(e->reply), reply, sizeof *reply) == 0) {
+            *link = e->next;
+            free(e);
+            --entry_count;
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Add the connection with the tuples `original` and `reply` to the table,
+/// if it is a masqueraded TCP connection.
+static void
+add_entry(const ct_tuple * const original, const ct_tuple * const reply) {
+    if (reply->protocol != IPPROTO_TCP) {
+        return;
+    }
+
+    // Replace any existing entry (e.g., from both the dump and an event)
+    (void) remove_entry(reply);
+
+    if (original->family == reply->family
+        && memcmp(original->src, reply->dst, sizeof reply->dst) == 0) {
+        // Not masqueraded
+        return;
+    }
+
+    if (entry_count >= NT_MAX_ENTRIES) {
+        if (table_complete) {
+            notice("NAT table full (%u entries), looking up the rest directly", entry_count);
+            table_complete = false;
+        }
+        return;
+    }
+
+    nat_entry * const e = malloc(sizeof *e);
+    if (!e) {
+        warning("NT malloc");
+        table_complete = false;
+        return;
+    }
+    e->original = *original;
+    e->reply = *reply;
+
+    nat_entry ** const bucket = &table[bucket_for_ports(reply->src_port, reply->dst_port)];
+    e->next = *bucket;
+    *bucket = e;
+    ++entry_count;
+}
+
+/// Remove all entries from the table.
+static void
+flush_table(void) {
+    for (unsigned i = 0; i < NT_BUCKETS; ++i) {
+        nat_entry *e = table[i];
+        while (e) {
+            nat_entry * const next = e->next;
+            free(e);
+            e = next;
+        }
+        table[i] = NULL;
+    }
+    entry_count = 0;
+}
+
+/// Apply the new or destroyed connection in the message `nlh`.
+static void
+apply_message(const struct nlmsghdr * const nlh) {
+    if (NFNL_SUBSYS_ID(nlh->nlmsg_type) != NFNL_SUBSYS_CTNETLINK) {
+        return;
+    }
+
+    const int type = NFNL_MSG_TYPE(nlh->nlmsg_type);
+    if (type != IPCTNL_MSG_CT_NEW && type != IPCTNL_MSG_CT_DELETE) {
+        return;
+    }
+
+    ct_tuple original, reply;
+    if (!ctnetlink_parse(nlh, &original, &reply)) {
+        debug("NT skipping unparseable entry");
+        return;
+    }
+
+    if (type == IPCTNL_MSG_CT_NEW) {
+        add_entry(&original, &reply);
+    } else {
+        (void) remove_entry(&reply);
+    }
+}
+
+/// Seed the table with a dump of the tracked TCP connections.
+/// Returns `true` on success.
+static bool
+seed_table(void) {
+    const int sockfd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+    if (sockfd < 0) {
+        warning("NT socket");
+        return false;
+    }
+
+    const int families[] = { AF_INET, AF_INET6 };
+    bool success = true;
+
+    for (int i = 0; success && i < (int) (sizeof families / sizeof *families); ++i) {
+        const uint32_t seq = ctnetlink_request(sockfd, families[i], NULL);
+        bool done = !seq;
+        success = !done;
+
+        while (!done) {
+            ssize_t len = recv(sockfd, &buf, sizeof buf, 0);
+            if (len < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                warning("NT recv");
+                success = false;
+                break;
+            }
+
+            for (struct nlmsghdr *nlh = &buf.header; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+                if (nlh->nlmsg_seq != seq) {
+                    continue;
+                }
+                if (nlh->nlmsg_type == NLMSG_DONE) {
+                    done = true;
+                    break;
+                }
+                if (nlh->nlmsg_type == NLMSG_ERROR) {
+                    const struct nlmsgerr * const err = NLMSG_DATA(nlh);
+                    if (nlh->nlmsg_len >= NLMSG_LENGTH(sizeof *err) && err->error == 0) {
+                        continue; // acknowledgement
+                    }
+                    errno = (nlh->nlmsg_len >= NLMSG_LENGTH(sizeof *err)) ? -(err->error) : EIO;
+                    warning("NT netlink error");
+                    success = false;
+                    done = true;
+                    break;
+                }
+                apply_message(nlh);
+            }
+        }
+    }
+
+    (void) close(sockfd);
+
+    return success;
+}
+
+/// Discard the table and seed it again.
+static void
+resync_table(void) {
+    flush_table();
+    table_complete = true;
+    if (!seed_table()) {
+        table_complete = false;
+    }
+    debug("NT table has %u entries%s", entry_count, table_complete ? "" : " (incomplete)");
+}
+
+/// Apply all pending connection tracking events without blocking.
+static void
+apply_events(void) {
+    for (;;) {
+        ssize_t len = recv(event_fd, &buf, sizeof buf, MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS) {
+                // Events were lost, so the table can no longer be trusted
+                notice("NAT table events lost, resynchronizing");
+                resync_table();
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                warning("NT recv (events)");
+            }
+            return;
+        }
+
+        for (struct nlmsghdr *nlh = &buf.header; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            apply_message(nlh);
+        }
+    }
+}
+
+/// Find the entries matching `q` from the table. Returns the number of
+/// matches filled in `entries` (up to `max`).
+static int
+find_entries(const ident_query * const q, conntrack_entry entries[], const int max) {
+    int count = 0;
+    for (const nat_entry *e = table[bucket_for_ports(q->remote_port, q->local_port)];
+         e && count < max; e = e->next) {
+        if (e->reply.src_port == q->remote_port && e->reply.dst_port == q->local_port
+            && ctnetlink_match(&(e->original), &(e->reply), q, &entries[count])) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+bool
+enable_nat_table(void) {
+    if (event_fd >= 0) {
+        return true;
+    }
+
+    const int sockfd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+    if (sockfd < 0) {
+        warning("NT socket (events)");
+        return false;
+    }
+
+    // Events are lost if the buffer fills up, so make it large
+    const int rcvbuf = NT_RCVBUF_SIZE;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof rcvbuf) < 0) {
+        (void) setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+    }
+
+    // Multicast is only delivered to bound sockets
+    const struct sockaddr_nl address = { .nl_family = AF_NETLINK };
+    if (bind(sockfd, (const struct sockaddr *) &address, sizeof address) < 0) {
+        warning("NT bind");
+        (void) close(sockfd);
+        return false;
+    }
+
+    // Subscribe before seeding so that no changes are missed in between
+    const int groups[] = { NFNLGRP_CONNTRACK_NEW, NFNLGRP_CONNTRACK_DESTROY };
+    for (int i = 0; i < (int) (sizeof groups / sizeof *groups); ++i) {
+        if (setsockopt(sockfd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &groups[i], sizeof groups[i]) < 0) {
+            warning("NT subscribe");
+            (void) close(sockfd);
+            return false;
+        }
+    }
+
+    table_complete = true;
+    if (!seed_table()) {
+        flush_table();
+        table_complete = false;
+        (void) close(sockfd);
+        return false;
+    }
+    event_fd = sockfd;
+
+    if (!watch_input(event_fd, apply_events)) {
+        debug("NT events only applied on lookup");
+    }
+
+    notice("NAT table enabled with %u entries", entry_count);
+
+    return true;
+}
+
+int
+nat_table_lookup(const ident_query * const query, conntrack_entry entries[], const int max) {
+    if (event_fd < 0) {
+        return -1;
+    }
+
+    // Do not let a timeout interrupt changes to the table
+    block_timeout();
+
+    int result = find_entries(query, entries, max);
+    if (!result) {
+        // The connection may be newer than the events applied so far
+        apply_events();
+        result = find_entries(query, entries, max);
+    }
+    if (!result) {
+        debug("NT no match among %u entries", entry_count);
+        if (!table_complete) {
+            result = -1;
+        }
+    }
+
+    unblock_timeout();
+
+    return result;
+}
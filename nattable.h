@@ -0,0 +1,32 @@
+/*
+ * nattable.h: In-memory table of masqueraded connections.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#ifndef AIDENTD_NATTABLE_H
+#define AIDENTD_NATTABLE_H
+
+#include "aidentd.h"
+#include "conntrack.h"
+
+#include <stdbool.h>
+
+/// Enable the table of masqueraded connections. The table is seeded with
+/// a dump of the tracked TCP connections, and then kept up to date by
+/// subscribing to connection tracking events via netlink, so that lookups
+/// are done in memory without asking the kernel. This is only useful for
+/// long-running processes, and requires `CAP_NET_ADMIN`. The events are
+/// also serviced by the event loop of `serve_connections` (`listener.h`).
+/// Returns `true` on success.
+bool enable_nat_table(void);
+
+/// Look up the masqueraded TCP connections matching `query` from the table.
+/// Returns the number of matches filled in `entries` (up to `max`), 0 if
+/// there is no match, or -1 if the table is not enabled or can not be
+/// trusted to be complete (in which case the caller should look up
+/// connection tracking directly).
+int nat_table_lookup(const ident_query * const query, conntrack_entry entries[], const int max);
+
+#endif
@@ -0,0 +1,150 @@
+/*
+ * negcache.c: Caching queries that matched no connection.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#include "negcache.h"
+
+#include <arpa/inet.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define NEGATIVE_CACHE_SIZE 1024 // must be a power of 2
+#define NEGATIVE_PEER_SIZE 256 // must be a power of 2
+#define NEGATIVE_PEER_THRESHOLD 8 // consecutive misses
+
+/// A query that matched no connection.
+typedef struct negative_entry {
+    /// The time after which the entry is no longer valid (0 if unused).
+    time_t expires;
+    uint16_t local_port;
+    uint16_t remote_port;
+    char address[INET6_ADDRSTRLEN];
+} negative_entry;
+
+/// The summary of recent misses for an address.
+typedef struct peer_summary {
+    /// The time of the latest miss (0 if unused).
+    time_t last_miss;
+    /// The number of consecutive misses without a match.
+    unsigned misses;
+    char address[INET6_ADDRSTRLEN];
+} peer_summary;
+
+static unsigned cache_ttl = 0;
+
+/// The cache, indexed by the hash of the query. Colliding entries replace
+/// each other, which keeps the size bounded.
+static negative_entry cache[NEGATIVE_CACHE_SIZE];
+
+/// The summaries, indexed by the hash of the address.
+static peer_summary peers[NEGATIVE_PEER_SIZE];
+
+/// Returns the hash of `address`.
+static uint32_t
+hash_address(const char *address) {
+    uint32_t hash = 2166136261U;
+    while (*address) {
+        hash ^= (uint8_t) *address++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/// Returns the cache slot for the query.
+static negative_entry *
+cache_slot(const char * const address, const unsigned local_port, const unsigned remote_port) {
+    uint32_t hash = hash_address(address) ^ ((local_port << 16) | remote_port);
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3bU;
+    hash ^= hash >> 16;
+    return &cache[hash & (NEGATIVE_CACHE_SIZE - 1)];
+}
+
+/// Returns the summary slot for `address`.
+static peer_summary *
+peer_slot(const char * const address) {
+    return &peers[hash_address(address) & (NEGATIVE_PEER_SIZE - 1)];
+}
+
+void
+enable_negative_cache(const unsigned ttl) {
+    cache_ttl = ttl;
+}
+
+bool
+negative_cache_lookup(const char * const address,
+                      const unsigned local_port, const unsigned remote_port) {
+    if (!cache_ttl || !*address) {
+        return false;
+    }
+
+    const time_t now = monotonic_time();
+
+    const negative_entry * const entry = cache_slot(address, local_port, remote_port);
+    if (entry->expires > now && entry->local_port == local_port
+        && entry->remote_port == remote_port && strcmp(entry->address, address) == 0) {
+        debug("NC cached miss from %s (%u, %u)", address, local_port, remote_port);
+        return true;
+    }
+
+    const peer_summary * const peer = peer_slot(address);
+    if (peer->misses >= NEGATIVE_PEER_THRESHOLD && peer->last_miss + (time_t) cache_ttl > now
+        && strcmp(peer->address, address) == 0) {
+        debug("NC %s has missed %u times, assuming miss (%u, %u)",
+              address, peer->misses, local_port, remote_port);
+        return true;
+    }
+
+    return false;
+}
+
+void
+negative_cache_update(const char * const address,
+                      const unsigned local_port, const unsigned remote_port,
+                      const bool found) {
+    if (!cache_ttl || !*address) {
+        return;
+    }
+
+    peer_summary * const peer = peer_slot(address);
+    const bool same_peer = peer->last_miss && strcmp(peer->address, address) == 0;
+
+    if (found) {
+        if (same_peer) {
+            peer->last_miss = 0;
+            peer->misses = 0;
+        }
+        return;
+    }
+
+    const time_t now = monotonic_time();
+
+    negative_entry * const entry = cache_slot(address, local_port, remote_port);
+    entry->expires = now + (time_t) cache_ttl;
+    entry->local_port = (uint16_t) local_port;
+    entry->remote_port = (uint16_t) remote_port;
+    (void) strncpy(entry->address, address, sizeof(entry->address) - 1);
+    entry->address[sizeof(entry->address) - 1] = '\0';
+
+    // While the misses are answered from the summary there are no misses
+    // to count, so the count carries over one more period after expiring
+    if (same_peer && peer->last_miss + 2 * (time_t) cache_ttl >= now) {
+        if (peer->misses < NEGATIVE_PEER_THRESHOLD) {
+            if (++(peer->misses) == NEGATIVE_PEER_THRESHOLD) {
+                notice("Queries from %s match no connections, answering from cache for %u s",
+                       address, cache_ttl);
+            }
+        }
+    } else {
+        peer->misses = 1;
+        (void) strncpy(peer->address, address, sizeof(peer->address) - 1);
+        peer->address[sizeof(peer->address) - 1] = '\0';
+    }
+    peer->last_miss = now;
+}
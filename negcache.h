@@ -0,0 +1,35 @@
+/*
+ * negcache.h: Caching queries that matched no connection.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#ifndef AIDENTD_NEGCACHE_H
+#define AIDENTD_NEGCACHE_H
+
+#include "aidentd.h"
+
+#include <stdbool.h>
+
+/// Enable caching of queries that matched no connection for `ttl` seconds.
+/// Repeated queries for the same port pair from the same address are then
+/// answered without a lookup until the entry expires. Furthermore, an
+/// address that keeps asking about connections that do not exist (such as
+/// a scan sweeping over ports) is answered without a lookup for any ports
+/// for `ttl` seconds after its latest miss. This is only useful for
+/// long-running processes, since the cache is per-process.
+void enable_negative_cache(const unsigned ttl);
+
+/// Returns `true` if the query for `local_port` and `remote_port` from
+/// `address` is known to match no connection.
+bool negative_cache_lookup(const char * const address,
+                           const unsigned local_port, const unsigned remote_port);
+
+/// Record the result of looking up the query for `local_port` and
+/// `remote_port` from `address`: `found` is `true` if it matched.
+void negative_cache_update(const char * const address,
+                           const unsigned local_port, const unsigned remote_port,
+                           const bool found);
+
+#endif
@@ -6,15 +6,17 @@
  */
 
 #include "netlink.h"
+#include "usercache.h"
 
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <netinet/tcp.h>
-#include <pwd.h>
 
 #include <linux/inet_diag.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
 
 #include <assert.h>
 #include <errno.h>
@@ -28,32 +30,109 @@
 /// field `nlmsg_seq`.
 static uint32_t sequence = 0;
 
+/// The states of TCP connections that may be the subject of a query,
+/// i.e., excluding listening, closed and `TIME_WAIT` sockets.
+#define QUERY_STATES ((1U << TCP_ESTABLISHED) | (1U << TCP_SYN_SENT) \
+                      | (1U << TCP_SYN_RECV) | (1U << TCP_FIN_WAIT1) \
+                      | (1U << TCP_FIN_WAIT2) | (1U << TCP_CLOSE_WAIT) \
+                      | (1U << TCP_LAST_ACK) | (1U << TCP_CLOSING))
+
+/// The maximum size of the filter bytecode built by `filter_bytecode`.
+#define BYTECODE_MAX_SIZE (4 * sizeof(struct inet_diag_bc_op) \
+                           + sizeof(struct inet_diag_bc_op) \
+                           + sizeof(struct inet_diag_hostcond) \
+                           + sizeof(struct in6_addr))
+
+/// Build the inet_diag bytecode to filter a dump by the ports (and the
+/// remote address, if given) of `q` into `bytecode`, which must have room
+/// for `BYTECODE_MAX_SIZE` bytes. Returns the length of the bytecode.
+///
+/// Only the `GE`/`LE` port comparisons and the host condition are used,
+/// since they are supported by all kernels with bytecode filters.
+static size_t
+filter_bytecode(const ident_query * const q, void * const bytecode) {
+    struct inet_diag_bc_op * const op = bytecode;
+    const size_t op_size = sizeof(struct inet_diag_bc_op);
+    size_t address_size = 0;
+
+    if (q->socket_address) {
+        if (q->address_family == AF_INET) {
+            address_size = sizeof(struct in_addr);
+        } else if (q->address_family == AF_INET6) {
+            address_size = sizeof(struct in6_addr);
+        }
+    }
+
+    // The host condition also compares the remote port
+    const int num_comparisons = address_size ? 2 : 4;
+    const size_t cond_size = address_size ? op_size + sizeof(struct inet_diag_hostcond) + address_size : 0;
+    const size_t length = num_comparisons * 2 * op_size + cond_size;
+    assert(length <= BYTECODE_MAX_SIZE);
+
+    // Each comparison jumps past the end (i.e., rejects) on failure
+    size_t offset = 0;
+    const struct { uint8_t code; unsigned port; } comparisons[] = {
+        { INET_DIAG_BC_S_GE, q->local_port },
+        { INET_DIAG_BC_S_LE, q->local_port },
+        { INET_DIAG_BC_D_GE, q->remote_port },
+        { INET_DIAG_BC_D_LE, q->remote_port }
+    };
+
+    for (int i = 0; i < num_comparisons; ++i) {
+        struct inet_diag_bc_op * const cmp = op + (offset / op_size);
+        cmp[0].code = comparisons[i].code;
+        cmp[0].yes = (uint8_t) (2 * op_size);
+        cmp[0].no = (uint16_t) (length - offset + 4);
+        cmp[1].code = INET_DIAG_BC_NOP;
+        cmp[1].yes = 0;
+        cmp[1].no = (uint16_t) comparisons[i].port;
+        offset += 2 * op_size;
+    }
+
+    if (address_size) {
+        struct inet_diag_bc_op * const cond_op = op + (offset / op_size);
+        cond_op->code = INET_DIAG_BC_D_COND;
+        cond_op->yes = (uint8_t) cond_size;
+        cond_op->no = (uint16_t) (length - offset + 4);
+
+        struct inet_diag_hostcond * const cond = (struct inet_diag_hostcond *) (cond_op + 1);
+        cond->family = (uint8_t) q->address_family;
+        cond->prefix_len = (uint8_t) (address_size * 8);
+        cond->port = (int) q->remote_port;
+        (void) memcpy(cond->addr, q->socket_address, address_size);
+        offset += cond_size;
+    }
+
+    assert(offset == length);
+    return length;
+}
+
 /// Send the query to the netlink socket `sockfd`. Return the
 /// sequence number assigned to the request, or 0 on error.
 /// The number should be passed to `read_responses`.
+///
+/// The dump is limited to the states in `QUERY_STATES` and filtered in
+/// the kernel by the ports and address of the query, so that only the
+/// candidate sockets are copied to us. If the ports of the query are
+/// zero, all sockets of its address family (in those states) are dumped.
 static uint32_t
 send_request(const int sockfd, const ident_query * const q) {
     debug("NL sending netlink request...");
 
-    struct inet_diag_req req = {
-        .idiag_family = AF_INET,
-        .idiag_states = 0xFFFF,
+    struct inet_diag_req_v2 req = {
+        .sdiag_family = AF_INET,
+        .sdiag_protocol = IPPROTO_TCP,
+        .idiag_states = QUERY_STATES,
         .idiag_ext = 1 << (INET_DIAG_INFO - 1),
         .id = {
             .idiag_sport = htons((uint16_t) q->local_port),
-            .idiag_dport = htons((uint16_t) q->remote_port)
+            .idiag_dport = htons((uint16_t) q->remote_port),
+            .idiag_cookie = { INET_DIAG_NOCOOKIE, INET_DIAG_NOCOOKIE }
         }
     };
 
-    struct nlmsghdr nlh = {
-        .nlmsg_type= TCPDIAG_GETSOCK,
-        .nlmsg_seq = ++sequence,
-        .nlmsg_len = NLMSG_ALIGN(NLMSG_LENGTH(sizeof req)),
-        .nlmsg_flags = NLM_F_DUMP | NLM_F_REQUEST
-    };
-
     if (q->address_family == AF_INET6) {
-        req.idiag_family = AF_INET6;
+        req.sdiag_family = AF_INET6;
     }
 
     if (q->address_family && q->socket_address) {
@@ -72,8 +151,75 @@ send_request(const int sockfd, const ident_query * const q) {
         }
     }
 
-    //req.id.idiag_cookie[0] = INET_DIAG_NOCOOKIE;
-    //req.id.idiag_cookie[1] = INET_DIAG_NOCOOKIE;
+    uint32_t bytecode[BYTECODE_MAX_SIZE / sizeof(uint32_t)];
+    const size_t bytecode_length = q->local_port ? filter_bytecode(q, bytecode) : 0;
+
+    struct nlattr bytecode_attr = {
+        .nla_type = INET_DIAG_REQ_BYTECODE,
+        .nla_len = (uint16_t) NLA_HDRLEN + bytecode_length
+    };
+
+    struct nlmsghdr nlh = {
+        .nlmsg_type = SOCK_DIAG_BY_FAMILY,
+        .nlmsg_seq = ++sequence,
+        .nlmsg_len = NLMSG_ALIGN(NLMSG_LENGTH(sizeof req))
+                     + (bytecode_length ? NLA_HDRLEN + NLA_ALIGN(bytecode_length) : 0),
+        .nlmsg_flags = NLM_F_DUMP | NLM_F_REQUEST
+    };
+
+    struct iovec iov[4] = {
+        { .iov_base = &nlh, .iov_len = sizeof nlh },
+        { .iov_base = &req, .iov_len = NLMSG_ALIGN(sizeof req) },
+        { .iov_base = &bytecode_attr, .iov_len = NLA_HDRLEN },
+        { .iov_base = bytecode, .iov_len = NLA_ALIGN(bytecode_length) }
+    };
+
+    struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+
+    struct msghdr msg = {
+        .msg_name = &sa, .msg_namelen = sizeof sa,
+        .msg_iov = iov, .msg_iovlen = bytecode_length ? 4 : 2
+    };
+
+    if (sendmsg(sockfd, &msg, 0) < 0) {
+        warning("sendmsg");
+        return 0;
+    }
+
+    return nlh.nlmsg_seq;
+}
+
+/// Send a request to look up the exact connection matching `q` from our
+/// address `local` to the address `remote` (both of `family`) to the netlink
+/// socket `sockfd`. Unlike a dump, this is a single hash lookup in the
+/// kernel. Return the sequence number assigned to the request, or 0 on error.
+static uint32_t
+send_exact_request(const int sockfd, const ident_query * const q, const int family,
+                   const void * const local, const void * const remote) {
+    debug("NL sending exact netlink request...");
+
+    struct inet_diag_req_v2 req = {
+        .sdiag_family = (uint8_t) family,
+        .sdiag_protocol = IPPROTO_TCP,
+        .idiag_states = QUERY_STATES,
+        .id = {
+            .idiag_sport = htons((uint16_t) q->local_port),
+            .idiag_dport = htons((uint16_t) q->remote_port),
+            .idiag_cookie = { INET_DIAG_NOCOOKIE, INET_DIAG_NOCOOKIE }
+        }
+    };
+
+    const size_t address_size = (family == AF_INET6) ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+    assert(sizeof(req.id.idiag_src) >= address_size);
+    (void) memcpy(req.id.idiag_src, local, address_size);
+    (void) memcpy(req.id.idiag_dst, remote, address_size);
+
+    struct nlmsghdr nlh = {
+        .nlmsg_type = SOCK_DIAG_BY_FAMILY,
+        .nlmsg_seq = ++sequence,
+        .nlmsg_len = NLMSG_ALIGN(NLMSG_LENGTH(sizeof req)),
+        .nlmsg_flags = NLM_F_REQUEST
+    };
 
     struct iovec iov[2] = {
         { .iov_base = &nlh, .iov_len = sizeof nlh },
@@ -95,19 +241,30 @@ send_request(const int sockfd, const ident_query * const q) {
     return nlh.nlmsg_seq;
 }
 
+/// A handler for each socket in the responses to a request. Returns a
+/// non-`NULL` result to stop reading the responses.
+typedef char *(*response_handler)(struct inet_diag_msg *msg, const ident_query * const q);
+
 /// Check the netlink response `msg` against the query `q`.
 /// Returns the matching username or `NULL` if no match.
 static char *
 check_response(struct inet_diag_msg *msg, const ident_query * const q) {
     char srcbuf[INET6_ADDRSTRLEN] = { '\0' };
     char dstbuf[INET6_ADDRSTRLEN] = { '\0' };
-    struct passwd *uid_info = NULL;
+    char *username = NULL;
 
     unsigned local_port = (unsigned) ntohs(msg->id.idiag_sport);
     unsigned remote_port = (unsigned) ntohs(msg->id.idiag_dport);
 
     bool match = (local_port == q->local_port && remote_port == q->remote_port);
 
+    if (match && (msg->idiag_state >= 32 || !((1U << msg->idiag_state) & QUERY_STATES))) {
+        // The exact lookup ignores the states requested, and the kernel
+        // reports `TIME_WAIT` sockets as owned by root
+        debug("NL ignoring socket in state %u", (unsigned) msg->idiag_state);
+        match = false;
+    }
+
     (void) inet_ntop(msg->idiag_family, &(msg->id.idiag_src), srcbuf, sizeof srcbuf);
     (void) inet_ntop(msg->idiag_family, &(msg->id.idiag_dst), dstbuf, sizeof dstbuf);
 
@@ -131,11 +288,11 @@ check_response(struct inet_diag_msg *msg, const ident_query * const q) {
     }
 
     if (match) {
-        uid_info = getpwuid(msg->idiag_uid);
+        username = username_for_uid(msg->idiag_uid);
     }
 
     debug("NL user %s (%u) %s port %u -> %s port %u (%s)",
-          uid_info ? uid_info->pw_name : "?", msg->idiag_uid,
+          username ? username : "?", msg->idiag_uid,
           srcbuf, local_port,
           dstbuf, remote_port,
           match ? "MATCH" : "no match");
@@ -146,10 +303,6 @@ check_response(struct inet_diag_msg *msg, const ident_query * const q) {
 
     cancel_timeout();
 
-    char *username = NULL;
-    if (uid_info && uid_info->pw_name) {
-        username = strdup(uid_info->pw_name);
-    }
     if (!username) {
         const unsigned uid_bufsize = 16;
         username = malloc(uid_bufsize);
@@ -169,10 +322,21 @@ check_response(struct inet_diag_msg *msg, const ident_query * const q) {
 #define NL_BUF_ALIGN 4 // must be a power of 2, >= 2
 
 /// Read responses to the netlink query from `sockfd`, corresponding to the
-/// sequence number `seq`. Returns the username matching the connection in
-/// the query `q`, or `NULL` if no match.
+/// sequence number `seq`. The flag `dump` indicates whether the request was
+/// a dump (as opposed to an exact lookup with a single response). Each
+/// socket in the responses is passed to `handler` along with `q`, and the
+/// first non-`NULL` result (e.g., the username matching the connection in
+/// the query `q`) is returned, or `NULL` if none. The flag `finished` is set
+/// if all responses were read (i.e., the socket can be used for another
+/// request).
+///
+/// If `pending` is not `NULL`, the socket is not waited on: if no more
+/// responses are available yet, `pending` is set and `NULL` is returned,
+/// and the reading may be resumed when the socket becomes readable.
 static char *
-read_responses(const int sockfd, const uint32_t seq, const ident_query * const q) {
+read_responses(const int sockfd, const uint32_t seq, const response_handler handler,
+               const ident_query * const q, const bool dump, bool * const finished,
+               bool * const pending) {
     debug("NL reading responses...");
 
     unsigned char buf[NL_BUF_SIZE + NL_BUF_ALIGN] = { '\0' };
@@ -184,11 +348,26 @@ read_responses(const int sockfd, const uint32_t seq, const ident_query * const q
         aligned_buf = (unsigned char *) addr;
     }
 
+    *finished = false;
+    if (pending) {
+        *pending = false;
+    }
+
     for (;;) {
-        ssize_t len = recv(sockfd, aligned_buf, NL_BUF_SIZE, 0);
+        if (!pending) {
+            allow_timeout();
+        }
+        ssize_t len = recv(sockfd, aligned_buf, NL_BUF_SIZE, pending ? MSG_DONTWAIT : 0);
+        if (!pending) {
+            disallow_timeout();
+        }
         struct nlmsghdr *nlh = (struct nlmsghdr *) aligned_buf;
 
         if (len < 0) {
+            if (pending && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                *pending = true;
+                return NULL;
+            }
             warning("netlink recv");
             return NULL;
         }
@@ -203,16 +382,27 @@ read_responses(const int sockfd, const uint32_t seq, const ident_query * const q
             switch (nlh->nlmsg_type) {
             case NLMSG_DONE:
                 debug("NL done.");
+                *finished = true;
                 return NULL;
-            case NLMSG_ERROR:
-                errno = EIO;
-                warning("NL returned error!");
-                return NULL;
+            case NLMSG_ERROR: {
+                    const struct nlmsgerr * const err = NLMSG_DATA(nlh);
+                    if (!dump && nlh->nlmsg_len >= NLMSG_LENGTH(sizeof *err)
+                        && err->error == -ENOENT) {
+                        debug("NL no such connection.");
+                        *finished = true;
+                        return NULL;
+                    }
+                    errno = EIO;
+                    warning("NL returned error!");
+                    return NULL;
+                }
             default: {
                     struct inet_diag_msg *msg = (struct inet_diag_msg *) NLMSG_DATA(nlh);
                     if (msg) {
-                        char *result = check_response(msg, q);
+                        char *result = handler(msg, q);
                         if (result) {
+                            // The rest of a dump would remain unread
+                            *finished = !dump;
                             return result;
                         }
                     }
@@ -222,26 +412,364 @@ read_responses(const int sockfd, const uint32_t seq, const ident_query * const q
 
             nlh = NLMSG_NEXT(nlh, len); 
         }
+
+        if (!dump) {
+            // The exact lookup has only a single response
+            *finished = true;
+            return NULL;
+        }
     }
 
     return NULL;
 }
 
-char *
-netlink(const ident_query * const query) {
-    if ((query_fd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_INET_DIAG)) < 0) {
-        warning("socket");
-        return NULL;
+/// Get the addresses for an exact lookup of `q` into `local` and `remote`,
+/// and return their family, or `AF_UNSPEC` if an exact lookup is not possible.
+static int
+exact_lookup_addresses(const ident_query * const q, const void **local, const void **remote) {
+    int family = q->local_address_family;
+    *local = q->local_address;
+
+    if (q->socket_address) {
+        *remote = q->socket_address;
+        if (q->address_family != family) {
+            return AF_UNSPEC;
+        }
+    } else {
+        *remote = q->peer_address;
+        if (q->peer_address_family != family) {
+            return AF_UNSPEC;
+        }
+    }
+
+    if (!(*local && *remote)) {
+        return AF_UNSPEC;
     }
 
-    const uint32_t seq = send_request(query_fd, query);
-    char * const result = seq ? read_responses(query_fd, seq, query) : NULL;
+    if (family == AF_INET6 && IN6_IS_ADDR_V4MAPPED((const struct in6_addr *) *local)
+        && IN6_IS_ADDR_V4MAPPED((const struct in6_addr *) *remote)) {
+        // The connection is actually IPv4
+        *local = ((const unsigned char *) *local) + 12;
+        *remote = ((const unsigned char *) *remote) + 12;
+        family = AF_INET;
+    }
 
-    debug("NL closing");
+    return family;
+}
+
+/// The netlink socket kept open between queries, or -1 if none.
+static int kept_fd = -1;
+
+/// Take the netlink socket kept from the previous request as `query_fd`
+/// (so that it gets closed if interrupted by a timeout), or open a new one.
+/// Returns `true` on success.
+static bool
+open_socket(void) {
+    if (kept_fd >= 0) {
+        block_timeout();
+        query_fd = kept_fd;
+        kept_fd = -1;
+        unblock_timeout();
+        debug("NL reusing socket");
+    } else if ((query_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_INET_DIAG)) < 0) {
+        warning("socket");
+        return false;
+    }
+    return true;
+}
+
+/// Keep `query_fd` open for the next request if `finished` (i.e., all
+/// responses have been read from it), otherwise close it.
+static void
+close_socket(const bool finished) {
     block_timeout();
-    (void) close(query_fd);
+    if (finished) {
+        kept_fd = query_fd;
+    } else {
+        debug("NL closing");
+        (void) close(query_fd);
+    }
     query_fd = -1;
     unblock_timeout();
+}
+
+#define NL_PREFETCH_MATCHES 4
+
+/// The sockets found with the port pair of a pending query in a dump.
+typedef struct prefetched {
+    unsigned local_port;
+    unsigned remote_port;
+    unsigned count;
+    struct inet_diag_msg sockets[NL_PREFETCH_MATCHES];
+} prefetched;
+
+/// The hash set of port pairs looked up by `netlink_prefetch`, or `NULL`.
+static prefetched *prefetch_table = NULL;
+
+/// The number of slots in `prefetch_table` (a power of 2).
+static unsigned prefetch_size = 0;
+
+/// Returns the slot for the port pair in `prefetch_table`, which is either
+/// that of the port pair or an unused one (with `local_port` zero).
+static prefetched *
+prefetch_slot(const unsigned local_port, const unsigned remote_port) {
+    const uint32_t key = ((uint32_t) local_port << 16) | (remote_port & 0xFFFFU);
+    unsigned i = (unsigned) ((key * UINT32_C(2654435761)) >> 16) & (prefetch_size - 1);
+
+    for (;;) {
+        prefetched * const slot = &prefetch_table[i];
+        if (!slot->local_port
+            || (slot->local_port == local_port && slot->remote_port == remote_port)) {
+            return slot;
+        }
+        i = (i + 1) & (prefetch_size - 1);
+    }
+}
+
+/// Store the socket `msg` from a dump if its port pair is pending.
+static char *
+store_prefetched(struct inet_diag_msg *msg, const ident_query * const q) {
+    (void) q;
+    prefetched * const slot = prefetch_slot(ntohs(msg->id.idiag_sport), ntohs(msg->id.idiag_dport));
+    if (slot->local_port) {
+        if (slot->count < NL_PREFETCH_MATCHES) {
+            slot->sockets[slot->count] = *msg;
+        }
+        ++slot->count;
+    }
+    return NULL;
+}
+
+void
+netlink_prefetch(const unsigned local_ports[], const unsigned remote_ports[], const int count) {
+    netlink_end_prefetch();
+    if (count < 1) {
+        return;
+    }
+
+    unsigned size = 4;
+    while (size < (unsigned) count * 2) {
+        size <<= 1;
+    }
+    if (!(prefetch_table = calloc(size, sizeof *prefetch_table))) {
+        warning("calloc");
+        return;
+    }
+    prefetch_size = size;
+
+    for (int i = 0; i < count; ++i) {
+        if (local_ports[i] && remote_ports[i]) {
+            prefetched * const slot = prefetch_slot(local_ports[i], remote_ports[i]);
+            slot->local_port = local_ports[i];
+            slot->remote_port = remote_ports[i];
+        }
+    }
+
+    if (!open_socket()) {
+        netlink_end_prefetch();
+        return;
+    }
+
+    debug("NL prefetching %d queries with a dump", count);
+
+    bool finished = false;
+    const int families[] = { AF_INET, AF_INET6 };
+    for (int i = 0; i < (int) (sizeof families / sizeof *families); ++i) {
+        const ident_query all_sockets = { .address_family = families[i] };
+        const uint32_t seq = send_request(query_fd, &all_sockets);
+        finished = false;
+        if (seq) {
+            (void) read_responses(query_fd, seq, store_prefetched, NULL, true, &finished, NULL);
+        }
+        if (!finished) {
+            // Incomplete results would cause false negatives
+            netlink_end_prefetch();
+            break;
+        }
+    }
+
+    close_socket(finished);
+}
+
+/// The handler of the sockets dumped by `netlink_sockets`.
+static void (*socket_handler)(const local_socket * const socket) = NULL;
+
+/// Pass the socket `msg` of a dump to `socket_handler`.
+static char *
+pass_socket(struct inet_diag_msg *msg, const ident_query * const q) {
+    (void) q;
+    local_socket socket = {
+        .family = msg->idiag_family,
+        .local_port = (unsigned) ntohs(msg->id.idiag_sport),
+        .remote_port = (unsigned) ntohs(msg->id.idiag_dport),
+        .uid = (uid_t) msg->idiag_uid
+    };
+    const size_t size = (msg->idiag_family == AF_INET6) ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+    (void) memcpy(socket.local_address, msg->id.idiag_src, size);
+    (void) memcpy(socket.remote_address, msg->id.idiag_dst, size);
+    socket_handler(&socket);
+    return NULL;
+}
+
+bool
+netlink_sockets(const int family, void (* const handler)(const local_socket * const socket)) {
+    if (!open_socket()) {
+        return false;
+    }
+
+    bool finished = false;
+    const ident_query all_sockets = { .address_family = family };
+    const uint32_t seq = send_request(query_fd, &all_sockets);
+    if (seq) {
+        socket_handler = handler;
+        (void) read_responses(query_fd, seq, pass_socket, NULL, true, &finished, NULL);
+        socket_handler = NULL;
+    }
+
+    close_socket(finished);
+    return finished;
+}
+
+void
+netlink_end_prefetch(void) {
+    free(prefetch_table);
+    prefetch_table = NULL;
+    prefetch_size = 0;
+}
+
+/// Look up `query` from the prefetched dump. Returns `true` if the port pair
+/// was prefetched, in which case `result` is set to the matching username
+/// (or `NULL` if none).
+static bool
+lookup_prefetched(const ident_query * const query, char ** const result) {
+    *result = NULL;
+
+    if (!prefetch_table) {
+        return false;
+    }
+    prefetched * const slot = prefetch_slot(query->local_port, query->remote_port);
+    if (!slot->local_port || slot->count > NL_PREFETCH_MATCHES) {
+        return false;
+    }
+
+    debug("NL found %u prefetched sockets", slot->count);
+    for (unsigned i = 0; i < slot->count && !*result; ++i) {
+        *result = check_response(&(slot->sockets[i]), query);
+    }
+    return true;
+}
+
+char *
+netlink(const ident_query * const query) {
+    char *result = NULL;
+
+    if (lookup_prefetched(query, &result)) {
+        return result;
+    }
+
+    if (!open_socket()) {
+        return NULL;
+    }
+
+    bool need_dump = true;
+    bool finished = false;
+
+    {
+        const void *local = NULL;
+        const void *remote = NULL;
+        const int family = exact_lookup_addresses(query, &local, &remote);
+
+        if (family != AF_UNSPEC) {
+            const uint32_t seq = send_exact_request(query_fd, query, family, local, remote);
+            if (seq) {
+                result = read_responses(query_fd, seq, check_response, query, false, &finished, NULL);
+
+                // If the remote address is given, only the local address
+                // could differ in a dump, so trust the exact lookup
+                need_dump = !(result || query->socket_address);
+            }
+        }
+    }
+
+    if (need_dump) {
+        const uint32_t seq = send_request(query_fd, query);
+        finished = false;
+        result = seq ? read_responses(query_fd, seq, check_response, query, true, &finished, NULL) : NULL;
+    }
+
+    close_socket(finished);
 
     return result;
 }
+
+/// The state of the lookup started by `netlink_start`.
+static struct {
+    uint32_t seq;
+    bool dump;
+} started;
+
+bool
+netlink_start(const ident_query * const query, char ** const result) {
+    *result = NULL;
+
+    if (lookup_prefetched(query, result)) {
+        return true;
+    }
+
+    if (!open_socket()) {
+        return true;
+    }
+
+    started.seq = 0;
+    {
+        const void *local = NULL;
+        const void *remote = NULL;
+        const int family = exact_lookup_addresses(query, &local, &remote);
+
+        if (family != AF_UNSPEC) {
+            started.seq = send_exact_request(query_fd, query, family, local, remote);
+            started.dump = false;
+        }
+    }
+    if (!started.seq) {
+        started.seq = send_request(query_fd, query);
+        started.dump = true;
+    }
+    if (!started.seq) {
+        close_socket(false);
+        return true;
+    }
+
+    return false;
+}
+
+bool
+netlink_continue(const ident_query * const query, char ** const result) {
+    bool finished = false;
+    bool pending = false;
+
+    *result = read_responses(query_fd, started.seq, check_response, query,
+                             started.dump, &finished, &pending);
+    if (pending) {
+        return false;
+    }
+
+    if (!(*result || started.dump || query->socket_address)) {
+        // The exact lookup failed, continue with a dump like `netlink`
+        if ((started.seq = send_request(query_fd, query))) {
+            started.dump = true;
+            return false;
+        }
+        finished = false;
+    }
+
+    close_socket(finished);
+    return true;
+}
+
+void
+netlink_cancel(void) {
+    if (query_fd >= 0) {
+        close_socket(false);
+    }
+}
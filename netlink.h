@@ -10,14 +10,65 @@
 
 #include "aidentd.h"
 
+#include <stdbool.h>
+#include <sys/types.h>
+
 /// Query netlink for local connections matching `query`. This is
 /// specific to Linux, but considerably faster than iterating through
 /// all entries in `/proc/net/tcp` . However, it is possible that
 /// future versions of Linux may break compatibility, so this is the
 /// first thing to check when encountering failed local queries.
 ///
+/// If the local and remote addresses are known (see `ident_query`), the
+/// exact connection is looked up first, and only if that fails (and the
+/// remote address is not given by `query->socket_address`), are all
+/// sockets dumped to look for a match by the ports.
+///
 /// Returns the discovered username for the connection matching `query`,
 /// or `NULL` otherwise. Any returned username must be freed with `free`.
 char *netlink(const ident_query * const query);
 
+/// Start looking up `query` as with `netlink`, but without waiting for the
+/// kernel to respond, so that other lookups can be done meanwhile. Returns
+/// `true` if the lookup is already done, with `result` set as `netlink`
+/// would return. Otherwise `netlink_continue` must be called when `query_fd`
+/// becomes readable, or `netlink_cancel` to abandon the lookup.
+bool netlink_start(const ident_query * const query, char ** const result);
+
+/// Continue the lookup started by `netlink_start` with the responses
+/// available on `query_fd`. Returns `true` if the lookup is done, with
+/// `result` set as `netlink` would return, or `false` if more responses
+/// are needed (i.e., this must be called again when `query_fd` becomes
+/// readable).
+bool netlink_continue(const ident_query * const query, char ** const result);
+
+/// Abandon the lookup started by `netlink_start`.
+void netlink_cancel(void);
+
+/// Look up the local connections for `count` pending queries with the port
+/// pairs in `local_ports` and `remote_ports` using a single dump of all
+/// sockets. Until `netlink_end_prefetch` is called, `netlink` then answers
+/// queries with these port pairs from the results without asking the
+/// kernel again. This is only useful for answering a batch of queries that
+/// arrived at nearly the same time.
+void netlink_prefetch(const unsigned local_ports[], const unsigned remote_ports[], const int count);
+
+/// Discard the results of `netlink_prefetch`.
+void netlink_end_prefetch(void);
+
+/// A local TCP connection found by `netlink_sockets`.
+typedef struct local_socket {
+    int family;
+    unsigned char local_address[16];
+    unsigned char remote_address[16];
+    unsigned local_port;
+    unsigned remote_port;
+    uid_t uid;
+} local_socket;
+
+/// Dump the local TCP connections of `family` (in the states that may be
+/// the subject of a query), passing each to `handler`. Returns `true` if
+/// the whole dump was read.
+bool netlink_sockets(const int family, void (* const handler)(const local_socket * const socket));
+
 #endif
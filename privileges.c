@@ -131,7 +131,9 @@ set_file_capabilites(const char * const file, const int num_caps, const cap_valu
     cap_t capabilities;
     int fd = open(file, O_RDONLY);
     if (fd < 0) {
-        error(file);
+        // Only needed as a fallback for netlink, so not fatal
+        warning(file);
+        return;
     }
     if (!(capabilities = cap_get_fd(fd))) {
         if (errno != ENODATA) {
@@ -0,0 +1,204 @@
+/*
+ * ratelimit.c: Limiting the rate of queries per client.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#include "ratelimit.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define RATE_LIMIT_CLIENTS 4096
+#define RATE_LIMIT_HASH_SIZE 4096 // must be a power of 2
+#define NO_CLIENT (-1)
+
+/// The token bucket of a client (an IPv4 address or an IPv6 /64 prefix).
+typedef struct client_bucket {
+    /// The key: `AF_INET` and the address, or `AF_INET6` and the prefix.
+    uint8_t key[9];
+    /// The number of queries allowed, in thousandths.
+    long long tokens;
+    /// The time when `tokens` was last refilled, in milliseconds.
+    long long refilled;
+    /// The next client with the same hash.
+    int hash_next;
+    /// The neighbours in the order of use.
+    int newer;
+    int older;
+} client_bucket;
+
+static unsigned limit_rate = 0;
+static long long limit_burst = 0;
+
+static client_bucket clients[RATE_LIMIT_CLIENTS];
+
+/// The first client for each hash, indexed by the hash of the key.
+static int hash_table[RATE_LIMIT_HASH_SIZE];
+
+/// The most and least recently used clients.
+static int newest = NO_CLIENT;
+static int oldest = NO_CLIENT;
+
+/// The number of entries of `clients` in use.
+static int client_count = 0;
+
+/// Returns the current monotonic time in milliseconds.
+static long long
+now_milliseconds(void) {
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+        return (long long) monotonic_time() * 1000;
+    }
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/// Returns the hash of `key`.
+static uint32_t
+hash_key(const uint8_t key[9]) {
+    uint32_t hash = 2166136261U;
+    for (int i = 0; i < 9; ++i) {
+        hash ^= key[i];
+        hash *= 16777619U;
+    }
+    return hash & (RATE_LIMIT_HASH_SIZE - 1);
+}
+
+/// Set the `key` for `peer`. Returns `false` if the address family is
+/// not known.
+static bool
+key_for_peer(const struct sockaddr_storage * const peer, uint8_t key[9]) {
+    (void) memset(key, 0, 9);
+    if (peer->ss_family == AF_INET) {
+        key[0] = AF_INET;
+        (void) memcpy(key + 1, &(((const struct sockaddr_in *) peer)->sin_addr), 4);
+    } else if (peer->ss_family == AF_INET6) {
+        const struct in6_addr * const address = &(((const struct sockaddr_in6 *) peer)->sin6_addr);
+        if (IN6_IS_ADDR_V4MAPPED(address)) {
+            key[0] = AF_INET;
+            (void) memcpy(key + 1, address->s6_addr + 12, 4);
+        } else {
+            key[0] = AF_INET6;
+            (void) memcpy(key + 1, address->s6_addr, 8);
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/// Remove client `i` from the order of use.
+static void
+unlink_client(const int i) {
+    client_bucket * const c = &clients[i];
+    if (c->newer == NO_CLIENT) {
+        newest = c->older;
+    } else {
+        clients[c->newer].older = c->older;
+    }
+    if (c->older == NO_CLIENT) {
+        oldest = c->newer;
+    } else {
+        clients[c->older].newer = c->newer;
+    }
+}
+
+/// Make client `i` the most recently used.
+static void
+make_newest(const int i) {
+    client_bucket * const c = &clients[i];
+    c->newer = NO_CLIENT;
+    c->older = newest;
+    if (newest != NO_CLIENT) {
+        clients[newest].newer = i;
+    }
+    newest = i;
+    if (oldest == NO_CLIENT) {
+        oldest = i;
+    }
+}
+
+/// Remove client `i` from the hash table.
+static void
+unhash_client(const int i) {
+    int *link = &hash_table[hash_key(clients[i].key)];
+    while (*link != i) {
+        link = &(clients[*link].hash_next);
+    }
+    *link = clients[i].hash_next;
+}
+
+/// Returns the client for `key`, adding it (and evicting the least
+/// recently used client if full) if it does not exist.
+static client_bucket *
+find_client(const uint8_t key[9], const long long now) {
+    const uint32_t hash = hash_key(key);
+    for (int i = hash_table[hash]; i != NO_CLIENT; i = clients[i].hash_next) {
+        if (memcmp(clients[i].key, key, sizeof clients[i].key) == 0) {
+            unlink_client(i);
+            make_newest(i);
+            return &clients[i];
+        }
+    }
+
+    int i;
+    if (client_count < RATE_LIMIT_CLIENTS) {
+        i = client_count++;
+    } else {
+        i = oldest;
+        unlink_client(i);
+        unhash_client(i);
+    }
+
+    client_bucket * const c = &clients[i];
+    (void) memcpy(c->key, key, sizeof c->key);
+    c->tokens = limit_burst;
+    c->refilled = now;
+    c->hash_next = hash_table[hash];
+    hash_table[hash] = i;
+    make_newest(i);
+    return c;
+}
+
+void
+enable_rate_limit(const unsigned rate, const unsigned burst) {
+    for (int i = 0; i < RATE_LIMIT_HASH_SIZE; ++i) {
+        hash_table[i] = NO_CLIENT;
+    }
+    newest = NO_CLIENT;
+    oldest = NO_CLIENT;
+    client_count = 0;
+    limit_rate = rate;
+    limit_burst = (long long) (burst ? burst : 1) * 1000;
+}
+
+bool
+rate_limit_allow(const struct sockaddr_storage * const peer) {
+    uint8_t key[9];
+    if (!limit_rate || !key_for_peer(peer, key)) {
+        return true;
+    }
+
+    const long long now = now_milliseconds();
+    client_bucket * const c = find_client(key, now);
+
+    if (now > c->refilled) {
+        c->tokens += (now - c->refilled) * limit_rate;
+        if (c->tokens > limit_burst) {
+            c->tokens = limit_burst;
+        }
+        c->refilled = now;
+    }
+
+    if (c->tokens < 1000) {
+        return false;
+    }
+    c->tokens -= 1000;
+    return true;
+}
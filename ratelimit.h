@@ -0,0 +1,29 @@
+/*
+ * ratelimit.h: Limiting the rate of queries per client.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#ifndef AIDENTD_RATELIMIT_H
+#define AIDENTD_RATELIMIT_H
+
+#include "aidentd.h"
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+/// Enable limiting each client to `rate` queries per second on average,
+/// with bursts of up to `burst` queries. IPv6 clients are limited per /64
+/// prefix, since a single host can trivially use any address in its /64.
+/// The state is kept for a bounded number of the most recently active
+/// clients. This is only useful for long-running processes, since the
+/// state is per-process.
+void enable_rate_limit(const unsigned rate, const unsigned burst);
+
+/// Returns `true` if a query from `peer` is allowed, and takes one query
+/// from its allowance. Always returns `true` if rate limiting is not
+/// enabled or the address family of `peer` is unknown.
+bool rate_limit_allow(const struct sockaddr_storage * const peer);
+
+#endif
@@ -0,0 +1,1015 @@
+/*
+ * replica.c: Replicating the owners of connections from hosts behind NAT.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // accept4
+#endif
+
+#include "replica.h"
+#include "listener.h"
+#include "netlink.h"
+#include "usercache.h"
+
+#include <ifaddrs.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define REPLICA_ENTRIES 16384
+#define REPLICA_HASH_SIZE 16384 // must be a power of 2
+#define REPLICA_USERNAME_SIZE 33
+#define REPLICA_FEEDS 64
+#define REPLICA_LINE_SIZE 128
+#define REPLICA_OUTPUT_SIZE 65536 // initially
+// A dump can remove and add every entry, so this is never reached unless
+// the router stops receiving
+#define REPLICA_MAX_OUTPUT_SIZE ((2 * REPLICA_ENTRIES + 1) * REPLICA_LINE_SIZE)
+#define REPLICA_INTERVAL_MS 200 // between dumps of the local connections
+#define REPLICA_RETRY_SECONDS 5 // between attempts to connect to the router
+#define REPLICA_HEADER "AIDENTD-REPLICA 1"
+#define NO_ENTRY (-1)
+
+unsigned replica_port = 1113;
+
+/// A connection from `client` (a host behind NAT) to `server`.
+typedef struct replica_key {
+    int family;
+    unsigned client_port;
+    unsigned server_port;
+    unsigned char client[16];
+    unsigned char server[16];
+} replica_key;
+
+/// The owner of a connection.
+typedef struct replica_entry {
+    replica_key key;
+    char username[REPLICA_USERNAME_SIZE];
+    bool in_use;
+    /// The feed of the entry (on the router), or the number of the last
+    /// dump of the local connections to contain it (on the host).
+    unsigned tag;
+    /// The next entry with the same hash, or in the list of free entries.
+    int next;
+} replica_entry;
+
+/// A hash table of `replica_entry`.
+typedef struct replica_table {
+    replica_entry *entries;
+    int *hash_table;
+    int free_list;
+} replica_table;
+
+/// Returns the size of an address of `family`.
+static size_t
+address_size(const int family) {
+    return (family == AF_INET6) ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+}
+
+/// Returns the hash of `key`.
+static uint32_t
+hash_key(const replica_key * const key) {
+    const unsigned char * const bytes = (const unsigned char *) key;
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < sizeof *key; ++i) {
+        hash ^= bytes[i];
+        hash *= 16777619U;
+    }
+    return hash & (REPLICA_HASH_SIZE - 1);
+}
+
+/// Make all entries of `t` free.
+static void
+table_clear(replica_table * const t) {
+    for (int i = 0; i < REPLICA_HASH_SIZE; ++i) {
+        t->hash_table[i] = NO_ENTRY;
+    }
+    for (int i = 0; i < REPLICA_ENTRIES; ++i) {
+        t->entries[i].in_use = false;
+        t->entries[i].next = (i + 1 < REPLICA_ENTRIES) ? i + 1 : NO_ENTRY;
+    }
+    t->free_list = 0;
+}
+
+/// Allocate the table `t`. Returns `true` on success.
+static bool
+table_init(replica_table * const t) {
+    t->entries = calloc(REPLICA_ENTRIES, sizeof *t->entries);
+    t->hash_table = calloc(REPLICA_HASH_SIZE, sizeof *t->hash_table);
+    if (!(t->entries && t->hash_table)) {
+        warning("calloc (replica)");
+        free(t->entries);
+        free(t->hash_table);
+        t->entries = NULL;
+        t->hash_table = NULL;
+        return false;
+    }
+    table_clear(t);
+    return true;
+}
+
+/// Returns the index of the entry of `t` for `key`, or `NO_ENTRY` if none.
+static int
+table_find(const replica_table * const t, const replica_key * const key) {
+    for (int i = t->hash_table[hash_key(key)]; i != NO_ENTRY; i = t->entries[i].next) {
+        if (memcmp(&(t->entries[i].key), key, sizeof *key) == 0) {
+            return i;
+        }
+    }
+    return NO_ENTRY;
+}
+
+/// Add an entry for `key` to `t`. Returns its index, or `NO_ENTRY` if full.
+static int
+table_add(replica_table * const t, const replica_key * const key) {
+    const int i = t->free_list;
+    if (i == NO_ENTRY) {
+        return NO_ENTRY;
+    }
+    replica_entry * const e = &(t->entries[i]);
+    t->free_list = e->next;
+
+    const uint32_t hash = hash_key(key);
+    e->key = *key;
+    e->username[0] = '\0';
+    e->in_use = true;
+    e->tag = 0;
+    e->next = t->hash_table[hash];
+    t->hash_table[hash] = i;
+    return i;
+}
+
+/// Remove the entry `i` from `t`.
+static void
+table_remove(replica_table * const t, const int i) {
+    int *link = &(t->hash_table[hash_key(&(t->entries[i].key))]);
+    while (*link != i) {
+        link = &(t->entries[*link].next);
+    }
+    *link = t->entries[i].next;
+
+    t->entries[i].in_use = false;
+    t->entries[i].next = t->free_list;
+    t->free_list = i;
+}
+
+/// Set the `key` of the connection from `client` port `client_port` to
+/// `server` port `server_port` (addresses of `family`).
+static void
+set_key(replica_key * const key, const int family,
+        const void * const client, const unsigned client_port,
+        const void * const server, const unsigned server_port) {
+    (void) memset(key, 0, sizeof *key);
+    key->family = family;
+    key->client_port = client_port;
+    key->server_port = server_port;
+    (void) memcpy(key->client, client, address_size(family));
+    (void) memcpy(key->server, server, address_size(family));
+}
+
+/// Convert the IPv4-mapped IPv6 address of `family` at `address` (of 16
+/// bytes) to IPv4 in place. Returns the resulting family.
+static int
+unmap_address(const int family, unsigned char address[16]) {
+    if (family == AF_INET6 && IN6_IS_ADDR_V4MAPPED((const struct in6_addr *) address)) {
+        (void) memmove(address, address + 12, sizeof(struct in_addr));
+        return AF_INET;
+    }
+    return family;
+}
+
+/// Copy the address of `sa` to `address` (of 16 bytes), and return its
+/// family (`AF_UNSPEC` if unknown).
+static int
+copy_address(const struct sockaddr_storage * const sa, unsigned char address[16]) {
+    if (sa->ss_family == AF_INET) {
+        (void) memcpy(address, &(((const struct sockaddr_in *) sa)->sin_addr), sizeof(struct in_addr));
+        return AF_INET;
+    }
+    if (sa->ss_family == AF_INET6) {
+        (void) memcpy(address, &(((const struct sockaddr_in6 *) sa)->sin6_addr), sizeof(struct in6_addr));
+        return unmap_address(AF_INET6, address);
+    }
+    return AF_UNSPEC;
+}
+
+// The router
+
+/// A network from which replicas are accepted.
+typedef struct replica_network {
+    int family;
+    unsigned bits;
+    unsigned char address[16];
+} replica_network;
+
+static replica_network networks[REPLICA_NETWORKS];
+static int network_count = 0;
+
+/// Parse the network `text` ("address/bits") into `n`. Returns `true` on
+/// success.
+static bool
+parse_network(const char * const text, replica_network * const n) {
+    char address[INET6_ADDRSTRLEN];
+    const char * const slash = strchr(text, '/');
+    if (!slash || (size_t) (slash - text) >= sizeof address) {
+        return false;
+    }
+    (void) memcpy(address, text, (size_t) (slash - text));
+    address[slash - text] = '\0';
+
+    n->family = AF_INET;
+    if (inet_pton(n->family, address, n->address) != 1) {
+        n->family = AF_INET6;
+        if (inet_pton(n->family, address, n->address) != 1) {
+            return false;
+        }
+    }
+    char *end;
+    const unsigned long bits = strtoul(slash + 1, &end, 10);
+    if (end == slash + 1 || *end || bits > 8 * address_size(n->family)) {
+        return false;
+    }
+    n->bits = (unsigned) bits;
+    return true;
+}
+
+/// Returns `true` if the `address` of `family` is in the network `n`.
+static bool
+in_network(const replica_network * const n, const int family, const unsigned char * const address) {
+    if (family != n->family) {
+        return false;
+    }
+    const unsigned bytes = n->bits / 8;
+    if (memcmp(address, n->address, bytes)) {
+        return false;
+    }
+    const unsigned bits = n->bits % 8;
+    if (bits) {
+        const unsigned char mask = (unsigned char) (0xFFU << (8 - bits));
+        return ((address[bytes] ^ n->address[bytes]) & mask) == 0;
+    }
+    return true;
+}
+
+/// A host pushing replicas.
+typedef struct replica_feed {
+    int fd;
+    bool greeted;
+    int family;
+    unsigned char address[16];
+    char name[INET6_ADDRSTRLEN];
+    size_t length;
+    char buf[REPLICA_LINE_SIZE];
+} replica_feed;
+
+/// The replicated owners of connections (on the router).
+static replica_table replicas = { NULL, NULL, NO_ENTRY };
+
+static replica_feed feeds[REPLICA_FEEDS];
+
+/// The listening sockets for feeds, and their number.
+static int server_fds[REPLICA_NETWORKS];
+static int server_fd_count = 0;
+
+/// The epoll instance for the listening sockets and the feeds, itself
+/// watched by the event loop of `serve_connections`.
+static int server_epoll = -1;
+
+/// Close the feed `f` and discard its replicas.
+static void
+drop_feed(replica_feed * const f) {
+    const unsigned tag = (unsigned) (f - feeds) + 1;
+    int count = 0;
+    for (int i = 0; i < REPLICA_ENTRIES; ++i) {
+        if (replicas.entries[i].in_use && replicas.entries[i].tag == tag) {
+            table_remove(&replicas, i);
+            ++count;
+        }
+    }
+    (void) close(f->fd);
+    f->fd = -1;
+    notice("Replica from %s closed, discarded %d connections", f->name, count);
+}
+
+/// Apply the `line` received from the feed `f`. Returns `false` if the
+/// line is invalid.
+static bool
+apply_line(replica_feed * const f, char * const line) {
+    if (!f->greeted) {
+        f->greeted = (strcmp(line, REPLICA_HEADER) == 0);
+        return f->greeted;
+    }
+
+    // "+client_port server server_port username" or
+    // "-client_port server server_port"
+    const char op = line[0];
+    if (op != '+' && op != '-') {
+        return false;
+    }
+
+    char *p;
+    const unsigned long client_port = strtoul(line + 1, &p, 10);
+    if (*p++ != ' ') {
+        return false;
+    }
+    char * const server = p;
+    if (!(p = strchr(server, ' '))) {
+        return false;
+    }
+    *p++ = '\0';
+    const unsigned long server_port = strtoul(p, &p, 10);
+    if (client_port > 65535 || server_port > 65535 || (op == '+' ? *p != ' ' : *p != '\0')) {
+        return false;
+    }
+
+    unsigned char server_address[16];
+    if (inet_pton(f->family, server, server_address) != 1) {
+        return false;
+    }
+    replica_key key;
+    set_key(&key, f->family, f->address, (unsigned) client_port, server_address,
+            (unsigned) server_port);
+
+    int i = table_find(&replicas, &key);
+
+    if (op == '-') {
+        if (i != NO_ENTRY) {
+            table_remove(&replicas, i);
+        }
+        return true;
+    }
+
+    const char * const username = p + 1;
+    const size_t length = strlen(username);
+    if (length == 0 || length >= REPLICA_USERNAME_SIZE) {
+        return false;
+    }
+    for (const char *c = username; *c; ++c) {
+        if (*c <= ' ' || *c == ':' || *c >= 127) {
+            return false;
+        }
+    }
+
+    if (i == NO_ENTRY && (i = table_add(&replicas, &key)) == NO_ENTRY) {
+        debug("RP table full, ignoring connection from %s port %lu", f->name, client_port);
+        return true;
+    }
+    (void) strcpy(replicas.entries[i].username, username);
+    replicas.entries[i].tag = (unsigned) (f - feeds) + 1;
+    return true;
+}
+
+/// Read and apply the lines available from the feed `f`.
+static void
+read_feed(replica_feed * const f) {
+    for (;;) {
+        const ssize_t received = recv(f->fd, f->buf + f->length, sizeof(f->buf) - 1 - f->length, 0);
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+        }
+        if (received <= 0) {
+            drop_feed(f);
+            return;
+        }
+        f->length += (size_t) received;
+        f->buf[f->length] = '\0';
+
+        char *line = f->buf;
+        char *end;
+        while ((end = strchr(line, '\n'))) {
+            *end = '\0';
+            if (end > line && end[-1] == '\r') {
+                end[-1] = '\0';
+            }
+            if (!apply_line(f, line)) {
+                notice("Invalid replica from %s: %s", f->name, line);
+                drop_feed(f);
+                return;
+            }
+            line = end + 1;
+        }
+
+        f->length -= (size_t) (line - f->buf);
+        (void) memmove(f->buf, line, f->length);
+        if (f->length >= sizeof(f->buf) - 1) {
+            notice("Invalid replica from %s: line too long", f->name);
+            drop_feed(f);
+            return;
+        }
+    }
+}
+
+/// Accept the feeds waiting on the listening socket `fd`.
+static void
+accept_feeds(const int fd) {
+    for (;;) {
+        struct sockaddr_storage peer;
+        socklen_t peer_size = sizeof peer;
+        const int client_fd = accept4(fd, (struct sockaddr *) &peer, &peer_size,
+                                      SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                warning("RP accept");
+            }
+            return;
+        }
+
+        unsigned char address[16];
+        const int family = copy_address(&peer, address);
+        bool allowed = false;
+        for (int i = 0; i < network_count && !allowed && family != AF_UNSPEC; ++i) {
+            allowed = in_network(&networks[i], family, address);
+        }
+        if (!allowed) {
+            char name[INET6_ADDRSTRLEN] = "?";
+            (void) inet_ntop(family, address, name, sizeof name);
+            notice("Refusing replica from %s outside the networks for replicas", name);
+            (void) close(client_fd);
+            continue;
+        }
+
+        // A new feed from the same host replaces the old one
+        replica_feed *f = NULL;
+        for (int i = 0; i < REPLICA_FEEDS; ++i) {
+            replica_feed * const other = &feeds[i];
+            if (other->fd >= 0 && other->family == family
+                && memcmp(other->address, address, address_size(family)) == 0) {
+                drop_feed(other);
+            }
+            if (!f && other->fd < 0) {
+                f = other;
+            }
+        }
+        if (!f) {
+            notice("Too many replicas, refusing another");
+            (void) close(client_fd);
+            continue;
+        }
+
+        f->fd = client_fd;
+        f->greeted = false;
+        f->family = family;
+        (void) memcpy(f->address, address, sizeof address);
+        f->length = 0;
+        if (!inet_ntop(family, address, f->name, sizeof f->name)) {
+            (void) strcpy(f->name, "?");
+        }
+
+        struct epoll_event event = { .events = EPOLLIN, .data.u32 = (uint32_t) (f - feeds) };
+        if (epoll_ctl(server_epoll, EPOLL_CTL_ADD, client_fd, &event) < 0) {
+            warning("RP epoll_ctl");
+            (void) close(client_fd);
+            f->fd = -1;
+            continue;
+        }
+        notice("Replica from %s connected", f->name);
+    }
+}
+
+/// Handle the events of `server_epoll`.
+static void
+handle_server_events(void) {
+    struct epoll_event events[16];
+
+    const int count = epoll_wait(server_epoll, events, (int) (sizeof events / sizeof *events), 0);
+    for (int i = 0; i < count; ++i) {
+        const uint32_t index = events[i].data.u32;
+        if (index >= REPLICA_FEEDS) {
+            accept_feeds(server_fds[index - REPLICA_FEEDS]);
+        } else if (feeds[index].fd >= 0) {
+            read_feed(&feeds[index]);
+        }
+    }
+}
+
+/// Open a listening socket for feeds at the address `sa` (of `size`) port
+/// `replica_port`. Returns `true` on success.
+static bool
+open_server_socket(struct sockaddr_storage * const sa, const socklen_t size) {
+    if (server_fd_count >= REPLICA_NETWORKS) {
+        return false;
+    }
+    if (sa->ss_family == AF_INET) {
+        ((struct sockaddr_in *) sa)->sin_port = htons((uint16_t) replica_port);
+    } else {
+        ((struct sockaddr_in6 *) sa)->sin6_port = htons((uint16_t) replica_port);
+    }
+
+    const int fd = socket(sa->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        debug("RP socket: %s", strerror(errno));
+        return false;
+    }
+
+    const int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) < 0) {
+        warning("SO_REUSEADDR");
+    }
+
+    struct epoll_event event = { .events = EPOLLIN,
+                                 .data.u32 = (uint32_t) (REPLICA_FEEDS + server_fd_count) };
+    if (bind(fd, (struct sockaddr *) sa, size) < 0 || listen(fd, SOMAXCONN) < 0
+        || epoll_ctl(server_epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+        warning("RP bind");
+        (void) close(fd);
+        return false;
+    }
+
+    server_fds[server_fd_count++] = fd;
+    return true;
+}
+
+/// Open a listening socket for feeds on the local address in the network
+/// `n` (named `name`), as found in `interfaces`. Returns `true` on success.
+static bool
+listen_in_network(const replica_network * const n, const char * const name,
+                  const struct ifaddrs * const interfaces) {
+    for (const struct ifaddrs *ifa = interfaces; ifa; ifa = ifa->ifa_next) {
+        if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != n->family) {
+            continue;
+        }
+        struct sockaddr_storage sa = { .ss_family = AF_UNSPEC };
+        const socklen_t size = (n->family == AF_INET) ? sizeof(struct sockaddr_in)
+                                                      : sizeof(struct sockaddr_in6);
+        (void) memcpy(&sa, ifa->ifa_addr, size);
+
+        unsigned char address[16];
+        if (copy_address(&sa, address) != n->family || !in_network(n, n->family, address)) {
+            continue;
+        }
+
+        char local[INET6_ADDRSTRLEN] = { '\0' };
+        (void) inet_ntop(n->family, address, local, sizeof local);
+        if (!open_server_socket(&sa, size)) {
+            return false;
+        }
+        notice("Accepting replicas from %s on %s port %u", name, local, replica_port);
+        return true;
+    }
+    notice("No local address in %s for replicas", name);
+    return false;
+}
+
+bool
+enable_replica_server(const char * const network_names[], const int count) {
+    if (server_epoll >= 0) {
+        return true;
+    }
+    for (int i = 0; i < count && i < REPLICA_NETWORKS; ++i) {
+        if (!parse_network(network_names[i], &networks[i])) {
+            notice("Invalid network for replicas: %s", network_names[i]);
+            return false;
+        }
+        network_count = i + 1;
+    }
+
+    if ((server_epoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        warning("RP epoll_create1");
+        return false;
+    }
+    for (int i = 0; i < REPLICA_FEEDS; ++i) {
+        feeds[i].fd = -1;
+    }
+
+    struct ifaddrs *interfaces = NULL;
+    if (getifaddrs(&interfaces) < 0) {
+        warning("getifaddrs");
+    } else {
+        for (int i = 0; i < network_count; ++i) {
+            (void) listen_in_network(&networks[i], network_names[i], interfaces);
+        }
+        freeifaddrs(interfaces);
+    }
+
+    if (server_fd_count == 0 || !table_init(&replicas)
+        || !watch_input(server_epoll, handle_server_events)) {
+        while (server_fd_count) {
+            (void) close(server_fds[--server_fd_count]);
+        }
+        (void) close(server_epoll);
+        server_epoll = -1;
+        return false;
+    }
+
+    return true;
+}
+
+char *
+replica_lookup(const conntrack_entry * const entry) {
+    if (!replicas.entries || !entry->server[0]) {
+        return NULL;
+    }
+
+    unsigned char client[16];
+    unsigned char server[16];
+    int family = AF_INET;
+    if (inet_pton(family, entry->client, client) != 1) {
+        family = AF_INET6;
+        if (inet_pton(family, entry->client, client) != 1) {
+            return NULL;
+        }
+    }
+    if (inet_pton(family, entry->server, server) != 1) {
+        return NULL;
+    }
+
+    replica_key key;
+    set_key(&key, family, client, entry->client_port, server, entry->server_port);
+    const int i = table_find(&replicas, &key);
+    if (i == NO_ENTRY) {
+        debug("RP no replica of %s port %u", entry->client, entry->client_port);
+        return NULL;
+    }
+
+    char * const username = strdup(replicas.entries[i].username);
+    if (!username) {
+        error("strdup");
+    }
+    return username;
+}
+
+// The host pushing replicas
+
+/// The owners of the local connections pushed to the router.
+static replica_table published = { NULL, NULL, NO_ENTRY };
+
+/// The state of pushing replicas to the router.
+static struct {
+    int timer_fd;
+    int fd;
+    bool connected;
+    bool failed;
+    struct sockaddr_storage router;
+    socklen_t router_size;
+    char name[INET6_ADDRSTRLEN];
+    time_t retry_time;
+    int family;
+    unsigned char local_address[16];
+    unsigned dump;
+    /// The fixed username published for every connection (option `-f`),
+    /// or `NULL` to publish the owners.
+    const char *fixed_username;
+    /// The output queued for the router (`length` bytes, of which `sent`
+    /// have been sent), growing up to `REPLICA_MAX_OUTPUT_SIZE`.
+    char *output;
+    size_t size;
+    size_t length;
+    size_t sent;
+} push = { .timer_fd = -1, .fd = -1 };
+
+/// Send as much of `push.output` to the router as it will take without
+/// waiting. Sets `push.failed` on error.
+static void
+flush_output(void) {
+    while (push.sent < push.length && !push.failed) {
+        const ssize_t sent = send(push.fd, push.output + push.sent, push.length - push.sent,
+                                  MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                notice("Replica to %s: %s", push.name, strerror(errno));
+                push.failed = true;
+            }
+            return;
+        }
+        push.sent += (size_t) sent;
+    }
+    if (push.sent == push.length) {
+        push.sent = 0;
+        push.length = 0;
+    }
+}
+
+/// Queue a line formatted from `format` for the router. Sets `push.failed`
+/// on error, or if the output would exceed `REPLICA_MAX_OUTPUT_SIZE`.
+static void
+queue_line(const char * const format, ...) {
+    if (push.failed) {
+        return;
+    }
+
+    char line[REPLICA_LINE_SIZE];
+    va_list args;
+    va_start(args, format);
+    const int length = vsnprintf(line, sizeof line, format, args);
+    va_end(args);
+    if (length < 0 || (size_t) length >= sizeof line) {
+        push.failed = true;
+        return;
+    }
+
+    if (push.length + (size_t) length > push.size) {
+        size_t size = push.size ? push.size * 2 : REPLICA_OUTPUT_SIZE;
+        if (size > REPLICA_MAX_OUTPUT_SIZE) {
+            size = REPLICA_MAX_OUTPUT_SIZE;
+        }
+        char * const output = (push.length + (size_t) length <= size)
+                              ? realloc(push.output, size) : NULL;
+        if (!output) {
+            notice("Replica to %s is not keeping up", push.name);
+            push.failed = true;
+            return;
+        }
+        push.output = output;
+        push.size = size;
+    }
+    (void) memcpy(push.output + push.length, line, (size_t) length);
+    push.length += (size_t) length;
+}
+
+/// Queue the owner of the connection of entry `i` of `published`, or its
+/// removal if not `add`.
+static void
+queue_entry(const int i, const bool add) {
+    const replica_entry * const e = &(published.entries[i]);
+    char server[INET6_ADDRSTRLEN];
+    if (!inet_ntop(e->key.family, e->key.server, server, sizeof server)) {
+        return;
+    }
+    if (add) {
+        queue_line("+%u %s %u %s\n", e->key.client_port, server, e->key.server_port, e->username);
+    } else {
+        queue_line("-%u %s %u\n", e->key.client_port, server, e->key.server_port);
+    }
+}
+
+/// Update the owner of the local connection `s` in `published`, queueing
+/// any change for the router.
+static void
+publish_socket(const local_socket * const s) {
+    if (push.failed || s->family != push.family
+        || memcmp(s->local_address, push.local_address, address_size(s->family))) {
+        return;
+    }
+
+    replica_key key;
+    set_key(&key, s->family, s->local_address, s->local_port, s->remote_address, s->remote_port);
+    int i = table_find(&published, &key);
+
+    char *username = NULL;
+    char uid[16];
+    if (!push.fixed_username && !(username = username_for_uid(s->uid))) {
+        (void) snprintf(uid, sizeof uid, "%u", (unsigned) s->uid);
+    }
+    const char * const name = push.fixed_username ? push.fixed_username : (username ? username : uid);
+    bool valid = (strlen(name) < REPLICA_USERNAME_SIZE);
+    for (const char *c = name; valid && *c; ++c) {
+        valid = !(*c <= ' ' || *c == ':' || *c >= 127);
+    }
+
+    if (!valid) {
+        // Let the router forward the query for this one
+        if (i != NO_ENTRY) {
+            queue_entry(i, false);
+            table_remove(&published, i);
+        }
+    } else if (i != NO_ENTRY) {
+        published.entries[i].tag = push.dump;
+        if (strcmp(published.entries[i].username, name)) {
+            (void) strcpy(published.entries[i].username, name);
+            queue_entry(i, true);
+        }
+    } else if ((i = table_add(&published, &key)) != NO_ENTRY) {
+        (void) strcpy(published.entries[i].username, name);
+        published.entries[i].tag = push.dump;
+        queue_entry(i, true);
+    }
+
+    free(username);
+}
+
+/// Dump the local connections and queue the changes for the router.
+static void
+publish_changes(void) {
+    ++push.dump;
+    if (!netlink_sockets(push.family, publish_socket) || push.failed) {
+        // Removals are only known from a complete dump
+        return;
+    }
+    for (int i = 0; i < REPLICA_ENTRIES && !push.failed; ++i) {
+        if (published.entries[i].in_use && published.entries[i].tag != push.dump) {
+            queue_entry(i, false);
+            table_remove(&published, i);
+        }
+    }
+}
+
+/// Close the connection to the router, to be retried later.
+static void
+disconnect_router(void) {
+    if (push.fd >= 0) {
+        (void) close(push.fd);
+        push.fd = -1;
+    }
+    push.connected = false;
+    push.failed = false;
+    push.length = 0;
+    push.sent = 0;
+    push.retry_time = monotonic_time() + REPLICA_RETRY_SECONDS;
+    table_clear(&published);
+}
+
+/// Start pushing replicas on the newly established connection to the router.
+/// Returns `true` on success, otherwise the connection is closed.
+static bool
+connected_to_router(void) {
+    struct sockaddr_storage local;
+    socklen_t local_size = sizeof local;
+    if (getsockname(push.fd, (struct sockaddr *) &local, &local_size) < 0) {
+        warning("RP getsockname");
+        disconnect_router();
+        return false;
+    }
+    push.family = copy_address(&local, push.local_address);
+    push.connected = true;
+
+    char address[INET6_ADDRSTRLEN] = { '\0' };
+    (void) inet_ntop(push.family, push.local_address, address, sizeof address);
+    notice("Replicating connections from %s to %s", address, push.name);
+
+    table_clear(&published);
+    push.length = 0;
+    push.sent = 0;
+    queue_line("%s\n", REPLICA_HEADER);
+    return true;
+}
+
+/// Connect (or continue connecting) to the router. Returns `true` if
+/// connected.
+static bool
+connect_router(void) {
+    if (push.fd < 0) {
+        if (monotonic_time() < push.retry_time) {
+            return false;
+        }
+        push.fd = socket(push.router.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (push.fd < 0) {
+            warning("RP socket");
+            disconnect_router();
+            return false;
+        }
+        debug("RP connecting to %s", push.name);
+        if (connect(push.fd, (struct sockaddr *) &(push.router), push.router_size) == 0) {
+            return connected_to_router();
+        }
+        if (errno != EINPROGRESS) {
+            debug("RP connect to %s: %s", push.name, strerror(errno));
+            disconnect_router();
+        }
+        return false;
+    }
+
+    struct pollfd pfd = { .fd = push.fd, .events = POLLOUT };
+    if (poll(&pfd, 1, 0) <= 0) {
+        return false;
+    }
+    int socket_error = 0;
+    socklen_t size = sizeof socket_error;
+    if (getsockopt(push.fd, SOL_SOCKET, SO_ERROR, &socket_error, &size) < 0) {
+        socket_error = errno;
+    }
+    if (socket_error) {
+        debug("RP connect to %s: %s", push.name, strerror(socket_error));
+        disconnect_router();
+        return false;
+    }
+    return connected_to_router();
+}
+
+/// Returns `false` if the router has closed the connection.
+static bool
+router_open(void) {
+    char buf[64];
+    for (;;) {
+        const ssize_t received = recv(push.fd, buf, sizeof buf, MSG_DONTWAIT);
+        if (received > 0) {
+            continue;
+        }
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        return received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+}
+
+/// Handle the expiry of `push.timer_fd`.
+static void
+handle_push_timer(void) {
+    uint64_t expirations;
+    if (read(push.timer_fd, &expirations, sizeof expirations) < 0
+        && errno != EAGAIN && errno != EWOULDBLOCK) {
+        warning("RP timer");
+    }
+
+    if (!push.connected && !connect_router()) {
+        return;
+    }
+    if (!router_open()) {
+        notice("Replica to %s closed", push.name);
+        disconnect_router();
+        return;
+    }
+
+    // Dump only once the router has received the previous changes, so that
+    // the output does not grow while the router is not keeping up
+    flush_output();
+    if (push.length) {
+        debug("RP %s still receiving, postponing the dump", push.name);
+    } else {
+        publish_changes();
+        flush_output();
+    }
+
+    if (push.failed) {
+        disconnect_router();
+    }
+}
+
+bool
+enable_replica_push(const char * const address, const char * const fixed_result) {
+    if (push.timer_fd >= 0) {
+        return true;
+    }
+    if (fixed_result) {
+        switch (*fixed_result) {
+        case '\0':
+        case '*':
+        case '!':
+        case '?':
+            // The router must forward to get the error (or no answer)
+            notice("Replicas not pushed with option -f '%s'", fixed_result);
+            return true;
+        default:
+            push.fixed_username = fixed_result;
+            break;
+        }
+    }
+
+    char port[8];
+    (void) snprintf(port, sizeof port, "%u", replica_port);
+
+    struct addrinfo *router = NULL;
+    const struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_NUMERICHOST | AI_NUMERICSERV
+    };
+    const int error_result = getaddrinfo(address, port, &hints, &router);
+    if (error_result) {
+        notice("Replica to %s: %s", address, gai_strerror(error_result));
+        return false;
+    }
+    (void) memcpy(&(push.router), router->ai_addr, router->ai_addrlen);
+    push.router_size = router->ai_addrlen;
+    freeaddrinfo(router);
+    (void) snprintf(push.name, sizeof push.name, "%s", address);
+
+    if (!table_init(&published)) {
+        return false;
+    }
+
+    if ((push.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        warning("RP timerfd_create");
+        return false;
+    }
+    const struct itimerspec interval = {
+        .it_interval = { .tv_sec = 0, .tv_nsec = REPLICA_INTERVAL_MS * 1000000L },
+        .it_value = { .tv_sec = 0, .tv_nsec = 1000000L }
+    };
+    if (timerfd_settime(push.timer_fd, 0, &interval, NULL) < 0
+        || !watch_input(push.timer_fd, handle_push_timer)) {
+        warning("RP timer");
+        (void) close(push.timer_fd);
+        push.timer_fd = -1;
+        return false;
+    }
+
+    return true;
+}
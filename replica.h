@@ -0,0 +1,54 @@
+/*
+ * replica.h: Replicating the owners of connections from hosts behind NAT.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#ifndef AIDENTD_REPLICA_H
+#define AIDENTD_REPLICA_H
+
+#include "aidentd.h"
+#include "conntrack.h"
+
+#include <stdbool.h>
+
+/// The TCP port on which the router accepts replicas, and to which hosts
+/// push them (option `-y`, default 1113).
+extern unsigned replica_port;
+
+/// The maximum number of networks from which replicas are accepted.
+#define REPLICA_NETWORKS 4
+
+/// Accept replicas of the owners of connections from hosts behind NAT
+/// (running with `enable_replica_push`) in the `count` networks named by
+/// `networks` (e.g., "192.168.1.0/24"), so that queries for their
+/// masqueraded connections can be answered by `replica_lookup` without
+/// forwarding. The replicas are accepted on port `replica_port` of the
+/// local address in each network (i.e., on the LAN side of the router),
+/// and only from hosts in these networks. Each host can only replicate the
+/// connections from the address it connects from, and its replicas are
+/// discarded when it disconnects. The replicas are serviced by the event
+/// loop of `serve_connections`, and are only available in this process.
+/// Returns `true` on success.
+bool enable_replica_server(const char * const networks[], const int count);
+
+/// Push the owners of the connections from this host to the router at the
+/// numeric `address` port `replica_port`: the whole table on connecting,
+/// and then only the changes, as found by dumping the local connections
+/// periodically from the event loop of `serve_connections` (but not while
+/// the router is still receiving the previous changes). Only the
+/// connections from the address used to connect to the router are pushed.
+/// If `fixed_result` is not `NULL`, it is the fixed response to local
+/// queries (option `-f`): a fixed username is pushed as the owner of every
+/// connection, and for the error responses nothing is pushed, so that the
+/// router forwards the queries to this host.
+/// Returns `true` on success (the router need not be reachable yet).
+bool enable_replica_push(const char * const address, const char * const fixed_result);
+
+/// Returns the username replicated for the masqueraded connection `entry`
+/// (as found by `conntrack_lookup`), or `NULL` if there is none. Any
+/// returned username must be freed with `free`.
+char *replica_lookup(const conntrack_entry * const entry);
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * test.c: Tests for forwarding a query to several hosts at once.
+ * aidentd
+ *
+ * The tested functions are internal to their modules, so the modules are
+ * included here directly rather than linked. The hosts are simulated by
+ * child processes on loopback addresses. Run with `make test`.
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#define main aidentd_main
+#include "aidentd.c"
+#undef main
+
+#include "forwarding.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define TEST_HOSTS 2
+
+/// The loopback addresses of the simulated hosts.
+static const char * const host_addresses[TEST_HOSTS] = { "127.0.0.2", "127.0.0.3" };
+
+/// The listening sockets of the simulated hosts, all on `ident_port`.
+static int host_fds[TEST_HOSTS];
+
+static int failures = 0;
+
+/// Listen on `address` port `ident_port` (or any port if it is 0, setting
+/// `ident_port`). Returns the socket, or -1 on error.
+static int
+listen_on(const char * const address) {
+    struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = htons((uint16_t) ident_port) };
+    socklen_t size = sizeof sin;
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || inet_pton(AF_INET, address, &sin.sin_addr) != 1
+        || bind(fd, (struct sockaddr *) &sin, sizeof sin) < 0 || listen(fd, 8) < 0
+        || getsockname(fd, (struct sockaddr *) &sin, &size) < 0) {
+        perror(address);
+        if (fd >= 0) {
+            (void) close(fd);
+        }
+        return -1;
+    }
+    ident_port = ntohs(sin.sin_port);
+    return fd;
+}
+
+/// Answer one query on `fd` with the error `response` after `delay_ms`.
+/// Returns the pid of the process answering.
+static pid_t
+answer_after(const int fd, const char * const response, const long delay_ms) {
+    const pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    const int client_fd = accept(fd, NULL, NULL);
+    char buf[FORWARD_LINE_SIZE];
+    if (client_fd < 0 || recv(client_fd, buf, sizeof buf, 0) <= 0) {
+        _exit(EXIT_FAILURE);
+    }
+    const struct timespec delay = { delay_ms / 1000, (delay_ms % 1000) * 1000000L };
+    (void) nanosleep(&delay, NULL);
+    const int length = snprintf(buf, sizeof buf, "40000,6667:ERROR:%s\r\n", response);
+    (void) send(client_fd, buf, (size_t) length, MSG_NOSIGNAL);
+    (void) close(client_fd);
+    _exit(EXIT_SUCCESS);
+}
+
+/// Forward a query to both hosts, which answer with `responses` after
+/// `delays_ms` respectively, and check that the error is `expected`.
+static void
+test_errors(const char * const responses[TEST_HOSTS], const long delays_ms[TEST_HOSTS],
+            const char * const expected) {
+    ident_query queries[TEST_HOSTS];
+    pid_t pids[TEST_HOSTS];
+    for (int i = 0; i < TEST_HOSTS; ++i) {
+        queries[i] = (ident_query) { .local_port = 40000, .remote_port = 6667 };
+        pids[i] = answer_after(host_fds[i], responses[i], delays_ms[i]);
+    }
+
+    char * const username = forward_queries(queries, host_addresses, TEST_HOSTS);
+    const char * const result = additional_info ? additional_info : "(none)";
+    const bool passed = !username && strcmp(result, expected) == 0;
+    (void) printf("%s: %s after %ld ms, %s after %ld ms -> %s\n",
+                  passed ? "PASS" : "FAIL",
+                  responses[0], delays_ms[0], responses[1], delays_ms[1], result);
+    if (!passed) {
+        ++failures;
+    }
+
+    free(username);
+    clean_up_forwarding();
+    for (int i = 0; i < TEST_HOSTS; ++i) {
+        (void) waitpid(pids[i], NULL, 0);
+    }
+}
+
+int
+main(void) {
+    verbosity = 0;
+    open_log("aidentd_test", false);
+
+    ident_port = 0;
+    for (int i = 0; i < TEST_HOSTS; ++i) {
+        if ((host_fds[i] = listen_on(host_addresses[i])) < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    // The error must not depend on which host answers last
+    const long first_fast[TEST_HOSTS] = { 0, 100 };
+    const long second_fast[TEST_HOSTS] = { 100, 0 };
+
+    test_errors((const char *[]) { "NO-USER", "HIDDEN-USER" }, first_fast, "HIDDEN-USER");
+    test_errors((const char *[]) { "NO-USER", "HIDDEN-USER" }, second_fast, "HIDDEN-USER");
+    test_errors((const char *[]) { "HIDDEN-USER", "NO-USER" }, first_fast, "HIDDEN-USER");
+    test_errors((const char *[]) { "HIDDEN-USER", "NO-USER" }, second_fast, "HIDDEN-USER");
+    test_errors((const char *[]) { "UNKNOWN-ERROR", "NO-USER" }, second_fast, "UNKNOWN-ERROR");
+    test_errors((const char *[]) { "NO-USER", "UNKNOWN-ERROR" }, first_fast, "UNKNOWN-ERROR");
+    test_errors((const char *[]) { "INVALID-PORT", "UNKNOWN-ERROR" }, first_fast, "INVALID-PORT");
+    test_errors((const char *[]) { "INVALID-PORT", "UNKNOWN-ERROR" }, second_fast, "INVALID-PORT");
+    test_errors((const char *[]) { "NO-USER", "NO-USER" }, second_fast, "NO-USER");
+
+    for (int i = 0; i < TEST_HOSTS; ++i) {
+        (void) close(host_fds[i]);
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,217 @@
+/*
+ * uring.c: Minimal io_uring interface for the event loop.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#include "uring.h"
+
+#ifndef NO_IO_URING
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/// The io_uring instance.
+static int ring_fd = -1;
+
+/// The submission queue.
+static struct {
+    unsigned *head;
+    unsigned *tail;
+    unsigned *array;
+    unsigned mask;
+    unsigned entries;
+    unsigned local_tail;
+    struct io_uring_sqe *entry;
+} sq;
+
+/// The completion queue.
+static struct {
+    unsigned *head;
+    unsigned *tail;
+    unsigned mask;
+    struct io_uring_cqe *entry;
+} cq;
+
+static int
+io_uring_setup(const unsigned entries, struct io_uring_params * const params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+io_uring_enter(const unsigned to_submit, const unsigned min_complete, const unsigned flags,
+               const void * const arg, const size_t argsize) {
+    return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, argsize);
+}
+
+/// Submit the new entries to the kernel, and wait for `min_complete`
+/// completions with the arguments `arg`. Returns `false` on error.
+static bool
+enter(const unsigned min_complete, const unsigned flags, const void * const arg,
+      const size_t argsize) {
+    __atomic_store_n(sq.tail, sq.local_tail, __ATOMIC_RELEASE);
+
+    const unsigned to_submit = sq.local_tail - __atomic_load_n(sq.head, __ATOMIC_ACQUIRE);
+    if (io_uring_enter(to_submit, min_complete, flags, arg, argsize) < 0) {
+        if (errno == EINTR || errno == ETIME || errno == EBUSY || errno == EAGAIN) {
+            // Interrupted, timed out, or completions need to be reaped first
+            return true;
+        }
+        return false;
+    }
+    return true;
+}
+
+bool
+uring_open(const unsigned entries, const unsigned cq_entries) {
+    if (ring_fd >= 0) {
+        return true;
+    }
+
+    struct io_uring_params params;
+    (void) memset(&params, 0, sizeof params);
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = cq_entries;
+
+    int fd = io_uring_setup(entries, &params);
+    if (fd < 0 && errno == EINVAL) {
+        // Older kernels do not support the optimizations for a single thread
+        (void) memset(&params, 0, sizeof params);
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = cq_entries;
+        fd = io_uring_setup(entries, &params);
+    }
+    if (fd < 0) {
+        debug("LS io_uring_setup: %s", strerror(errno));
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        debug("LS io_uring does not support timeouts");
+        (void) close(fd);
+        return false;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && cq_size > sq_size) {
+        sq_size = cq_size;
+    }
+
+    unsigned char * const sq_ring = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        debug("LS io_uring mmap: %s", strerror(errno));
+        (void) close(fd);
+        return false;
+    }
+
+    unsigned char *cq_ring = sq_ring;
+    if (!single_mmap) {
+        cq_ring = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            debug("LS io_uring mmap: %s", strerror(errno));
+            (void) munmap(sq_ring, sq_size);
+            (void) close(fd);
+            return false;
+        }
+    }
+
+    void * const sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        debug("LS io_uring mmap: %s", strerror(errno));
+        if (!single_mmap) {
+            (void) munmap(cq_ring, cq_size);
+        }
+        (void) munmap(sq_ring, sq_size);
+        (void) close(fd);
+        return false;
+    }
+
+    sq.head = (unsigned *) (sq_ring + params.sq_off.head);
+    sq.tail = (unsigned *) (sq_ring + params.sq_off.tail);
+    sq.array = (unsigned *) (sq_ring + params.sq_off.array);
+    sq.mask = *(unsigned *) (sq_ring + params.sq_off.ring_mask);
+    sq.entries = params.sq_entries;
+    sq.local_tail = *sq.tail;
+    sq.entry = sqes;
+
+    cq.head = (unsigned *) (cq_ring + params.cq_off.head);
+    cq.tail = (unsigned *) (cq_ring + params.cq_off.tail);
+    cq.mask = *(unsigned *) (cq_ring + params.cq_off.ring_mask);
+    cq.entry = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+
+    ring_fd = fd;
+
+    debug("LS io_uring with %u+%u entries", params.sq_entries, params.cq_entries);
+
+    return true;
+}
+
+struct io_uring_sqe *
+uring_sqe(void) {
+    if (sq.local_tail - __atomic_load_n(sq.head, __ATOMIC_ACQUIRE) >= sq.entries) {
+        // Submit the full queue without waiting
+        if (!enter(0, 0, NULL, 0)
+            || sq.local_tail - __atomic_load_n(sq.head, __ATOMIC_ACQUIRE) >= sq.entries) {
+            return NULL;
+        }
+    }
+
+    const unsigned index = sq.local_tail & sq.mask;
+    struct io_uring_sqe * const sqe = &sq.entry[index];
+    (void) memset(sqe, 0, sizeof *sqe);
+    sq.array[index] = index;
+    ++sq.local_tail;
+
+    return sqe;
+}
+
+bool
+uring_wait(const int timeout) {
+    if (__atomic_load_n(cq.tail, __ATOMIC_ACQUIRE) != *cq.head) {
+        // Completions are already available, only submit
+        return enter(0, IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+
+    if (timeout < 0) {
+        return enter(1, IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout / 1000,
+        .tv_nsec = (long long) (timeout % 1000) * 1000000
+    };
+    struct io_uring_getevents_arg arg = {
+        .ts = (uint64_t) (uintptr_t) &ts
+    };
+    return enter(1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+}
+
+bool
+uring_completion(uint64_t * const user_data, int32_t * const result) {
+    const unsigned head = *cq.head;
+    if (head == __atomic_load_n(cq.tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    const struct io_uring_cqe * const cqe = &cq.entry[head & cq.mask];
+    *user_data = cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(cq.head, head + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,41 @@
+/*
+ * uring.h: Minimal io_uring interface for the event loop.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#ifndef AIDENTD_URING_H
+#define AIDENTD_URING_H
+
+#include "aidentd.h"
+
+#ifndef NO_IO_URING
+
+#include <linux/io_uring.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Set up the io_uring instance of this process with room for `entries`
+/// submissions and `cq_entries` completions. The kernel must support
+/// waiting with a timeout (Linux 5.11 or later). Returns `true` on success.
+bool uring_open(const unsigned entries, const unsigned cq_entries);
+
+/// Returns the next free submission queue entry (cleared to zero), or `NULL`
+/// if the queue is full and can not be submitted. The entry is submitted
+/// to the kernel on the next call to `uring_wait`.
+struct io_uring_sqe *uring_sqe(void);
+
+/// Submit any new entries to the kernel, and wait up to `timeout`
+/// milliseconds (or indefinitely if negative) for at least one completion.
+/// Returns `false` on error (other than being interrupted or timing out).
+bool uring_wait(const int timeout);
+
+/// Take the next completion from the queue. Returns `false` if there are
+/// no completions pending.
+bool uring_completion(uint64_t * const user_data, int32_t * const result);
+
+#endif
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * usercache.c: Caching usernames of local users.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#include "usercache.h"
+
+#include <pwd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define USER_CACHE_SIZE 256 // must be a power of 2
+#define USER_CACHE_TTL 600 // seconds
+#define USER_CACHE_NEGATIVE_TTL 60 // seconds
+
+/// Files whose change invalidates the cache.
+static const char * const user_database_files[] = {
+    "/etc/passwd",
+    "/var/lib/sss/mc/passwd",
+    "/var/cache/nscd/passwd"
+};
+
+#define USER_DATABASE_FILE_COUNT (sizeof user_database_files / sizeof *user_database_files)
+
+/// A cached username.
+typedef struct user_cache_entry {
+    /// The username, or `NULL` for a negative entry.
+    char *name;
+    /// The time after which the entry is no longer valid (0 if unused).
+    time_t expires;
+    uid_t uid;
+} user_cache_entry;
+
+/// The state of a user database file when last checked.
+typedef struct file_state {
+    struct timespec mtime;
+    ino_t inode;
+    off_t size;
+    bool exists;
+} file_state;
+
+static bool cache_enabled = false;
+
+/// The cache, indexed by the hash of the uid. Colliding entries replace
+/// each other, which keeps the size bounded.
+static user_cache_entry cache[USER_CACHE_SIZE];
+
+static file_state database_state[USER_DATABASE_FILE_COUNT];
+
+/// The time the files were last checked for changes.
+static time_t last_checked = 0;
+
+/// Get the state of `file` into `state`.
+static void
+get_file_state(const char * const file, file_state * const state) {
+    struct stat st;
+    (void) memset(state, 0, sizeof *state);
+    if (stat(file, &st) == 0) {
+        state->exists = true;
+        state->mtime = st.st_mtim;
+        state->inode = st.st_ino;
+        state->size = st.st_size;
+    }
+}
+
+/// Remove all entries from the cache.
+static void
+flush_cache(void) {
+    for (unsigned i = 0; i < USER_CACHE_SIZE; ++i) {
+        free(cache[i].name);
+        cache[i].name = NULL;
+        cache[i].expires = 0;
+    }
+}
+
+/// Check the user database files for changes (at most once per second),
+/// and flush the cache if any have changed.
+static void
+check_for_changes(const time_t now) {
+    if (now == last_checked) {
+        return;
+    }
+    last_checked = now;
+
+    bool changed = false;
+    for (unsigned i = 0; i < USER_DATABASE_FILE_COUNT; ++i) {
+        file_state state;
+        get_file_state(user_database_files[i], &state);
+        if (memcmp(&state, &database_state[i], sizeof state)) {
+            database_state[i] = state;
+            changed = true;
+        }
+    }
+
+    if (changed) {
+        debug("UC user database changed, flushing cache");
+        flush_cache();
+    }
+}
+
+/// Returns the cache slot for `uid`.
+static user_cache_entry *
+cache_slot(const uid_t uid) {
+    uint32_t hash = (uint32_t) uid;
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3bU;
+    hash ^= hash >> 16;
+    return &cache[hash & (USER_CACHE_SIZE - 1)];
+}
+
+/// Look up the username for `uid` from the user database.
+static char *
+lookup_username(const uid_t uid) {
+    errno = 0;
+    struct passwd * const uid_info = getpwuid(uid);
+    if (!(uid_info && uid_info->pw_name)) {
+        return NULL;
+    }
+    char * const username = strdup(uid_info->pw_name);
+    if (!username) {
+        error("strdup");
+    }
+    return username;
+}
+
+void
+enable_user_cache(void) {
+    for (unsigned i = 0; i < USER_DATABASE_FILE_COUNT; ++i) {
+        get_file_state(user_database_files[i], &database_state[i]);
+    }
+    last_checked = monotonic_time();
+    cache_enabled = true;
+}
+
+char *
+username_for_uid(const uid_t uid) {
+    if (!cache_enabled) {
+        return lookup_username(uid);
+    }
+
+    const time_t now = monotonic_time();
+    check_for_changes(now);
+
+    user_cache_entry * const entry = cache_slot(uid);
+    if (entry->expires > now && entry->uid == uid) {
+        debug("UC cached user %u: %s", (unsigned) uid, entry->name ? entry->name : "(none)");
+        if (!entry->name) {
+            return NULL;
+        }
+        char * const username = strdup(entry->name);
+        if (!username) {
+            error("strdup");
+        }
+        return username;
+    }
+
+    char * const username = lookup_username(uid);
+    if (!username && !(errno == 0 || errno == ENOENT || errno == ESRCH)) {
+        // Do not cache failure of the lookup itself
+        debug("UC lookup of user %u failed: %s", (unsigned) uid, strerror(errno));
+        return NULL;
+    }
+
+    block_timeout();
+    free(entry->name);
+    entry->name = NULL;
+    entry->uid = uid;
+    entry->expires = 0;
+    if (username) {
+        entry->name = strdup(username);
+    }
+    if (entry->name || !username) {
+        entry->expires = now + (username ? USER_CACHE_TTL : USER_CACHE_NEGATIVE_TTL);
+    }
+    unblock_timeout();
+
+    return username;
+}
@@ -0,0 +1,26 @@
+/*
+ * usercache.h: Caching usernames of local users.
+ * aidentd
+ *
+ * Copyright (c) 2018 Kimmo Kulovesi, https://arkku.com
+ */
+
+#ifndef AIDENTD_USERCACHE_H
+#define AIDENTD_USERCACHE_H
+
+#include "aidentd.h"
+
+#include <sys/types.h>
+
+/// Enable caching of usernames. This is only useful for long-running
+/// processes, since the cache is per-process. Entries (including negative
+/// ones for uids without a name) are invalidated when the user database
+/// files (`/etc/passwd` and the caches of `sssd` and `nscd`) change,
+/// or when they expire.
+void enable_user_cache(void);
+
+/// Returns the username for `uid`, or `NULL` if there is no such user.
+/// The returned username must be freed with `free`.
+char *username_for_uid(const uid_t uid);
+
+#endif